@@ -13,8 +13,45 @@
 #define P_NODE_DATA_TYPE ((uint8_t) 2)
 
 
+/* Morton (or Hilbert) keys, compared from the most significant bit (position 1) down */
+#ifdef HILBERT_KEY_ON
+#if (defined KEY_128_BIT_ON) || NR_DIMENSION > 10
+#error "HILBERT_KEY_ON needs 64-bit keys and NR_DIMENSION <= 10"
+#endif
+#endif
+#ifdef KEY_128_BIT_ON
+#if NR_DIMENSION != 3
+#error "KEY_128_BIT_ON needs NR_DIMENSION == 3"
+#endif
+typedef struct key128 {
+    uint64_t hi;
+    uint64_t lo;
+} key128;
+#define KEY_TYPE key128
+#define KEY_BITS (128)
+#define KEY_WORDS (2)  // 64-bit words per key
+#else
+#define KEY_TYPE uint64_t
+#define KEY_BITS (64)
+#define KEY_WORDS (1)
+#endif
+
+/* Point payloads, stored after the vectors in P nodes, tasks and replies */
+#ifdef POINT_PAYLOAD_ON
+#define PAYLOAD_TYPE uint64_t
+#define PAYLOAD_WORDS (1)  // 64-bit words per payload
+#define PAYLOAD_ARG(x) , x  // Extra parameter or argument, dropped when payloads are off
+#else
+#define PAYLOAD_WORDS (0)
+#define PAYLOAD_ARG(x)
+#endif
+
 /* Macros for node heights */
+#ifdef KEY_128_BIT_ON
+#define INT_HEIGHT int16_t
+#else
 #define INT_HEIGHT int8_t
+#endif
 #define INVALID_NODE_HEIGHT ((INT_HEIGHT) -2)
 #define ROOT_NODE_HEIGHT ((INT_HEIGHT) 0)
 
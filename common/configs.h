@@ -5,8 +5,7 @@
 /* Size of the batch size */
 #define BATCH_SIZE (2100000)
 
-/* Maximum sizes of box range and kNN queries */
-#define MAX_RANGE_QUERY_SIZE (1000)
+/* Maximum size of kNN queries */
 #define MAX_KNN_SIZE (125)
 
 /* Size threshold of a leaf node in the tree */
@@ -19,6 +18,13 @@
 #define DB_SIZE_PLUS_ONE (17)  // DB_SIZE_PLUS_ONE = DB_SIZE + 1
 
 /* Coord <-----> Key */
+// 128-bit keys for 64-bit coordinates: 3D keys keep 42 bits of each coordinate instead of 21 (NR_DIMENSION == 3 only)
+// #define KEY_128_BIT_ON
+#ifdef KEY_128_BIT_ON
+#define COORD_MAX (INT64_MAX)
+#define KEY_START_POS (2)  // The first position where in coord start to convert into key [1, 64]
+#define KEY_START_POS_MINUS_ONE (1)  // KEY_START_POS_MINUS_ONE = KEY_START_POS - 1
+#else
 // 64-bit int
 // #define COORD_MAX (INT64_MAX)
 // #define KEY_START_POS (2)  // The first position where in coord start to convert into key [1, 64]
@@ -27,6 +33,19 @@
 #define COORD_MAX ((int64_t)INT32_MAX)
 #define KEY_START_POS (34)  // The first position where in coord start to convert into key [1, 64]
 #define KEY_START_POS_MINUS_ONE (33)  // KEY_START_POS_MINUS_ONE = KEY_START_POS - 1
+#endif
+// Order the keys along a Hilbert curve instead of the Morton curve (64-bit keys, NR_DIMENSION <= 10)
+// #define HILBERT_KEY_ON
+
+/* Store a 64-bit payload (e.g. a point id) with every point, returned by box fetch and kNN queries */
+// #define POINT_PAYLOAD_ON
+
+/*
+    Keep the coordinate sums and the tight bounding box of every subtree in the B nodes, for box aggregate queries.
+    Sums are int64_t per dimension: exact below 2^32 points with 31-bit coordinates, but they can wrap with
+    the 64-bit coordinates of KEY_128_BIT_ON, where only the counts and boxes stay exact.
+*/
+// #define BNODE_AGGREGATE_ON
 
 #define LX_NORM (1)
 
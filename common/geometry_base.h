@@ -8,7 +8,11 @@
 #define COORD int64_t
 #endif
 
+#ifdef KEY_128_BIT_ON
+#define INVALID_KEY ((key128){.hi = UINT64_MAX, .lo = UINT64_MAX})
+#else
 #define INVALID_KEY (UINT64_MAX)
+#endif
 #define INVALID_COORD (UINT64_MAX)
 
 #define GEOMETRY_MAX(x, y) (((x) < (y)) ? (y) : (x))
@@ -499,8 +503,61 @@ inline bool radius_contained_in_box_dpu(struct vector_ *v, COORD radius, struct
 
 #endif
 
+// Coordinate d of a vector, for loops over the dimensions
+#define VECTOR_COORD(v, d) (((COORD*)(v))[d])
+
 inline bool box_contain(vectorT *small_box_min, vectorT *small_box_max,
                         vectorT *large_box_min, vectorT *large_box_max) {
     return vector_in_box(small_box_min, large_box_min, large_box_max)
         && vector_in_box(small_box_max, large_box_min, large_box_max);
 }
+
+inline bool vector_equal(vectorT *v1, vectorT *v2) {
+    return vector_in_box(v1, v2, v2);
+}
+
+/* Distance from v to the closest point of the box, a lower bound for every point inside it */
+inline COORD box_distance(vectorT *v, vectorT *box_min, vectorT *box_max) {
+    vectorT closest = *v;
+    vector_max(box_min, &closest);
+    vector_min(box_max, &closest);
+    closest = vector_sub(v, &closest);
+    return vector_norm(&closest);
+}
+
+inline COORD box_distance_dpu(vectorT *v, vectorT *box_min, vectorT *box_max) {
+    vectorT closest = *v;
+    vector_max(box_min, &closest);
+    vector_min(box_max, &closest);
+    closest = vector_sub(v, &closest);
+    return vector_norm_dpu(&closest);
+}
+
+/* Add the distance along one more dimension to a partial norm, starting from 0. Partial norms never decrease. */
+inline COORD norm_accumulate(COORD acc, COORD diff) {
+#if LX_NORM == 0
+    return GEOMETRY_MAX(acc, diff);
+#elif LX_NORM == 1
+    if(diff >= INT64_MAX - acc) return INT64_MAX;
+    return acc + diff;
+#else
+    if(diff >= L2_NORM_MAX) return INT64_MAX;
+    diff = diff * diff;
+    if(diff >= INT64_MAX - acc) return INT64_MAX;
+    return acc + diff;
+#endif
+}
+
+inline COORD norm_accumulate_dpu(COORD acc, COORD diff) {
+#if LX_NORM == 0
+    return GEOMETRY_MAX(acc, diff);
+#elif LX_NORM == 1
+    if(diff >= INT64_MAX - acc) return INT64_MAX;
+    return acc + diff;
+#else
+    if(diff >= L2_NORM_MAX) return INT64_MAX;
+    diff = approx_square(diff);
+    if(diff >= INT64_MAX - acc) return INT64_MAX;
+    return acc + diff;
+#endif
+}
@@ -22,6 +22,7 @@ TASK(empty_task_reply, 0, true, 0, {})
 /* -------------------------- Switches to enable tasks -------------------------- */
 // #define DPU_INIT_ON
 // #define INSERT_NODE_ON
+// #define DELETE_NODE_ON
 // #define BOX_RANGE_COUNT_ON
 // #define BOX_RANGE_FETCH_ON
 // #define SEARCH_TEST_ON
@@ -33,7 +34,7 @@ TASK(empty_task_reply, 0, true, 0, {})
 
 #define SINGLE_SEARCH_TSK 101
 TASK(Single_search_task, 101, true, sizeof(Single_search_task), {
-    uint64_t key;
+    KEY_TYPE key;
 })
 
 #define SINGLE_SEARCH_REP 102
@@ -41,25 +42,106 @@ TASK(Single_search_reply, 102, true, sizeof(Single_search_reply), {
     pptr addr;
 })
 
+// Exact membership of a point, answered in one descent
+#define POINT_LOOKUP_TSK 121
+TASK(Point_lookup_task, 121, true, sizeof(Point_lookup_task), {
+    vectorT v;
+})
+
+#define POINT_LOOKUP_REP 122
+TASK(Point_lookup_reply, 122, true, sizeof(Point_lookup_reply), {
+    int64_t found;
+    uint64_t payload[PAYLOAD_WORDS];  // The payload of the stored copy when POINT_PAYLOAD_ON
+})
+
 #ifdef INSERT_NODE_ON
 #define SINGLE_INSERT_TSK 103
 TASK(Single_insert_task, 103, false, sizeof(Single_insert_task), {
+    pptr addr;
+    int64_t len;
+    vectorT v[];  // Followed by len payloads when POINT_PAYLOAD_ON
+})
+#define SINGLE_INSERT_TSK_SIZE(x) S64(2 + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
+
+// Insert below a B node from the host replica of the upper levels, without a search round
+#define SINGLE_INSERT_FROM_TSK 115
+TASK(Single_insert_from_task, 115, false, sizeof(Single_insert_from_task), {
+    pptr addr;
+    int64_t len;
+    vectorT v[];  // Followed by len payloads when POINT_PAYLOAD_ON
+})
+#define SINGLE_INSERT_FROM_TSK_SIZE(x) S64(2 + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
+
+// The B node in the task node's child slot after the insert, or null_pptr
+#define SINGLE_INSERT_FROM_REP 116
+TASK(Single_insert_from_reply, 116, true, sizeof(Single_insert_from_reply), {
+    pptr addr;
+    KEY_TYPE key;
+    int64_t height;
+})
+#endif
+
+#ifdef DELETE_NODE_ON
+#define SINGLE_DELETE_TSK 111
+TASK(Single_delete_task, 111, false, sizeof(Single_delete_task), {
     pptr addr;
     int64_t len;
     vectorT v[];
 })
-#define SINGLE_INSERT_TSK_SIZE(x) S64(2 + MULTIPLY_NR_DIMENSION(x))
+#define SINGLE_DELETE_TSK_SIZE(x) S64(2 + MULTIPLY_NR_DIMENSION(x))
+
+#define SINGLE_DELETE_REP 112
+TASK(Single_delete_reply, 112, true, sizeof(Single_delete_reply), {
+    int64_t count;
+})
+
+#define DPU_COMPACT_TSK 113
+TASK(dpu_compact_task, 113, true, sizeof(dpu_compact_task), {
+    int64_t dpu_id;
+})
+#define DPU_COMPACT_REP 114
+TASK(dpu_compact_reply, 114, true, sizeof(dpu_compact_reply), {
+    int64_t bcnt;
+    int64_t pcnt;
+})
+
+// Repartitioning: sample keys to pick new borders, then export the points outside the new range
+#define DPU_SAMPLE_TSK 117
+TASK(dpu_sample_task, 117, true, sizeof(dpu_sample_task), {
+    int64_t sample_num;
+})
+#define DPU_SAMPLE_REP 118
+TASK(dpu_sample_reply, 118, false, sizeof(dpu_sample_reply), {
+    int64_t count;
+    int64_t len;
+    uint64_t keys[];  // Leading 64 bits of the keys
+})
+#define DPU_SAMPLE_REP_SIZE(x) S64(2 + (x))
+
+#define DPU_EXPORT_TSK 119
+TASK(dpu_export_task, 119, true, sizeof(dpu_export_task), {
+    uint64_t range_start;
+    uint64_t range_end;
+    int64_t limit;
+})
+#define DPU_EXPORT_REP 120
+TASK(dpu_export_reply, 120, false, sizeof(dpu_export_reply), {
+    int64_t len;
+    vectorT v[];  // Followed by the payloads when POINT_PAYLOAD_ON
+})
+#define DPU_EXPORT_REP_SIZE(x) S64(1 + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
+#define DPU_EXPORT_MAX_LEN (16384)
 #endif
 
 #ifdef SEARCH_TEST_ON
 #define SINGLE_KEY_SEARCH_TSK 104
 TASK(Single_key_search_task, 104, true, sizeof(Single_key_search_task), {
-    uint64_t key;
+    KEY_TYPE key;
 })
 
 #define SINGLE_KEY_SEARCH_REP 105
 TASK(Single_key_search_reply, 105, true, sizeof(Single_key_search_reply), {
-    uint64_t key;
+    KEY_TYPE key;
 })
 #endif
 
@@ -69,7 +151,7 @@ TASK(Single_key_search_reply, 105, true, sizeof(Single_key_search_reply), {
 #ifdef FETCH_NODE_ON
 #define FETCH_NODE_W_KEY_TSK 106
 TASK(Fetch_node_w_key_task, 106, true, sizeof(Fetch_node_w_key_task), {
-    uint64_t key;
+    KEY_TYPE key;
 })
 #define FETCH_NODE_W_PPTR_TSK 107
 TASK(Fetch_node_w_pptr_task, 107, true, sizeof(Fetch_node_w_pptr_task), {
@@ -79,10 +161,10 @@ TASK(Fetch_node_w_pptr_task, 107, true, sizeof(Fetch_node_w_pptr_task), {
 TASK(Fetch_node_reply, 108, true, sizeof(Fetch_node_reply), {
     pptr addr;
     pptr parent;
-    uint64_t key;
+    KEY_TYPE key;
     int64_t height;
     int64_t len;
-    uint64_t keys[LEAF_SIZE];
+    KEY_TYPE keys[LEAF_SIZE];
 })
 #endif
 
@@ -95,6 +177,10 @@ TASK(dpu_storage_stat_task, 109, true, sizeof(dpu_storage_stat_task), {
 TASK(dpu_storage_stat_reply, 110, true, sizeof(dpu_storage_stat_reply), {
     int64_t bcnt;
     int64_t pcnt;
+    int64_t bfree;
+    int64_t pfree;
+    int64_t bslab_unused;
+    int64_t pslab_unused;
 })
 #endif
 
@@ -114,6 +200,48 @@ TASK(Box_count_reply, 202, true, sizeof(Box_count_reply), {
     uint64_t count;
 })
 
+// Points within distance radius of center, with the radius in vector_norm units (squared for L2). Replies with Box_count_reply.
+#define BALL_COUNT_TSK 205
+TASK(Ball_count_task, 205, true, sizeof(Ball_count_task), {
+    vectorT center;
+    int64_t radius;
+})
+
+/*
+    Approximate count: nodes partially inside the box are expanded while fewer than budget nodes were expanded
+    and their depth is below max_depth (no depth limit if max_depth <= 0), the others are estimated by volume.
+*/
+#define BOX_COUNT_APPROX_TSK 211
+TASK(Box_count_approx_task, 211, true, sizeof(Box_count_approx_task), {
+    vectorT vec_min;
+    vectorT vec_max;
+    int32_t budget;
+    int32_t max_depth;
+})
+
+// count is the estimate, and the exact count lies in [lower, upper]
+#define BOX_COUNT_APPROX_REP 212
+TASK(Box_count_approx_reply, 212, true, sizeof(Box_count_approx_reply), {
+    uint64_t count;
+    uint64_t lower;
+    uint64_t upper;
+})
+
+#define BOX_AGGREGATE_TSK 209
+TASK(Box_aggregate_task, 209, true, sizeof(Box_aggregate_task), {
+    vectorT vec_min;
+    vectorT vec_max;
+})
+
+// Coordinate sums and tight bounding box of the points in the box, box_min > box_max if there are none
+#define BOX_AGGREGATE_REP 210
+TASK(Box_aggregate_reply, 210, true, sizeof(Box_aggregate_reply), {
+    int64_t count;
+    vectorT sum;
+    vectorT box_min;
+    vectorT box_max;
+})
+
 #endif
 
 #ifdef BOX_RANGE_FETCH_ON
@@ -127,9 +255,34 @@ TASK(Box_fetch_task, 203, true, sizeof(Box_fetch_task), {
 #define BOX_FETCH_REP 204
 TASK(Box_fetch_reply, 204, false, sizeof(Box_fetch_reply), {
     int64_t len;
-    vectorT v[];
+    vectorT v[];  // Followed by the payloads when POINT_PAYLOAD_ON
+})
+#define BOX_FETCH_REP_SIZE(x) S64(1 + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
+
+// Replies with Box_fetch_reply
+#define BALL_FETCH_TSK 206
+TASK(Ball_fetch_task, 206, true, sizeof(Ball_fetch_task), {
+    vectorT center;
+    int64_t radius;
 })
-#define BOX_FETCH_REP_SIZE(x) S64(1 + MULTIPLY_NR_DIMENSION(x))
+
+// Fetch at most limit points with keys up to cursor, to be resumed from the cursor of the reply while more is set
+#define BOX_FETCH_STREAM_TSK 207
+TASK(Box_fetch_stream_task, 207, true, sizeof(Box_fetch_stream_task), {
+    vectorT vec_min;
+    vectorT vec_max;
+    KEY_TYPE cursor;
+    int64_t limit;
+})
+
+#define BOX_FETCH_STREAM_REP 208
+TASK(Box_fetch_stream_reply, 208, false, sizeof(Box_fetch_stream_reply), {
+    int64_t len;
+    int64_t more;
+    KEY_TYPE cursor;
+    vectorT v[];  // Followed by the payloads when POINT_PAYLOAD_ON
+})
+#define BOX_FETCH_STREAM_REP_SIZE(x) S64(2 + KEY_WORDS + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
 
 #endif
 
@@ -147,9 +300,9 @@ TASK(knn_task, 301, true, sizeof(knn_task), {
 #define KNN_REP 302
 TASK(knn_reply, 302, false, sizeof(knn_reply), {
     int64_t len;
-    vectorT v[];
+    vectorT v[];  // Followed by the payloads when POINT_PAYLOAD_ON
 })
-#define KNN_REP_SIZE(x) S64(1 + MULTIPLY_NR_DIMENSION(x))
+#define KNN_REP_SIZE(x) S64(1 + MULTIPLY_NR_DIMENSION(x) + PAYLOAD_WORDS * (x))
 
 #define KNN_BOUNDED_TSK 303
 TASK(knn_bounded_task, 303, true, sizeof(knn_bounded_task), {
@@ -5,6 +5,9 @@
 #include "macro_common.h"
 #include "common.h"
 #include "geometry_base.h"
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 // Takes in an integer and a position in said integer and returns whether the bit at that position is 0 or 1 (range [1, 64])
 static inline bool lookup_bit(uint64_t interleave_integer, INT_HEIGHT pos){
@@ -25,43 +28,126 @@ static inline INT_HEIGHT prune_height(INT_HEIGHT height) {
     return ((height >> DB_SIZE_LOG_LOG) << DB_SIZE_LOG_LOG);
 }
 
-// Return the 4 bits in the next group of pos (range [1, 64])
-static inline int lookup_next_bit_chunk(uint64_t interleave_integer, INT_HEIGHT pos) {
-    // group_idx = (pos >> DB_SIZE_LOG_LOG);
-    // Needs to fetch [group_idx*DB_SIZE_LOG+1, group_idx*DB_SIZE_LOG+DB_SIZE_LOG]
-    if(pos > 64 - DB_SIZE_LOG) return interleave_integer & (uint64_t)(DB_SIZE - 1);
-    return (interleave_integer >> (64 - DB_SIZE_LOG - prune_height(pos))) & (uint64_t)(DB_SIZE - 1);
+/* Key operations. Keys are read as 32-bit words, which the DPU ALU handles natively. */
+
+#ifdef KEY_128_BIT_ON
+#define KEY_ZERO ((key128){.hi = 0, .lo = 0})
+
+static inline bool key_equal(key128 key1, key128 key2) {
+    return key1.hi == key2.hi && key1.lo == key2.lo;
+}
+
+static inline bool key_less(key128 key1, key128 key2) {
+    return key1.hi < key2.hi || (key1.hi == key2.hi && key1.lo < key2.lo);
+}
+
+// The 32-bit word idx of the key, 0 being the most significant
+static inline uint32_t key_word(key128 key, int idx) {
+    uint64_t word = (idx < 2 ? key.hi : key.lo);
+    return (idx & 1) ? (uint32_t)word : (uint32_t)(word >> 32);
+}
+
+// The leading 64 bits, on which the host partitions the key space among the DPUs
+static inline uint64_t key_prefix(key128 key) {
+    return key.hi;
+}
+
+// The smallest key with the given leading 64 bits
+static inline key128 key_from_prefix(uint64_t prefix) {
+    return (key128){.hi = prefix, .lo = 0};
+}
+#else
+#define KEY_ZERO ((uint64_t)0)
+
+static inline bool key_equal(uint64_t key1, uint64_t key2) {
+    return key1 == key2;
+}
+
+static inline bool key_less(uint64_t key1, uint64_t key2) {
+    return key1 < key2;
+}
+
+// The 32-bit word idx of the key, 0 being the most significant
+static inline uint32_t key_word(uint64_t key, int idx) {
+    return (idx & 1) ? (uint32_t)key : (uint32_t)(key >> 32);
+}
+
+// The leading 64 bits, on which the host partitions the key space among the DPUs
+static inline uint64_t key_prefix(uint64_t key) {
+    return key;
+}
+
+// The smallest key with the given leading 64 bits
+static inline uint64_t key_from_prefix(uint64_t prefix) {
+    return prefix;
+}
+#endif
+
+// Return the 4 bits in the next group of pos (range [1, KEY_BITS])
+static inline int lookup_next_bit_chunk(KEY_TYPE interleave_integer, INT_HEIGHT pos) {
+    // Fetch [p + 1, p + DB_SIZE_LOG] with p = prune_height(pos), which never crosses a 32-bit word
+    int p = (pos > KEY_BITS - DB_SIZE_LOG ? KEY_BITS - DB_SIZE_LOG : prune_height(pos));
+    return (key_word(interleave_integer, p >> 5) >> (32 - DB_SIZE_LOG - (p & 31))) & (uint32_t)(DB_SIZE - 1);
 }
 
 /*
     Check the maximum leading bits that matches between two keys.
-    Pruned with blocks of 4 bits.
+    Precise heights returned, not pruned with 4-bit blocks.
 */
-static inline INT_HEIGHT maximum_match_height(uint64_t key1, uint64_t key2) {
-    if(key1 == key2) return 64;
-    else return prune_height(__builtin_clzll(key1 ^ key2));
+static inline INT_HEIGHT maximum_match_height_precise(KEY_TYPE key1, KEY_TYPE key2) {
+    uint32_t diff;
+    for(int i = 0; i < (KEY_WORDS << 1); i++) {
+        diff = key_word(key1, i) ^ key_word(key2, i);
+        if(diff != 0) return (i << 5) + __builtin_clz(diff);
+    }
+    return KEY_BITS;
 }
 
 /*
     Check the maximum leading bits that matches between two keys.
-    Precise heights returned, not pruned with 4-bit blocks.
+    Pruned with blocks of 4 bits.
 */
-static inline INT_HEIGHT maximum_match_height_precise(uint64_t key1, uint64_t key2) {
-    if(key1 == key2) return 64;
-    else return __builtin_clzll(key1 ^ key2);
+static inline INT_HEIGHT maximum_match_height(KEY_TYPE key1, KEY_TYPE key2) {
+    return prune_height(maximum_match_height_precise(key1, key2));
 }
 
-// Check whether two integers match for bits leq pos (range [1, 64])
-static inline bool check_match_height(uint64_t key1, uint64_t key2, INT_HEIGHT pos) {
-    if(pos >= 64) return key1 == key2;
-    else if(pos == 0) return true;
-    else return ((key1 ^ key2) >> (64 - pos)) == (uint64_t)0;
+// Check whether two integers match for bits leq pos (range [1, KEY_BITS])
+static inline bool check_match_height(KEY_TYPE key1, KEY_TYPE key2, INT_HEIGHT pos) {
+    if(pos >= KEY_BITS) return key_equal(key1, key2);
+    int i = 0;
+    for(; pos >= 32; pos -= 32, i++) {
+        if(key_word(key1, i) != key_word(key2, i)) return false;
+    }
+    return pos == 0 || ((key_word(key1, i) ^ key_word(key2, i)) >> (32 - pos)) == (uint32_t)0;
+}
+
+// Ones on the leading pos bits of a 64-bit word
+static inline uint64_t leading_ones(int pos) {
+    if(pos <= 0) return (uint64_t)0;
+    else if(pos >= 64) return UINT64_MAX;
+    else return ~(UINT64_MAX >> pos);
+}
+
+// Prune the tail bits of a key to 0s (Input range [0, KEY_BITS])
+static inline KEY_TYPE prune_tail_bits(KEY_TYPE key, INT_HEIGHT pos) {
+#ifdef KEY_128_BIT_ON
+    key.hi &= leading_ones(pos);
+    key.lo &= leading_ones(pos - 64);
+    return key;
+#else
+    return key & leading_ones(pos);
+#endif
 }
 
-// Prune the tail bits of a key to 0s (Input range [1, 64])
-static inline uint64_t prune_tail_bits(uint64_t key, INT_HEIGHT pos) {
-    if(pos == 0) return (uint64_t)0;
-    else return ((key >> (64 - pos)) << (64 - pos));
+// Set the tail bits of a key to 1s (Input range [0, KEY_BITS])
+static inline KEY_TYPE fill_tail_bits(KEY_TYPE key, INT_HEIGHT pos) {
+#ifdef KEY_128_BIT_ON
+    key.hi |= ~leading_ones(pos);
+    key.lo |= ~leading_ones(pos - 64);
+    return key;
+#else
+    return key | ~leading_ones(pos);
+#endif
 }
 
 
@@ -88,10 +174,129 @@ static inline uint64_t split_by_three(COORD x) {
     key = (key | (key << 2))  & 0x1249249249249249;
     return key;
 }
+#elif NR_DIMENSION >= 4 && NR_DIMENSION <= 10
+// Each coordinate takes MORTON_SPLIT_BITS or MORTON_SPLIT_BITS - 1 bits of the key
+#if NR_DIMENSION == 4
+#define MORTON_SPLIT_BITS (16)
+#define MORTON_SPLIT_MASK_8 (0x000000ff000000ff)
+#define MORTON_SPLIT_MASK_4 (0x000f000f000f000f)
+#define MORTON_SPLIT_MASK_2 (0x0303030303030303)
+#define MORTON_SPLIT_MASK_1 (0x1111111111111111)
+#elif NR_DIMENSION == 5
+#define MORTON_SPLIT_BITS (13)
+#define MORTON_SPLIT_MASK_8 (0x00001f00000000ff)
+#define MORTON_SPLIT_MASK_4 (0x10000f0000f0000f)
+#define MORTON_SPLIT_MASK_2 (0x100c0300c0300c03)
+#define MORTON_SPLIT_MASK_1 (0x1084210842108421)
+#elif NR_DIMENSION == 6
+#define MORTON_SPLIT_BITS (11)
+#define MORTON_SPLIT_MASK_8 (0x00070000000000ff)
+#define MORTON_SPLIT_MASK_4 (0x000700000f00000f)
+#define MORTON_SPLIT_MASK_2 (0x1003003003003003)
+#define MORTON_SPLIT_MASK_1 (0x1041041041041041)
+#elif NR_DIMENSION == 7
+#define MORTON_SPLIT_BITS (10)
+#define MORTON_SPLIT_MASK_8 (0x03000000000000ff)
+#define MORTON_SPLIT_MASK_4 (0x03000000f000000f)
+#define MORTON_SPLIT_MASK_2 (0x03000c003000c003)
+#define MORTON_SPLIT_MASK_1 (0x8102040810204081)
+#elif NR_DIMENSION == 8
+#define MORTON_SPLIT_BITS (8)
+#define MORTON_SPLIT_MASK_4 (0x0000000f0000000f)
+#define MORTON_SPLIT_MASK_2 (0x0003000300030003)
+#define MORTON_SPLIT_MASK_1 (0x0101010101010101)
+#elif NR_DIMENSION == 9
+#define MORTON_SPLIT_BITS (8)
+#define MORTON_SPLIT_MASK_4 (0x000000f00000000f)
+#define MORTON_SPLIT_MASK_2 (0x00c00030000c0003)
+#define MORTON_SPLIT_MASK_1 (0x8040201008040201)
+#elif NR_DIMENSION == 10
+#define MORTON_SPLIT_BITS (7)
+#define MORTON_SPLIT_MASK_4 (0x000007000000000f)
+#define MORTON_SPLIT_MASK_2 (0x1000030000300003)
+#define MORTON_SPLIT_MASK_1 (0x1004010040100401)
 #endif
+#define MORTON_SPLIT_MASK_0 ((((uint64_t)1) << MORTON_SPLIT_BITS) - 1)
+
+// Coordinate k supplies key positions k + 1, k + 1 + NR_DIMENSION, ...: MORTON_COORD_BITS(k) bits, the last at bit MORTON_KEY_OFFSET(k)
+#define MORTON_COORD_BITS(k) ((63 - (k)) / NR_DIMENSION + 1)
+#define MORTON_KEY_OFFSET(k) (63 - (k) - (MORTON_COORD_BITS(k) - 1) * NR_DIMENSION)
+
+// Move bit i of the low MORTON_SPLIT_BITS bits to bit i * NR_DIMENSION
+static inline uint64_t split_by_dimension(uint64_t key) {
+    key &= MORTON_SPLIT_MASK_0;
+#ifdef MORTON_SPLIT_MASK_8
+    key = (key | (key << (8 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_8;
+#endif
+    key = (key | (key << (4 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_4;
+    key = (key | (key << (2 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_2;
+    key = (key | (key << (NR_DIMENSION - 1)))       & MORTON_SPLIT_MASK_1;
+    return key;
+}
+
+// Inverse of split_by_dimension, ignoring the bits in between
+static inline uint64_t compact_by_dimension(uint64_t key) {
+    key &= MORTON_SPLIT_MASK_1;
+    key = (key | (key >> (NR_DIMENSION - 1)))       & MORTON_SPLIT_MASK_2;
+    key = (key | (key >> (2 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_4;
+#ifdef MORTON_SPLIT_MASK_8
+    key = (key | (key >> (4 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_8;
+    key = (key | (key >> (8 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_0;
+#else
+    key = (key | (key >> (4 * (NR_DIMENSION - 1)))) & MORTON_SPLIT_MASK_0;
+#endif
+    return key;
+}
+
+// Key positions of coordinate k, for PDEP / PEXT
+#define MORTON_DIMENSION_MASK(k) (split_by_dimension(UINT64_MAX) << MORTON_KEY_OFFSET(k))
+#endif
+
+#ifdef KEY_128_BIT_ON
+// Coordinate bits in a 128-bit key, as two 21-bit halves: 126 bits, plus 2 unused tail bits
+#define KEY_128_COORD_BITS (42)
+#define KEY_128_COORD_SHIFT (65 - KEY_START_POS - KEY_128_COORD_BITS)
+
+// Inverse of split_by_three
+static inline uint64_t compact_by_three(uint64_t key) {
+    key &= 0x1249249249249249;
+    key = (key | (key >> 2))  & 0x10c30c30c30c30c3;
+    key = (key | (key >> 4))  & 0x100f00f00f00f00f;
+    key = (key | (key >> 8))  & 0x001f0000ff0000ff;
+    key = (key | (key >> 16)) & 0x001f00000000ffff;
+    key = (key | (key >> 32)) & 0x1fffff;
+    return key;
+}
 
 // Morton Ordering
-static inline uint64_t coord_to_key(vectorT *v) {
+static inline key128 coord_to_key(vectorT *v) {
+    uint64_t x = ((uint64_t)v->x) >> KEY_128_COORD_SHIFT,
+             y = ((uint64_t)v->y) >> KEY_128_COORD_SHIFT,
+             z = ((uint64_t)v->z) >> KEY_128_COORD_SHIFT;
+    // Positions [1, 63] from the upper halves, [64, 126] from the lower halves
+    uint64_t h = (split_by_three(x >> 21) << 2) | (split_by_three(y >> 21) << 1) | split_by_three(z >> 21),
+             l = (split_by_three(x) << 2) | (split_by_three(y) << 1) | split_by_three(z);
+    return (key128){.hi = (h << 1) | (l >> 62), .lo = l << 2};
+}
+
+// Reverse Morton Ordering
+static inline vectorT key_to_coord(key128 key, bool fill_with_one) {
+    vectorT v;
+    uint64_t h = key.hi >> 1, l = (key.hi << 62) | (key.lo >> 2);
+    v.x = ((compact_by_three(h >> 2) << 21) | compact_by_three(l >> 2)) << KEY_128_COORD_SHIFT;
+    v.y = ((compact_by_three(h >> 1) << 21) | compact_by_three(l >> 1)) << KEY_128_COORD_SHIFT;
+    v.z = ((compact_by_three(h) << 21) | compact_by_three(l)) << KEY_128_COORD_SHIFT;
+    if(fill_with_one) {
+        uint64_t mask = (((uint64_t)1) << KEY_128_COORD_SHIFT) - 1;
+        v.x |= mask;
+        v.y |= mask;
+        v.z |= mask;
+    }
+    return v;
+}
+#else
+// Morton Ordering
+static inline uint64_t coord_to_morton_key(vectorT *v) {
 #if NR_DIMENSION == 2
     uint64_t x = split_by_two(COORD_PART_BY_TWO_IDX > KEY_START_POS ? ((v->x) >> (COORD_PART_BY_TWO_IDX - KEY_START_POS)) : ((v->x) << (KEY_START_POS - COORD_PART_BY_TWO_IDX))),
              y = split_by_two(COORD_PART_BY_TWO_IDX > KEY_START_POS ? ((v->y) >> (COORD_PART_BY_TWO_IDX - KEY_START_POS)) : ((v->y) << (KEY_START_POS - COORD_PART_BY_TWO_IDX)));
@@ -101,6 +306,18 @@ static inline uint64_t coord_to_key(vectorT *v) {
              y = split_by_three(COORD_PART_BY_THREE_IDX > KEY_START_POS ? ((v->y) >> (COORD_PART_BY_THREE_IDX - KEY_START_POS)) : ((v->y) << (KEY_START_POS - COORD_PART_BY_THREE_IDX))),
              z = split_by_three(COORD_PART_BY_THREE_IDX > KEY_START_POS ? ((v->z) >> (COORD_PART_BY_THREE_IDX - KEY_START_POS)) : ((v->z) << (KEY_START_POS - COORD_PART_BY_THREE_IDX)));
     return (x << 3) | (y << 2) | (z << 1);
+#elif NR_DIMENSION >= 4 && NR_DIMENSION <= 10
+    uint64_t res = 0, c;
+    for(int k = 0; k < NR_DIMENSION; k++) {
+        // Bits [KEY_START_POS, KEY_START_POS + MORTON_COORD_BITS(k) - 1] of the coordinate
+        c = (((uint64_t)v->x[k]) << KEY_START_POS_MINUS_ONE) >> (64 - MORTON_COORD_BITS(k));
+#ifdef __BMI2__
+        res |= _pdep_u64(c, MORTON_DIMENSION_MASK(k));
+#else
+        res |= split_by_dimension(c) << MORTON_KEY_OFFSET(k);
+#endif
+    }
+    return res;
 #else
     uint64_t res = 0;
     int i = 1, j = KEY_START_POS;
@@ -143,7 +360,7 @@ static inline uint64_t merge_by_three(uint64_t key) {
 #endif
 
 // Reverse Morton Ordering
-static inline vectorT key_to_coord(uint64_t key, bool fill_with_one) {
+static inline vectorT morton_key_to_coord(uint64_t key, bool fill_with_one) {
     vectorT v;
 #if NR_DIMENSION == 2
     v.x = merge_by_two(key) >> KEY_START_POS_MINUS_ONE;
@@ -167,6 +384,17 @@ static inline vectorT key_to_coord(uint64_t key, bool fill_with_one) {
         v.z |= mask;
     }
 #endif
+#elif NR_DIMENSION >= 4 && NR_DIMENSION <= 10
+    uint64_t c;
+    for(int k = 0; k < NR_DIMENSION; k++) {
+#ifdef __BMI2__
+        c = _pext_u64(key, MORTON_DIMENSION_MASK(k));
+#else
+        c = compact_by_dimension(key >> MORTON_KEY_OFFSET(k));
+#endif
+        v.x[k] = (c << (64 - MORTON_COORD_BITS(k))) >> KEY_START_POS_MINUS_ONE;
+        if(fill_with_one) v.x[k] |= UINT64_MAX >> (KEY_START_POS_MINUS_ONE + MORTON_COORD_BITS(k));
+    }
 #else
     vector_ones(&v, 0);
     int i = 1, j = KEY_START_POS;
@@ -193,3 +421,187 @@ static inline vectorT key_to_coord(uint64_t key, bool fill_with_one) {
 #endif
     return v;
 }
+
+#ifdef HILBERT_KEY_ON
+/*
+    The next section is for Hilbert Ordering, after Hamilton's "Compact Hilbert Indices".
+    Each level of the key is an NR_DIMENSION-bit digit w, the rank along the curve of the sub-cube holding the point.
+    The Morton digit of the same level, with dimension 0 as the leading bit, is the label of the sub-cube.
+    The state (e, d) of a level is the entry corner and the main direction of the curve in the current cube.
+*/
+#define HILBERT_LEVELS (64 / NR_DIMENSION)
+#define HILBERT_KEY_BITS (HILBERT_LEVELS * NR_DIMENSION)
+#define HILBERT_DIGIT_MASK ((((uint32_t)1) << NR_DIMENSION) - 1)
+
+static inline uint32_t gray_code(uint32_t x) {
+    return x ^ (x >> 1);
+}
+
+static inline uint32_t gray_code_inverse(uint32_t x) {
+    for(int s = 1; s < NR_DIMENSION; s <<= 1) x ^= x >> s;
+    return x;
+}
+
+// Rotate a digit by r bits, r in [0, NR_DIMENSION)
+static inline uint32_t hilbert_rotate_left(uint32_t x, int r) {
+    return ((x << r) | (x >> (NR_DIMENSION - r))) & HILBERT_DIGIT_MASK;
+}
+
+static inline uint32_t hilbert_rotate_right(uint32_t x, int r) {
+    return ((x >> r) | (x << (NR_DIMENSION - r))) & HILBERT_DIGIT_MASK;
+}
+
+// Label of the w-th sub-cube along the curve
+static inline uint32_t hilbert_child_label(uint32_t w, uint32_t e, int d) {
+    return hilbert_rotate_left(gray_code(w), d == NR_DIMENSION - 1 ? 0 : d + 1) ^ e;
+}
+
+// Rank along the curve of the sub-cube with the label
+static inline uint32_t hilbert_child_rank(uint32_t label, uint32_t e, int d) {
+    return gray_code_inverse(hilbert_rotate_right(label ^ e, d == NR_DIMENSION - 1 ? 0 : d + 1));
+}
+
+// State of the curve inside the w-th sub-cube
+static inline void hilbert_next_state(uint32_t w, uint32_t *e, int *d) {
+    uint32_t entry = (w == 0 ? 0 : gray_code((w - 1) & ~((uint32_t)1)));
+    int direction = (w == 0 ? 0 : __builtin_ctz(~((w & 1) ? w : w - 1)) % NR_DIMENSION);
+    *e ^= hilbert_rotate_left(entry, *d == NR_DIMENSION - 1 ? 0 : *d + 1);
+    *d = (*d + direction + 1) % NR_DIMENSION;
+}
+
+static inline uint64_t morton_to_hilbert_key(uint64_t key) {
+    uint64_t res = 0;
+    uint32_t e = 0, w;
+    int d = 0, s;
+    for(s = 64 - NR_DIMENSION; s >= 64 - HILBERT_KEY_BITS; s -= NR_DIMENSION) {
+        w = hilbert_child_rank((uint32_t)(key >> s) & HILBERT_DIGIT_MASK, e, d);
+        res |= ((uint64_t)w) << s;
+        hilbert_next_state(w, &e, &d);
+    }
+    return res;
+}
+
+static inline uint64_t hilbert_to_morton_key(uint64_t key) {
+    uint64_t res = 0;
+    uint32_t e = 0, w;
+    int d = 0, s;
+    for(s = 64 - NR_DIMENSION; s >= 64 - HILBERT_KEY_BITS; s -= NR_DIMENSION) {
+        w = (uint32_t)(key >> s) & HILBERT_DIGIT_MASK;
+        res |= ((uint64_t)hilbert_child_label(w, e, d)) << s;
+        hilbert_next_state(w, &e, &d);
+    }
+    return res;
+}
+
+// Hilbert Ordering. The bits of the partial last level in Morton order are dropped.
+static inline uint64_t coord_to_key(vectorT *v) {
+    return morton_to_hilbert_key(coord_to_morton_key(v));
+}
+
+// Reverse Hilbert Ordering
+static inline vectorT key_to_coord(uint64_t key, bool fill_with_one) {
+    uint64_t morton_key = hilbert_to_morton_key(key);
+    return morton_key_to_coord(fill_with_one ? fill_tail_bits(morton_key, HILBERT_KEY_BITS) : morton_key, fill_with_one);
+}
+
+/*
+    Bounding box of the keys sharing the leading height bits. A partial digit fixes the leading bits of w,
+    hence of its gray code, so the free bits of the labels are the rotated tail bits: the union is a box.
+*/
+static inline void key_prefix_box(uint64_t key, INT_HEIGHT height, vectorT *box_min, vectorT *box_max) {
+    uint64_t morton_min = 0, morton_max;
+    uint32_t e = 0, w, label, free;
+    int d = 0, s, rest = height % NR_DIMENSION;
+    for(s = 64 - NR_DIMENSION; s >= 64 - height; s -= NR_DIMENSION) {
+        w = (uint32_t)(key >> s) & HILBERT_DIGIT_MASK;
+        morton_min |= ((uint64_t)hilbert_child_label(w, e, d)) << s;
+        hilbert_next_state(w, &e, &d);
+    }
+    morton_max = morton_min;
+    if(rest > 0 && s >= 64 - HILBERT_KEY_BITS) {
+        free = (((uint32_t)1) << (NR_DIMENSION - rest)) - 1;
+        w = (uint32_t)(key >> s) & HILBERT_DIGIT_MASK & ~free;
+        free = hilbert_rotate_left(free, d == NR_DIMENSION - 1 ? 0 : d + 1);
+        label = hilbert_child_label(w, e, d) & ~free;
+        morton_min |= ((uint64_t)label) << s;
+        morton_max |= ((uint64_t)(label | free)) << s;
+        s -= NR_DIMENSION;
+    }
+    *box_min = morton_key_to_coord(morton_min, false);
+    *box_max = morton_key_to_coord(fill_tail_bits(morton_max, 64 - NR_DIMENSION - s), true);
+}
+
+// The key bits of each coordinate, level 0 as the leading bit of HILBERT_LEVELS bits
+static inline void hilbert_coord_bits(vectorT *v, uint64_t *c) {
+#if NR_DIMENSION == 2
+    c[0] = (((uint64_t)v->x) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+    c[1] = (((uint64_t)v->y) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+#elif NR_DIMENSION == 3
+    c[0] = (((uint64_t)v->x) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+    c[1] = (((uint64_t)v->y) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+    c[2] = (((uint64_t)v->z) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+#else
+    for(int k = 0; k < NR_DIMENSION; k++) c[k] = (((uint64_t)v->x[k]) << KEY_START_POS_MINUS_ONE) >> (64 - HILBERT_LEVELS);
+#endif
+}
+
+/*
+    Place the sub-cube with the label inside a cell of level - 1, given by the coordinate bits cell_min.
+    Return 0 if it misses the box [box_min, box_max] (in hilbert_coord_bits), 2 if it lies inside, 1 otherwise.
+*/
+static inline int hilbert_child_cell(uint64_t *cell_min, uint32_t label, int level, uint64_t *box_min, uint64_t *box_max, uint64_t *child_min) {
+    uint64_t tail = (((uint64_t)1) << (HILBERT_LEVELS - level)) - 1, lo;
+    int ret = 2;
+    for(int k = 0; k < NR_DIMENSION; k++) {
+        lo = cell_min[k] | ((((uint64_t)label >> (NR_DIMENSION - 1 - k)) & 1) << (HILBERT_LEVELS - level));
+        if(lo > box_max[k] || (lo | tail) < box_min[k]) return 0;
+        if(lo < box_min[k] || (lo | tail) > box_max[k]) ret = 1;
+        child_min[k] = lo;
+    }
+    return ret;
+}
+
+/*
+    The smallest (upper = false) or largest (upper = true) key of a point in the box.
+    The keys of a sub-cube precede those of the next one, so the bound is in the first (last) sub-cube meeting the box.
+    Levels below the coordinate bits (the last one in 2D) may loosen the bound, never past the keys of the box.
+*/
+static inline uint64_t hilbert_box_key_bound(vectorT *box_min, vectorT *box_max, bool upper) {
+    uint64_t b_min[NR_DIMENSION], b_max[NR_DIMENSION], cell_min[NR_DIMENSION], child_min[NR_DIMENSION], key = 0;
+    uint32_t e = 0, w = 0, i;
+    int d = 0, level, k, relation = 1;
+    hilbert_coord_bits(box_min, b_min);
+    hilbert_coord_bits(box_max, b_max);
+    for(k = 0; k < NR_DIMENSION; k++) cell_min[k] = 0;
+    for(level = 1; level <= HILBERT_LEVELS && relation == 1; level++) {
+        for(i = 0; i <= HILBERT_DIGIT_MASK; i++) {
+            w = (upper ? HILBERT_DIGIT_MASK - i : i);
+            relation = hilbert_child_cell(cell_min, hilbert_child_label(w, e, d), level, b_min, b_max, child_min);
+            if(relation != 0) break;
+        }
+        key |= ((uint64_t)w) << (64 - level * NR_DIMENSION);
+        for(k = 0; k < NR_DIMENSION; k++) cell_min[k] = child_min[k];
+        hilbert_next_state(w, &e, &d);
+    }
+    // A sub-cube inside the box holds all the keys sharing its prefix
+    if(upper) key = fill_tail_bits(key, (level - 1) * NR_DIMENSION) & leading_ones(HILBERT_KEY_BITS);
+    return key;
+}
+#else
+static inline uint64_t coord_to_key(vectorT *v) {
+    return coord_to_morton_key(v);
+}
+
+static inline vectorT key_to_coord(uint64_t key, bool fill_with_one) {
+    return morton_key_to_coord(key, fill_with_one);
+}
+#endif
+#endif
+
+// Bounding box of the keys sharing the leading height bits: a cube in Morton order
+#ifndef HILBERT_KEY_ON
+static inline void key_prefix_box(KEY_TYPE key, INT_HEIGHT height, vectorT *box_min, vectorT *box_max) {
+    *box_min = key_to_coord(prune_tail_bits(key, height), false);
+    *box_max = key_to_coord(fill_tail_bits(key, height), true);
+}
+#endif
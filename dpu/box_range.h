@@ -21,6 +21,41 @@ bool vector_in_box(vectorT *v, vectorT *box_min, vectorT *box_max);
 bool box_intersect(vectorT *box1_min, vectorT *box1_max, vectorT *box2_min, vectorT *box2_max);
 bool box_contain(vectorT *small_box_min, vectorT *small_box_max, vectorT *large_box_min, vectorT *large_box_max);
 
+#if (defined BOX_RANGE_FETCH_ON) || (defined BOX_RANGE_COUNT_ON)
+vectorT vector_sub(vectorT *op1, vectorT *op2);
+void vector_max(vectorT *src, vectorT *dst);
+COORD vector_norm(vectorT *v);
+bool radius_intersect_box(vectorT *v, COORD radius, vectorT *box_min, vectorT *box_max);
+
+/* Whether the box lies inside the ball, i.e. its farthest corner is within radius of the center */
+static inline bool box_contained_in_radius(vectorT *center, COORD radius, vectorT *box_min, vectorT *box_max) {
+    vectorT v1 = vector_sub(center, box_min), v2 = vector_sub(center, box_max);
+    vector_max(&v2, &v1);
+    return vector_norm(&v1) <= radius;
+}
+#endif
+
+#ifdef DPU_PNODE_SOA
+/*
+    Mask of the P node vectors inside the box, read into pnode->cols one column at a time.
+    The scan stops at the first column that rejects every vector, leaving the other columns unread.
+*/
+static inline uint32_t pnode_box_filter(mPptr addr, Pnode *pnode, vectorT *vec_min, vectorT *vec_max) {
+    uint32_t mask = (((uint32_t)1) << pnode->num) - 1;
+    COORD lo, hi, *col;
+    int d, i;
+    for(d = 0; d < NR_DIMENSION && mask != 0; d++) {
+        col = pnode->cols[d];
+        m_read(addr->cols[d], col, S64(LEAF_SIZE));
+        lo = VECTOR_COORD(vec_min, d);
+        hi = VECTOR_COORD(vec_max, d);
+#pragma unroll
+        for(i = 0; i < LEAF_SIZE; i++) mask &= ~(((uint32_t)(col[i] < lo || col[i] > hi)) << i);
+    }
+    return mask;
+}
+#endif
+
 /* Count nr_points in Box Range Queries */
 #ifdef BOX_RANGE_COUNT_ON
 static inline uint64_t box_range_count(vectorT *vec_min, vectorT *vec_max, mpvoid buf) {
@@ -32,8 +67,9 @@ static inline uint64_t box_range_count(vectorT *vec_min, vectorT *vec_max, mpvoi
     pptr addr;
     mBptr b_addr;
     mPptr p_addr;
-    Bnode bnode;
+    Bnode bnode, *bnode_pt;
     Pnode pnode;
+    pptr *children;
     int64_t i;
     bool to_contunue_signal;
     while(pptr_wram_num > 0 || pptr_mram_num > 0) {
@@ -54,8 +90,8 @@ static inline uint64_t box_range_count(vectorT *vec_min, vectorT *vec_max, mpvoi
         }
         else if(addr.data_type == B_NODE_DATA_TYPE) {
             b_addr = pptr_to_mbptr(addr);
-            m_read(b_addr, &bnode, BNODE_METADATA_SIZE);
-            to_contunue_signal = box_intersect(&bnode.box_min, &bnode.box_max, vec_min, vec_max);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            to_contunue_signal = box_intersect(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max);
         }
         if(to_contunue_signal) {
             if(addr.data_type == P_NODE_DATA_TYPE) {
@@ -63,21 +99,25 @@ static inline uint64_t box_range_count(vectorT *vec_min, vectorT *vec_max, mpvoi
                     nr_count += pnode.num;
                 }
                 else {
-                    m_read(p_addr->v, pnode.v, S64(MULTIPLY_NR_DIMENSION(pnode.num)));
+#ifdef DPU_PNODE_SOA
+                    nr_count += __builtin_popcount(pnode_box_filter(p_addr, &pnode, vec_min, vec_max));
+#else
+                    pnode_read_vectors(p_addr, pnode.v, pnode.num);
                     for(i = 0; i < pnode.num; i++) {
                         if(vector_in_box(pnode.v + i, vec_min, vec_max))
                             nr_count++;
                     }
+#endif
                 }
             }
             else if(addr.data_type == B_NODE_DATA_TYPE) {
-                if(bnode.subtree_size < MAX_RANGE_QUERY_SIZE && box_contain(&bnode.box_min, &bnode.box_max, vec_min, vec_max)) {
-                    nr_count += bnode.subtree_size;
+                if(box_contain(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max)) {
+                    nr_count += bnode_pt->subtree_size;
                 }
                 else {
-                    m_read(b_addr->children, bnode.children, S64(DB_SIZE));
+                    children = bnode_load_children(b_addr, bnode.children);
                     for(i = 0; i < DB_SIZE; i++) {
-                        addr = bnode.children[i];
+                        addr = children[i];
                         if(valid_pptr(addr)) {
                             if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
                                 pptr_buf_wram[pptr_wram_num] = addr;
@@ -99,12 +139,295 @@ static inline uint64_t box_range_count(vectorT *vec_min, vectorT *vec_max, mpvoi
 }
 #endif
 
+#ifdef BOX_RANGE_COUNT_ON
+#define BOX_APPROX_FRACTION_BITS (16)
+
+/* Fraction of the volume of the node box inside the query box, with BOX_APPROX_FRACTION_BITS bits. The boxes intersect. */
+static inline uint64_t box_overlap_fraction(vectorT *node_min, vectorT *node_max, vectorT *vec_min, vectorT *vec_max) {
+    uint64_t frac = ((uint64_t)1) << BOX_APPROX_FRACTION_BITS, span, part;
+    COORD lo, hi;
+    int d;
+    for(d = 0; d < NR_DIMENSION; d++) {
+        lo = GEOMETRY_MAX(VECTOR_COORD(node_min, d), VECTOR_COORD(vec_min, d));
+        hi = GEOMETRY_MIN(VECTOR_COORD(node_max, d), VECTOR_COORD(vec_max, d));
+        // Widths minus one, scaled down together so that the division keeps the fraction bits
+        span = (uint64_t)VECTOR_COORD(node_max, d) - (uint64_t)VECTOR_COORD(node_min, d);
+        part = (uint64_t)hi - (uint64_t)lo;
+        while(span >= (((uint64_t)1) << 31)) {
+            span >>= 1;
+            part >>= 1;
+        }
+        frac = (frac * ((part + 1) << BOX_APPROX_FRACTION_BITS) / (span + 1)) >> BOX_APPROX_FRACTION_BITS;
+    }
+    return frac;
+}
+
+/*
+    Approximate count of Box Range Queries. Nodes partially inside the box are expanded while fewer than budget nodes
+    were expanded and their depth (the root at 0, kept in pptr::info of the stack) is below max_depth, if max_depth > 0.
+    The others are estimated by the fraction of their box volume inside the query box.
+    Return the estimate, with the exact count of the expanded part in *lower and *lower plus the sizes of the estimated nodes in *upper.
+*/
+static inline uint64_t box_range_count_approx(vectorT *vec_min, vectorT *vec_max, int32_t budget, int32_t max_depth,
+                                              uint64_t *lower, uint64_t *upper, mpvoid buf) {
+    uint64_t nr_count = 0, partial_count = 0, estimate = 0;
+    mppptr pptr_buf_mram = (mppptr)buf;
+    pptr pptr_buf_wram[BOX_QUERY_WRAM_BUFFER_SIZE];
+    int pptr_mram_num = 0, pptr_wram_num = 1;
+    pptr_buf_wram[0] = mbptr_to_pptr(root);
+    pptr addr;
+    mBptr b_addr;
+    mPptr p_addr;
+    Bnode bnode, *bnode_pt;
+    Pnode pnode;
+    pptr *children;
+    int64_t i;
+    int32_t expanded = 0;
+    int8_t depth;
+    bool to_contunue_signal, estimate_signal;
+    while(pptr_wram_num > 0 || pptr_mram_num > 0) {
+        if(pptr_wram_num > 0) {
+            pptr_wram_num--;
+            addr = pptr_buf_wram[pptr_wram_num];
+        }
+        else {
+            m_read(pptr_buf_mram + pptr_mram_num - (BOX_QUERY_WRAM_BUFFER_SIZE >> 1), pptr_buf_wram, S64(BOX_QUERY_WRAM_BUFFER_SIZE >> 1));
+            pptr_wram_num = (BOX_QUERY_WRAM_BUFFER_SIZE >> 1) - 1;
+            addr = pptr_buf_wram[pptr_wram_num];
+            pptr_mram_num -= (BOX_QUERY_WRAM_BUFFER_SIZE >> 1);
+        }
+        depth = addr.info;
+        estimate_signal = (expanded >= budget || (max_depth > 0 && depth >= max_depth));
+        if(addr.data_type == P_NODE_DATA_TYPE) {
+            p_addr = pptr_to_mpptr(addr);
+            m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+            to_contunue_signal = box_intersect(&pnode.box_min, &pnode.box_max, vec_min, vec_max);
+        }
+        else if(addr.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(addr);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            to_contunue_signal = box_intersect(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max);
+        }
+        if(!to_contunue_signal) continue;
+        if(addr.data_type == P_NODE_DATA_TYPE) {
+            if(box_contain(&pnode.box_min, &pnode.box_max, vec_min, vec_max)) {
+                nr_count += pnode.num;
+            }
+            else if(estimate_signal) {
+                partial_count += pnode.num;
+                estimate += (pnode.num * box_overlap_fraction(&pnode.box_min, &pnode.box_max, vec_min, vec_max)) >> BOX_APPROX_FRACTION_BITS;
+            }
+            else {
+                expanded++;
+#ifdef DPU_PNODE_SOA
+                nr_count += __builtin_popcount(pnode_box_filter(p_addr, &pnode, vec_min, vec_max));
+#else
+                pnode_read_vectors(p_addr, pnode.v, pnode.num);
+                for(i = 0; i < pnode.num; i++) {
+                    if(vector_in_box(pnode.v + i, vec_min, vec_max))
+                        nr_count++;
+                }
+#endif
+            }
+        }
+        else if(addr.data_type == B_NODE_DATA_TYPE) {
+            if(box_contain(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max)) {
+                nr_count += bnode_pt->subtree_size;
+            }
+            else if(estimate_signal) {
+                partial_count += bnode_pt->subtree_size;
+                estimate += (bnode_pt->subtree_size * box_overlap_fraction(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max))
+                            >> BOX_APPROX_FRACTION_BITS;
+            }
+            else {
+                expanded++;
+                children = bnode_load_children(b_addr, bnode.children);
+                for(i = 0; i < DB_SIZE; i++) {
+                    addr = children[i];
+                    if(valid_pptr(addr)) {
+                        addr.info = depth + 1;
+                        if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
+                            pptr_buf_wram[pptr_wram_num] = addr;
+                            pptr_wram_num++;
+                        }
+                        else {
+                            m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
+                            pptr_mram_num += pptr_wram_num;
+                            pptr_buf_wram[0] = addr;
+                            pptr_wram_num = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    *lower = nr_count;
+    *upper = nr_count + partial_count;
+    return nr_count + estimate;
+}
+#endif
+
+/* Count and aggregate the points in Box Range Queries. Subtrees inside the box are answered from their B node aggregates when BNODE_AGGREGATE_ON. */
+#ifdef BOX_RANGE_COUNT_ON
+static inline uint64_t box_range_aggregate(vectorT *vec_min, vectorT *vec_max, Bnode_aggregate *res, mpvoid buf) {
+    uint64_t nr_count = 0;
+    mppptr pptr_buf_mram = (mppptr)buf;
+    pptr pptr_buf_wram[BOX_QUERY_WRAM_BUFFER_SIZE];
+    int pptr_mram_num = 0, pptr_wram_num = 1;
+    pptr_buf_wram[0] = mbptr_to_pptr(root);
+    pptr addr;
+    mBptr b_addr;
+    mPptr p_addr;
+    Bnode bnode, *bnode_pt;
+    Pnode pnode;
+    pptr *children;
+    bool fetch_all;
+    int64_t i;
+#ifdef BNODE_AGGREGATE_ON
+    Bnode_aggregate agg_buf;
+#endif
+    aggregate_reset(res);
+    while(pptr_wram_num > 0 || pptr_mram_num > 0) {
+        if(pptr_wram_num > 0) {
+            pptr_wram_num--;
+            addr = pptr_buf_wram[pptr_wram_num];
+        }
+        else {
+            m_read(pptr_buf_mram + pptr_mram_num - (BOX_QUERY_WRAM_BUFFER_SIZE >> 1), pptr_buf_wram, S64(BOX_QUERY_WRAM_BUFFER_SIZE >> 1));
+            pptr_wram_num = (BOX_QUERY_WRAM_BUFFER_SIZE >> 1) - 1;
+            addr = pptr_buf_wram[pptr_wram_num];
+            pptr_mram_num -= (BOX_QUERY_WRAM_BUFFER_SIZE >> 1);
+        }
+        if(addr.data_type == P_NODE_DATA_TYPE) {
+            p_addr = pptr_to_mpptr(addr);
+            m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+            if(!box_intersect(&pnode.box_min, &pnode.box_max, vec_min, vec_max)) continue;
+            fetch_all = box_contain(&pnode.box_min, &pnode.box_max, vec_min, vec_max);
+            pnode_read_vectors(p_addr, pnode.v, pnode.num);
+            for(i = 0; i < pnode.num; i++) {
+                if(fetch_all || vector_in_box(pnode.v + i, vec_min, vec_max)) {
+                    aggregate_add_vector(res, pnode.v + i);
+                    nr_count++;
+                }
+            }
+        }
+        else if(addr.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(addr);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            if(!box_intersect(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max)) continue;
+#ifdef BNODE_AGGREGATE_ON
+            if(box_contain(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max)) {
+                nr_count += bnode_pt->subtree_size;
+                aggregate_merge(res, bnode_load_aggregate(b_addr, &agg_buf));
+                continue;
+            }
+#endif
+            children = bnode_load_children(b_addr, bnode.children);
+            for(i = 0; i < DB_SIZE; i++) {
+                addr = children[i];
+                if(valid_pptr(addr)) {
+                    if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
+                        pptr_buf_wram[pptr_wram_num] = addr;
+                        pptr_wram_num++;
+                    }
+                    else {
+                        m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
+                        pptr_mram_num += pptr_wram_num;
+                        pptr_buf_wram[0] = addr;
+                        pptr_wram_num = 1;
+                    }
+                }
+            }
+        }
+    }
+    return nr_count;
+}
+#endif
+
+/* Count nr_points within radius of center. Distances are exact, as a range query may not accept approximate norms. */
+#ifdef BOX_RANGE_COUNT_ON
+static inline uint64_t ball_range_count(vectorT *center, COORD radius, mpvoid buf) {
+    uint64_t nr_count = 0;
+    mppptr pptr_buf_mram = (mppptr)buf;
+    pptr pptr_buf_wram[BOX_QUERY_WRAM_BUFFER_SIZE];
+    int pptr_mram_num = 0, pptr_wram_num = 1;
+    pptr_buf_wram[0] = mbptr_to_pptr(root);
+    pptr addr;
+    mBptr b_addr;
+    mPptr p_addr;
+    Bnode bnode, *bnode_pt;
+    Pnode pnode;
+    pptr *children;
+    vectorT vec;
+    int64_t i;
+    while(pptr_wram_num > 0 || pptr_mram_num > 0) {
+        if(pptr_wram_num > 0) {
+            pptr_wram_num--;
+            addr = pptr_buf_wram[pptr_wram_num];
+        }
+        else {
+            m_read(pptr_buf_mram + pptr_mram_num - (BOX_QUERY_WRAM_BUFFER_SIZE >> 1), pptr_buf_wram, S64(BOX_QUERY_WRAM_BUFFER_SIZE >> 1));
+            pptr_wram_num = (BOX_QUERY_WRAM_BUFFER_SIZE >> 1) - 1;
+            addr = pptr_buf_wram[pptr_wram_num];
+            pptr_mram_num -= (BOX_QUERY_WRAM_BUFFER_SIZE >> 1);
+        }
+        if(addr.data_type == P_NODE_DATA_TYPE) {
+            p_addr = pptr_to_mpptr(addr);
+            m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+            if(!radius_intersect_box(center, radius, &pnode.box_min, &pnode.box_max)) continue;
+            if(box_contained_in_radius(center, radius, &pnode.box_min, &pnode.box_max)) {
+                nr_count += pnode.num;
+            }
+            else {
+                pnode_read_vectors(p_addr, pnode.v, pnode.num);
+                for(i = 0; i < pnode.num; i++) {
+                    vec = vector_sub(center, pnode.v + i);
+                    if(vector_norm(&vec) <= radius)
+                        nr_count++;
+                }
+            }
+        }
+        else if(addr.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(addr);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            if(!radius_intersect_box(center, radius, &bnode_pt->box_min, &bnode_pt->box_max)) continue;
+            if(box_contained_in_radius(center, radius, &bnode_pt->box_min, &bnode_pt->box_max)) {
+                nr_count += bnode_pt->subtree_size;
+            }
+            else {
+                children = bnode_load_children(b_addr, bnode.children);
+                for(i = 0; i < DB_SIZE; i++) {
+                    addr = children[i];
+                    if(valid_pptr(addr)) {
+                        if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
+                            pptr_buf_wram[pptr_wram_num] = addr;
+                            pptr_wram_num++;
+                        }
+                        else {
+                            m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
+                            pptr_mram_num += pptr_wram_num;
+                            pptr_buf_wram[0] = addr;
+                            pptr_wram_num = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return nr_count;
+}
+#endif
+
 /* Fetch all points in Box Range Queries */
 #ifdef BOX_RANGE_FETCH_ON
 
-static inline int check_fetch_pnode_to_buffer(bool fetch_all, Pnode *pnode_pt, vectorT *vec_min, vectorT *vec_max, varlen_buffer_in_mram *varlen_buf) {
+static inline int check_fetch_pnode_to_buffer(bool fetch_all, Pnode *pnode_pt, vectorT *vec_min, vectorT *vec_max, varlen_buffer_in_mram *varlen_buf
+        PAYLOAD_ARG(varlen_buffer_in_mram *payload_buf)) {
     if(fetch_all) {
         varlen_buffer_in_mram_push_bulk(varlen_buf, pnode_pt->v, MULTIPLY_NR_DIMENSION(pnode_pt->num));
+#ifdef POINT_PAYLOAD_ON
+        varlen_buffer_in_mram_push_bulk(payload_buf, pnode_pt->payloads, PAYLOAD_WORDS * pnode_pt->num);
+#endif
         return pnode_pt->num;
     }
     else {
@@ -113,6 +436,9 @@ static inline int check_fetch_pnode_to_buffer(bool fetch_all, Pnode *pnode_pt, v
         for(int8_t i = 0; i < pnode_pt->num; i++) {
             if(vector_in_box(vec, vec_min, vec_max)) {
                 varlen_buffer_in_mram_push_vector(varlen_buf, vec);
+#ifdef POINT_PAYLOAD_ON
+                varlen_buffer_in_mram_push(payload_buf, (int64_t)pnode_pt->payloads[i]);
+#endif
                 nr_count++;
             }
             vec++;
@@ -121,18 +447,138 @@ static inline int check_fetch_pnode_to_buffer(bool fetch_all, Pnode *pnode_pt, v
     }
 }
 
-static inline int box_range_fetch(vectorT *vec_min, vectorT *vec_max, varlen_buffer_in_mram *varlen_buf, mpvoid buf) {
+// Flags in pptr::info of the fetch stack
+#define BOX_FETCH_ALL (1)           // The subtree is inside the box
+#define BOX_FETCH_UNDER_CURSOR (2)  // The subtree has no key above the cursor
+
+/*
+    Push the vectors in the box to varlen_buf, and their payloads to payload_buf when POINT_PAYLOAD_ON.
+    Subtrees are visited in decreasing key order, skipping keys above *cursor, and whole P nodes are pushed
+    until the next one could exceed limit (at least LEAF_SIZE). Return the number of vectors, with *more set
+    when the fetch stopped early and *cursor lowered to the largest key of the P node to resume from.
+*/
+static inline int box_range_fetch(vectorT *vec_min, vectorT *vec_max, KEY_TYPE *cursor, int64_t limit, bool *more,
+                                  varlen_buffer_in_mram *varlen_buf PAYLOAD_ARG(varlen_buffer_in_mram *payload_buf), mpvoid buf) {
     int nr_count = 0;
     mppptr pptr_buf_mram = (mppptr)buf;
     pptr pptr_buf_wram[BOX_QUERY_WRAM_BUFFER_SIZE];
     int pptr_mram_num = 0, pptr_wram_num = 1;
     pptr_buf_wram[0] = mbptr_to_pptr(root);
+    if(key_equal(*cursor, INVALID_KEY)) pptr_buf_wram[0].info = BOX_FETCH_UNDER_CURSOR;
     pptr addr;
     mBptr b_addr;
     mPptr p_addr;
-    Bnode bnode;
+    Bnode bnode, *bnode_pt;
     Pnode pnode;
-    bool fetch_all, to_contunue_signal;
+    pptr *children;
+    bool fetch_all, under_cursor;
+    int i;
+    *more = false;
+    while(pptr_wram_num > 0 || pptr_mram_num > 0) {
+        if(pptr_wram_num > 0) {
+            pptr_wram_num--;
+            addr = pptr_buf_wram[pptr_wram_num];
+        }
+        else {
+            m_read(pptr_buf_mram + pptr_mram_num - (BOX_QUERY_WRAM_BUFFER_SIZE >> 1), pptr_buf_wram, S64(BOX_QUERY_WRAM_BUFFER_SIZE >> 1));
+            pptr_wram_num = (BOX_QUERY_WRAM_BUFFER_SIZE >> 1) - 1;
+            addr = pptr_buf_wram[pptr_wram_num];
+            pptr_mram_num -= (BOX_QUERY_WRAM_BUFFER_SIZE >> 1);
+        }
+        fetch_all = (addr.info & BOX_FETCH_ALL) != 0;
+        under_cursor = (addr.info & BOX_FETCH_UNDER_CURSOR) != 0;
+        if(addr.data_type == P_NODE_DATA_TYPE) {
+            p_addr = pptr_to_mpptr(addr);
+            // The metadata is only skipped when both flags come from ancestors
+            if(!fetch_all || !under_cursor) {
+                m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+                if(!under_cursor && key_less(*cursor, pnode.key)) continue;
+            }
+            else pnode.num = p_addr->num;
+            if(!fetch_all) {
+                if(!box_intersect(&pnode.box_min, &pnode.box_max, vec_min, vec_max)) continue;
+                fetch_all = box_contain(&pnode.box_min, &pnode.box_max, vec_min, vec_max);
+            }
+            if(nr_count + pnode.num > limit) {
+                if((addr.info & BOX_FETCH_ALL) && (addr.info & BOX_FETCH_UNDER_CURSOR)) m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+                *cursor = fill_tail_bits(pnode.key, pnode.height);
+                *more = true;
+                return nr_count;
+            }
+#ifdef DPU_PNODE_SOA
+            if(!fetch_all) {
+                // fetch_all is false only after the metadata read, so pnode.num is set
+                uint32_t mask = pnode_box_filter(p_addr, &pnode, vec_min, vec_max);
+                vectorT vec;
+                for(i = 0; mask != 0; i++, mask >>= 1) {
+                    if(mask & 1) {
+                        pnode_column_vector(&pnode, i, &vec);
+                        varlen_buffer_in_mram_push_vector(varlen_buf, &vec);
+#ifdef POINT_PAYLOAD_ON
+                        varlen_buffer_in_mram_push(payload_buf, (int64_t)p_addr->payloads[i]);
+#endif
+                        nr_count++;
+                    }
+                }
+                continue;
+            }
+#endif
+            pnode_read_vectors(p_addr, pnode.v, pnode.num);
+#ifdef POINT_PAYLOAD_ON
+            pnode_read_payloads(p_addr, pnode.payloads, pnode.num);
+#endif
+            nr_count += check_fetch_pnode_to_buffer(fetch_all, &pnode, vec_min, vec_max, varlen_buf PAYLOAD_ARG(payload_buf));
+        }
+        else if(addr.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(addr);
+            if(!fetch_all || !under_cursor) {
+                bnode_pt = bnode_load_metadata(b_addr, &bnode);
+                if(!under_cursor) {
+                    if(key_less(*cursor, bnode_pt->key)) continue;
+                    under_cursor = !key_less(*cursor, fill_tail_bits(bnode_pt->key, bnode_pt->height));
+                }
+                if(!fetch_all) {
+                    if(!box_intersect(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max)) continue;
+                    fetch_all = box_contain(&bnode_pt->box_min, &bnode_pt->box_max, vec_min, vec_max);
+                }
+            }
+            children = bnode_load_children(b_addr, bnode.children);
+            for(i = 0; i < DB_SIZE; i++) {
+                addr = children[i];
+                if(valid_pptr(addr)) {
+                    addr.info = (int8_t)((fetch_all ? BOX_FETCH_ALL : 0) | (under_cursor ? BOX_FETCH_UNDER_CURSOR : 0));
+                    if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
+                        pptr_buf_wram[pptr_wram_num] = addr;
+                        pptr_wram_num++;
+                    }
+                    else {
+                        m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
+                        pptr_mram_num += pptr_wram_num;
+                        pptr_buf_wram[0] = addr;
+                        pptr_wram_num = 1;
+                    }
+                }
+            }
+        }
+    }
+    return nr_count;
+}
+
+/* Push the vectors within radius of center to varlen_buf, and their payloads to payload_buf when POINT_PAYLOAD_ON */
+static inline int ball_range_fetch(vectorT *center, COORD radius, varlen_buffer_in_mram *varlen_buf PAYLOAD_ARG(varlen_buffer_in_mram *payload_buf), mpvoid buf) {
+    int nr_count = 0;
+    mppptr pptr_buf_mram = (mppptr)buf;
+    pptr pptr_buf_wram[BOX_QUERY_WRAM_BUFFER_SIZE];
+    int pptr_mram_num = 0, pptr_wram_num = 1;
+    pptr_buf_wram[0] = mbptr_to_pptr(root);
+    pptr addr;
+    mBptr b_addr;
+    mPptr p_addr;
+    Bnode bnode, *bnode_pt;
+    Pnode pnode;
+    pptr *children;
+    vectorT vec;
+    bool fetch_all;
     int i;
     while(pptr_wram_num > 0 || pptr_mram_num > 0) {
         if(pptr_wram_num > 0) {
@@ -148,40 +594,53 @@ static inline int box_range_fetch(vectorT *vec_min, vectorT *vec_max, varlen_buf
         fetch_all = addr.info != 0;
         if(addr.data_type == P_NODE_DATA_TYPE) {
             p_addr = pptr_to_mpptr(addr);
-            to_contunue_signal = fetch_all;
             if(!fetch_all) {
                 m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
-                to_contunue_signal = box_intersect(&pnode.box_min, &pnode.box_max, vec_min, vec_max);
-                fetch_all = box_contain(&pnode.box_min, &pnode.box_max, vec_min, vec_max);
+                if(!radius_intersect_box(center, radius, &pnode.box_min, &pnode.box_max)) continue;
+                fetch_all = box_contained_in_radius(center, radius, &pnode.box_min, &pnode.box_max);
             }
-            if(to_contunue_signal) {
-                m_read(p_addr->v, pnode.v, S64(MULTIPLY_NR_DIMENSION(pnode.num)));
-                nr_count += check_fetch_pnode_to_buffer(fetch_all, &pnode, vec_min, vec_max, varlen_buf);
+            // Not read yet when fetch_all comes from an ancestor
+            pnode.num = p_addr->num;
+            pnode_read_vectors(p_addr, pnode.v, pnode.num);
+#ifdef POINT_PAYLOAD_ON
+            pnode_read_payloads(p_addr, pnode.payloads, pnode.num);
+#endif
+            if(fetch_all) {
+                nr_count += check_fetch_pnode_to_buffer(true, &pnode, NULL, NULL, varlen_buf PAYLOAD_ARG(payload_buf));
+                continue;
+            }
+            for(i = 0; i < pnode.num; i++) {
+                vec = vector_sub(center, pnode.v + i);
+                if(vector_norm(&vec) <= radius) {
+                    varlen_buffer_in_mram_push_vector(varlen_buf, pnode.v + i);
+#ifdef POINT_PAYLOAD_ON
+                    varlen_buffer_in_mram_push(payload_buf, (int64_t)pnode.payloads[i]);
+#endif
+                    nr_count++;
+                }
             }
         }
         else if(addr.data_type == B_NODE_DATA_TYPE) {
             b_addr = pptr_to_mbptr(addr);
             if(!fetch_all) {
-                m_read(b_addr, &bnode, BNODE_METADATA_SIZE);
-                to_contunue_signal = box_intersect(&bnode.box_min, &bnode.box_max, vec_min, vec_max);
-                fetch_all = box_contain(&bnode.box_min, &bnode.box_max, vec_min, vec_max);
+                bnode_pt = bnode_load_metadata(b_addr, &bnode);
+                if(!radius_intersect_box(center, radius, &bnode_pt->box_min, &bnode_pt->box_max)) continue;
+                fetch_all = box_contained_in_radius(center, radius, &bnode_pt->box_min, &bnode_pt->box_max);
             }
-            if(to_contunue_signal) {
-                m_read(b_addr->children, bnode.children, S64(DB_SIZE));
-                for(i = 0; i < DB_SIZE; i++) {
-                    addr = bnode.children[i];
-                    if(valid_pptr(addr)) {
-                        addr.info = (int8_t)fetch_all;
-                        if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
-                            pptr_buf_wram[pptr_wram_num] = addr;
-                            pptr_wram_num++;
-                        }
-                        else {
-                            m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
-                            pptr_mram_num += pptr_wram_num;
-                            pptr_buf_wram[0] = addr;
-                            pptr_wram_num = 1;
-                        }
+            children = bnode_load_children(b_addr, bnode.children);
+            for(i = 0; i < DB_SIZE; i++) {
+                addr = children[i];
+                if(valid_pptr(addr)) {
+                    addr.info = (int8_t)fetch_all;
+                    if(pptr_wram_num < BOX_QUERY_WRAM_BUFFER_SIZE) {
+                        pptr_buf_wram[pptr_wram_num] = addr;
+                        pptr_wram_num++;
+                    }
+                    else {
+                        m_write(pptr_buf_wram, pptr_buf_mram + pptr_mram_num, S64(pptr_wram_num));
+                        pptr_mram_num += pptr_wram_num;
+                        pptr_buf_wram[0] = addr;
+                        pptr_wram_num = 1;
                     }
                 }
             }
@@ -190,4 +649,4 @@ static inline int box_range_fetch(vectorT *vec_min, vectorT *vec_max, varlen_buf
     return nr_count;
 }
 
-#endif
\ No newline at end of file
+#endif
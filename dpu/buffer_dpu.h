@@ -9,7 +9,7 @@
 #include "configs_dpu.h"
 #include "geometry.h"
 
-#ifdef BOX_RANGE_FETCH_ON
+#if (defined BOX_RANGE_FETCH_ON) || (defined DELETE_NODE_ON)
 
 #define VARLEN_BUFFER_SIZE (60)
 #define VARLEN_BUFFER_SIZE_IN_BYTES (512)  // VARLEN_BUFFER_SIZE_IN_BYTES = VARLEN_BUFFER_SIZE * sizeof(int64_t)
@@ -4,6 +4,10 @@
 
 #define MAX_KNN_SIZE_DPU (125)
 
+/* kNN visits the candidate subtrees closest-first, through a WRAM min-heap that overflows into MRAM */
+#define KNN_BEST_FIRST_ON
+#define KNN_CANDIDATE_HEAP_SIZE (32)
+
 /* DPU Buffer Size */
 
 #define B_BUFFER_SIZE (12 << 20) // 12 MB
@@ -11,6 +15,17 @@
 
 #define MRAM_BUFFER_SIZE (3 << 19) // 1.5 MB
 
+/* WRAM copies of the top B node levels, shared by all tasklets */
+
+#define WRAM_BNODE_CACHE_LEVELS (2)
+#define WRAM_BNODE_CACHE_SIZE (17)  // 1 + DB_SIZE: the root and its B node children
+#define WRAM_BNODE_CACHE_HASH_SIZE (64)  // Power of two
+
+/* Number of nodes each tasklet claims at once from the node buffers */
+
+#define BNODE_SLAB_SIZE (16)
+#define PNODE_SLAB_SIZE (32)
+
 /* DPU Locks */
 
 #define BNODE_LOCK_NUM (16)
@@ -11,6 +11,7 @@
 #include "single_node.h"
 #include "box_range.h"
 #include "knn.h"
+#include "rebalance.h"
 
 BARRIER_INIT(exec_barrier, NR_TASKLETS);
 
@@ -62,7 +63,7 @@ void execute(int l, int r) {
         case SINGLE_KEY_SEARCH_TSK: {
             init_block_with_type(Single_key_search_task, Single_key_search_reply);
             init_task_reader(l);
-            uint64_t key;
+            KEY_TYPE key;
             Single_key_search_task* tsk;
             Single_key_search_reply tsr;
             pptr addr;
@@ -80,11 +81,31 @@ void execute(int l, int r) {
         }
 #endif
 
+        // Served by every binary
+        case POINT_LOOKUP_TSK: {
+            init_block_with_type(Point_lookup_task, Point_lookup_reply);
+            init_task_reader(l);
+            Point_lookup_task* tsk;
+            Point_lookup_reply tsr;
+            mPptr p_addr;
+            int slot;
+            for (int i = l; i < r; i++) {
+                tsk = (Point_lookup_task*)get_task_cached(i);
+                slot = point_lookup(&(tsk->v), &p_addr);
+                tsr.found = (slot >= 0);
+#ifdef POINT_PAYLOAD_ON
+                tsr.payload[0] = (slot >= 0 ? p_addr->payloads[slot] : 0);
+#endif
+                push_fixed_reply(i, &tsr);
+            }
+            break;
+        }
+
 #ifdef INSERT_NODE_ON
         case SINGLE_SEARCH_TSK: {
             init_block_with_type(Single_search_task, Single_search_reply);
             init_task_reader(l);
-            uint64_t key;
+            KEY_TYPE key;
             Single_search_task* tsk;
             Single_search_reply tsr;
             for (int i = l; i < r; i++) {
@@ -100,26 +121,141 @@ void execute(int l, int r) {
             init_block_with_type(Single_insert_task, empty_task_reply);
             int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
             mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
-            uint64_t key_buf_wram[INSERT_WRAM_KEY_BUF_SIZE];
+            KEY_TYPE key_buf_wram[INSERT_WRAM_KEY_BUF_SIZE];
             for (int i = l; i < r; i++) {
                 __mram_ptr Single_insert_task* tsk = (__mram_ptr Single_insert_task*)get_task(i);
+                single_insert(tsk->addr, tsk->len, tsk->v PAYLOAD_ARG((mppayload)(tsk->v + tsk->len)), buf, buf_size, key_buf_wram);
+            }
+            // Apply the ancestor counters once no tasklet changes the tree
+            barrier_wait(&exec_barrier);
+            counter_log_apply();
+            break;
+        }
+
+        case SINGLE_INSERT_FROM_TSK: {
+            init_block_with_type(Single_insert_from_task, Single_insert_from_reply);
+            int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
+            mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
+            KEY_TYPE key_buf_wram[INSERT_WRAM_KEY_BUF_SIZE];
+            Single_insert_from_reply tsr;
+            for (int i = l; i < r; i++) {
+                __mram_ptr Single_insert_from_task* tsk = (__mram_ptr Single_insert_from_task*)get_task(i);
+                mBptr b_addr = pptr_to_mbptr(tsk->addr);
+                single_insert_from(b_addr, tsk->len, tsk->v PAYLOAD_ARG((mppayload)(tsk->v + tsk->len)), buf, buf_size, key_buf_wram);
+
+                // Report the B node now in this slot to grow the host replica
+                tsr.addr = b_addr->children[tsk->addr.info];
+                if(tsr.addr.data_type == B_NODE_DATA_TYPE) {
+                    b_addr = pptr_to_mbptr(tsr.addr);
+                    tsr.key = b_addr->key;
+                    tsr.height = b_addr->height;
+                }
+                else tsr.addr = null_pptr;
+                push_fixed_reply(i, &tsr);
+            }
+            barrier_wait(&exec_barrier);
+            counter_log_apply();
+            break;
+        }
+#endif
+
+#ifdef DELETE_NODE_ON
+        case SINGLE_DELETE_TSK: {
+            init_block_with_type(Single_delete_task, Single_delete_reply);
+            Single_delete_reply tsr;
+            for (int i = l; i < r; i++) {
+                __mram_ptr Single_delete_task* tsk = (__mram_ptr Single_delete_task*)get_task(i);
                 pptr addr = tsk->addr;
-                int len = tsk->len;
-                mBptr b_addr;
+                tsr.count = 0;
                 if(addr.data_type == P_NODE_DATA_TYPE) {
                     mPptr p_addr = pptr_to_mpptr(addr);
-                    b_addr = load_node_parent(p_addr->parent);
-                    p_insert(p_addr, addr.info, len, tsk->v, buf, buf_size, key_buf_wram);
-                    maintain_ancestor_counter(b_addr, len);
+                    mBptr b_addr = load_node_parent(p_addr->parent);
+                    Bnode_aggregate deleted;
+#ifdef BNODE_AGGREGATE_ON
+                    aggregate_reset(&deleted);
+#endif
+                    tsr.count = p_delete(p_addr, addr.info, tsk->len, tsk->v, &deleted);
+                    counter_log_push(b_addr, -tsr.count, &deleted);
                 }
-                else if(addr.data_type == B_NODE_DATA_TYPE) {
-                    b_addr = pptr_to_mbptr(addr);
-                    b_addr = b_insert(b_addr, addr.info, len, tsk->v, buf, buf_size, key_buf_wram);
-                    maintain_ancestor_counter(b_addr, len);
+                push_fixed_reply(i, &tsr);
+            }
+            // Restructure after all tasklets finished unlinking empty P nodes and applying their counters
+            barrier_wait(&exec_barrier);
+            counter_log_apply();
+            barrier_wait(&exec_barrier);
+            if (tasklet_id == 0) {
+#ifdef BNODE_AGGREGATE_ON
+                for (int i = 0; i < recv_block_task_cnt; i++) {
+                    __mram_ptr Single_delete_task* tsk = (__mram_ptr Single_delete_task*)get_task(i);
+                    if(tsk->addr.data_type == P_NODE_DATA_TYPE) bnode_refresh_box(load_node_parent(pptr_to_mpptr(tsk->addr)->parent));
+                }
+#endif
+                for (int i = 0; i < recv_block_task_cnt; i++) {
+                    __mram_ptr Single_delete_task* tsk = (__mram_ptr Single_delete_task*)get_task(i);
+                    pptr addr = tsk->addr;
+                    if(addr.data_type == P_NODE_DATA_TYPE) {
+                        mPptr p_addr = pptr_to_mpptr(addr);
+                        if(p_addr->num == 0 && p_addr->height != INVALID_NODE_HEIGHT) {
+                            b_collapse(load_node_parent(p_addr->parent));
+                            free_pnode(p_addr);
+                        }
+                    }
                 }
             }
             break;
         }
+
+        case DPU_COMPACT_TSK: {
+            init_block_with_type(dpu_compact_task, dpu_compact_reply);
+            if (tasklet_id == 0) {
+                init_task_reader(0);
+                dpu_compact_reply tsr;
+                storage_compact();
+                tsr.bcnt = bcnt;
+                tsr.pcnt = pcnt;
+                push_fixed_reply(0, &tsr);
+            }
+            break;
+        }
+
+        case DPU_SAMPLE_TSK: {
+            init_block_with_type(dpu_sample_task, dpu_sample_reply);
+            if (tasklet_id == 0) {
+                init_task_reader(0);
+                int sample_num = ((dpu_sample_task*)get_task_cached(0))->sample_num;
+                mpvoid buf = (mpvoid)mrambuffer;
+                varlen_buffer_in_mram *varlen_buf = varlen_buffer_in_mram_new((mpint64_t)(buf + (MRAM_BUFFER_SIZE >> 2)));
+                int64_t count = dpu_point_count(buf);
+                int len = dpu_sample_keys(count, sample_num, varlen_buf, buf);
+                __mram_ptr dpu_sample_reply *replyptr = (__mram_ptr dpu_sample_reply*)push_variable_reply_zero_copy(tasklet_id, DPU_SAMPLE_REP_SIZE(len));
+                replyptr->count = count;
+                replyptr->len = len;
+                varlen_buffer_in_mram_to_mram(varlen_buf, (mpint64_t)(replyptr->keys), varlen_buf->len);
+            }
+            break;
+        }
+
+        case DPU_EXPORT_TSK: {
+            init_block_with_type(dpu_export_task, dpu_export_reply);
+            if (tasklet_id == 0) {
+                init_task_reader(0);
+                dpu_export_task tsk = *((dpu_export_task*)get_task_cached(0));
+                mpvoid buf = (mpvoid)mrambuffer;
+                varlen_buffer_in_mram *varlen_buf = varlen_buffer_in_mram_new((mpint64_t)(buf + (MRAM_BUFFER_SIZE >> 2)));
+                int limit = (tsk.limit < DPU_EXPORT_MAX_LEN ? tsk.limit : DPU_EXPORT_MAX_LEN);
+#ifdef POINT_PAYLOAD_ON
+                varlen_buffer_in_mram *payload_buf = varlen_buffer_in_mram_new((mpint64_t)(buf + (MRAM_BUFFER_SIZE >> 2) * 3));
+#endif
+                int len = dpu_export_outside(tsk.range_start, tsk.range_end, limit, varlen_buf PAYLOAD_ARG(payload_buf), buf);
+                __mram_ptr dpu_export_reply *replyptr = (__mram_ptr dpu_export_reply*)push_variable_reply_zero_copy(tasklet_id, DPU_EXPORT_REP_SIZE(len));
+                replyptr->len = len;
+                varlen_buffer_in_mram_to_mram(varlen_buf, (mpint64_t)(replyptr->v), varlen_buf->len);
+#ifdef POINT_PAYLOAD_ON
+                varlen_buffer_in_mram_to_mram(payload_buf, (mpint64_t)(replyptr->v + len), payload_buf->len);
+#endif
+            }
+            break;
+        }
 #endif
 
 #ifdef BOX_RANGE_COUNT_ON
@@ -137,27 +273,130 @@ void execute(int l, int r) {
             }
             break;
         }
+
+        case BOX_COUNT_APPROX_TSK: {
+            init_block_with_type(Box_count_approx_task, Box_count_approx_reply);
+            init_task_reader(l);
+            int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
+            mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
+            Box_count_approx_task tsk;
+            Box_count_approx_reply tsr;
+            for (int i = l; i < r; i++) {
+                tsk = *((Box_count_approx_task*)get_task_cached(i));
+                tsr.count = box_range_count_approx(&(tsk.vec_min), &(tsk.vec_max), tsk.budget, tsk.max_depth, &(tsr.lower), &(tsr.upper), buf);
+                push_fixed_reply(i, &tsr);
+            }
+            break;
+        }
+
+        case BOX_AGGREGATE_TSK: {
+            init_block_with_type(Box_aggregate_task, Box_aggregate_reply);
+            init_task_reader(l);
+            int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
+            mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
+            Box_aggregate_task tsk;
+            Box_aggregate_reply tsr;
+            Bnode_aggregate agg;
+            for (int i = l; i < r; i++) {
+                tsk = *((Box_aggregate_task*)get_task_cached(i));
+                tsr.count = box_range_aggregate(&(tsk.vec_min), &(tsk.vec_max), &agg, buf);
+                tsr.sum = agg.sum;
+                tsr.box_min = agg.box_min;
+                tsr.box_max = agg.box_max;
+                push_fixed_reply(i, &tsr);
+            }
+            break;
+        }
+
+        case BALL_COUNT_TSK: {
+            init_block_with_type(Ball_count_task, Box_count_reply);
+            init_task_reader(l);
+            int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
+            mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
+            Ball_count_task tsk;
+            Box_count_reply tsr;
+            for (int i = l; i < r; i++) {
+                tsk = *((Ball_count_task*)get_task_cached(i));
+                tsr.count = ball_range_count(&(tsk.center), tsk.radius, buf);
+                push_fixed_reply(i, &tsr);
+            }
+            break;
+        }
 #endif
 
 #ifdef BOX_RANGE_FETCH_ON
-        case BOX_FETCH_TSK: {
-            init_block_with_type(Box_fetch_task, Box_fetch_reply);
+        case BOX_FETCH_TSK: {}
+        case BALL_FETCH_TSK: {
+            if(recv_block_task_type == BOX_FETCH_TSK) {init_block_with_type(Box_fetch_task, Box_fetch_reply);}
+            else {init_block_with_type(Ball_fetch_task, Box_fetch_reply);}
             init_task_reader(l);
-            Box_fetch_task tsk;
             int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
             mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
             int buf_size2 = buf_size / (MULTIPLY_DB_SIZE(NR_DIMENSION) >> 1);
             varlen_buffer_in_mram *varlen_buf;
             varlen_buf = varlen_buffer_in_mram_new(buf + buf_size2);
+#ifdef POINT_PAYLOAD_ON
+            // Payloads take their share of the space after the vectors
+            varlen_buffer_in_mram *payload_buf;
+            payload_buf = varlen_buffer_in_mram_new(buf + buf_size2 + (((buf_size - buf_size2) * NR_DIMENSION / (NR_DIMENSION + PAYLOAD_WORDS)) & ~7));
+#endif
             int64_t num;
+            KEY_TYPE cursor;
+            bool more;
             for (int i = l; i < r; i++) {
-                tsk = *((Box_fetch_task*)get_task_cached(i));
-                num = box_range_fetch(&(tsk.vec_min), &(tsk.vec_max), varlen_buf, buf);
+                if(recv_block_task_type == BOX_FETCH_TSK) {
+                    Box_fetch_task *tsk = (Box_fetch_task*)get_task_cached(i);
+                    cursor = INVALID_KEY;
+                    num = box_range_fetch(&(tsk->vec_min), &(tsk->vec_max), &cursor, INT64_MAX, &more, varlen_buf PAYLOAD_ARG(payload_buf), buf);
+                }
+                else {
+                    Ball_fetch_task *tsk = (Ball_fetch_task*)get_task_cached(i);
+                    num = ball_range_fetch(&(tsk->center), tsk->radius, varlen_buf PAYLOAD_ARG(payload_buf), buf);
+                }
                 IN_DPU_ASSERT(varlen_buf->len == MULTIPLY_NR_DIMENSION(num), "Box fetch err\n");
                 __mram_ptr Box_fetch_reply *replyptr = (__mram_ptr Box_fetch_reply*)push_variable_reply_zero_copy(tasklet_id, BOX_FETCH_REP_SIZE(num));
                 replyptr->len = num;
                 varlen_buffer_in_mram_to_mram(varlen_buf, (mpint64_t)(replyptr->v), varlen_buf->len);
                 varlen_buffer_in_mram_reset(varlen_buf);
+#ifdef POINT_PAYLOAD_ON
+                IN_DPU_ASSERT(payload_buf->len == PAYLOAD_WORDS * num, "Box fetch err\n");
+                varlen_buffer_in_mram_to_mram(payload_buf, (mpint64_t)(replyptr->v + num), payload_buf->len);
+                varlen_buffer_in_mram_reset(payload_buf);
+#endif
+            }
+            break;
+        }
+
+        case BOX_FETCH_STREAM_TSK: {
+            init_block_with_type(Box_fetch_stream_task, Box_fetch_stream_reply);
+            init_task_reader(l);
+            Box_fetch_stream_task tsk;
+            int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
+            mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
+            int buf_size2 = buf_size / (MULTIPLY_DB_SIZE(NR_DIMENSION) >> 1);
+            varlen_buffer_in_mram *varlen_buf;
+            varlen_buf = varlen_buffer_in_mram_new(buf + buf_size2);
+#ifdef POINT_PAYLOAD_ON
+            varlen_buffer_in_mram *payload_buf;
+            payload_buf = varlen_buffer_in_mram_new(buf + buf_size2 + (((buf_size - buf_size2) * NR_DIMENSION / (NR_DIMENSION + PAYLOAD_WORDS)) & ~7));
+#endif
+            int64_t num;
+            bool more;
+            for (int i = l; i < r; i++) {
+                tsk = *((Box_fetch_stream_task*)get_task_cached(i));
+                num = box_range_fetch(&(tsk.vec_min), &(tsk.vec_max), &(tsk.cursor), tsk.limit, &more, varlen_buf PAYLOAD_ARG(payload_buf), buf);
+                IN_DPU_ASSERT(varlen_buf->len == MULTIPLY_NR_DIMENSION(num), "Box fetch err\n");
+                __mram_ptr Box_fetch_stream_reply *replyptr = (__mram_ptr Box_fetch_stream_reply*)push_variable_reply_zero_copy(tasklet_id, BOX_FETCH_STREAM_REP_SIZE(num));
+                replyptr->len = num;
+                replyptr->more = more;
+                replyptr->cursor = tsk.cursor;
+                varlen_buffer_in_mram_to_mram(varlen_buf, (mpint64_t)(replyptr->v), varlen_buf->len);
+                varlen_buffer_in_mram_reset(varlen_buf);
+#ifdef POINT_PAYLOAD_ON
+                IN_DPU_ASSERT(payload_buf->len == PAYLOAD_WORDS * num, "Box fetch err\n");
+                varlen_buffer_in_mram_to_mram(payload_buf, (mpint64_t)(replyptr->v + num), payload_buf->len);
+                varlen_buffer_in_mram_reset(payload_buf);
+#endif
             }
             break;
         }
@@ -173,10 +412,14 @@ void execute(int l, int r) {
             int buf_size = MRAM_BUFFER_SIZE / NR_TASKLETS;
             mpvoid buf = (mpvoid)mrambuffer + buf_size * tasklet_id;
             heap_dpu *heap = heap_dpu_new(0, buf);
-            buf += S64(MAX_KNN_SIZE_DPU + MULTIPLY_NR_DIMENSION(MAX_KNN_SIZE_DPU));
-            buf_size -= S64(MAX_KNN_SIZE_DPU + MULTIPLY_NR_DIMENSION(MAX_KNN_SIZE_DPU));
+#ifdef KNN_BEST_FIRST_ON
+            candidate_heap_dpu *candidates = candidate_heap_dpu_new();
+#endif
+            buf += S64(MAX_KNN_SIZE_DPU + MULTIPLY_NR_DIMENSION(MAX_KNN_SIZE_DPU) + PAYLOAD_WORDS * MAX_KNN_SIZE_DPU);
+            buf_size -= S64(MAX_KNN_SIZE_DPU + MULTIPLY_NR_DIMENSION(MAX_KNN_SIZE_DPU) + PAYLOAD_WORDS * MAX_KNN_SIZE_DPU);
             knn_task knn_tsk;
             uint8_t k_max;
+            int reply_num;
             for (int i = l; i < r; i++) {
                 knn_tsk = *((knn_task*)get_task_cached(i));
                 radius = ((recv_block_task_type == KNN_TSK) ? INT64_MAX : ((knn_bounded_task*)get_task_cached(i))->radius);
@@ -186,8 +429,18 @@ void execute(int l, int r) {
                 k_max = knn_tsk.k;
 #endif
                 heap_dpu_init(heap, GEOMETRY_MIN(k_max, MAX_KNN_SIZE_DPU));
+#ifdef KNN_BEST_FIRST_ON
+                knn(&knn_tsk.center, radius, heap, candidates, buf, buf_size);
+#else
                 knn(&knn_tsk.center, radius, heap, buf, buf_size);
-                __mram_ptr knn_reply *replyptr = (__mram_ptr knn_reply*)push_variable_reply_zero_copy(tasklet_id, KNN_REP_SIZE(heap->num));
+#endif
+#if (LX_NORM == 2) && !defined(LX_NORM_ON_DPU)
+                reply_num = heap->num;
+#else
+                // A knn_task reply has no point count, so the points are padded to k and the payloads follow at v + k
+                reply_num = ((recv_block_task_type == KNN_TSK) ? k_max : heap->num);
+#endif
+                __mram_ptr knn_reply *replyptr = (__mram_ptr knn_reply*)push_variable_reply_zero_copy(tasklet_id, KNN_REP_SIZE(reply_num));
 #if (LX_NORM == 2) && !defined(LX_NORM_ON_DPU)
                 replyptr->len = heap->num;
 #else
@@ -203,6 +456,9 @@ void execute(int l, int r) {
                 else replyptr->len = heap->num;
 #endif
                 if(heap->num > 0) mram_to_mram(replyptr->v, heap->vector_storage, S64(MULTIPLY_NR_DIMENSION(heap->num)));
+#ifdef POINT_PAYLOAD_ON
+                if(heap->num > 0) mram_to_mram((mpvoid)(replyptr->v + reply_num), heap->payload_storage, S64(PAYLOAD_WORDS * heap->num));
+#endif
             }
             break;
         }
@@ -212,7 +468,7 @@ void execute(int l, int r) {
         case FETCH_NODE_W_KEY_TSK: {
             init_block_with_type(Fetch_node_w_key_task, Fetch_node_reply);
             init_task_reader(l);
-            uint64_t key;
+            KEY_TYPE key;
             Fetch_node_w_key_task* tsk;
             pptr addr;
             for (int i = l; i < r; i++) {
@@ -246,6 +502,10 @@ void execute(int l, int r) {
                 dpu_storage_stat_reply tsr;
                 tsr.bcnt = bcnt;
                 tsr.pcnt = pcnt;
+                tsr.bfree = free_list_total(b_free_num);
+                tsr.pfree = free_list_total(p_free_num);
+                tsr.bslab_unused = slab_unused_total(b_slab_next, b_slab_end);
+                tsr.pslab_unused = slab_unused_total(p_slab_next, p_slab_end);
                 push_fixed_reply(0, &tsr);
             }
             break;
@@ -263,7 +523,25 @@ void execute(int l, int r) {
 }
 
 void init() {
-    
+    // Blocks that change B nodes descend through MRAM; the next read-only block rebuilds the WRAM copies
+    switch (recv_block_task_type) {
+#ifdef DPU_INIT_ON
+        case INIT_TSK:
+#endif
+#ifdef INSERT_NODE_ON
+        case SINGLE_INSERT_TSK:
+        case SINGLE_INSERT_FROM_TSK:
+#endif
+#ifdef DELETE_NODE_ON
+        case SINGLE_DELETE_TSK:
+        case DPU_COMPACT_TSK:
+#endif
+            bnode_cache_invalidate();
+            break;
+        default:
+            if(bnode_cache.num == 0) bnode_cache_build();
+            break;
+    }
 }
 
 int main() {
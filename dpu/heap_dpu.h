@@ -17,6 +17,9 @@ typedef struct heap_dpu {
     uint8_t max_k;
     mpint64_t distance_storage;
     mpvector vector_storage;
+#ifdef POINT_PAYLOAD_ON
+    mppayload payload_storage;
+#endif
     uint8_t arr[MAX_KNN_SIZE_DPU];
 } heap_dpu;
 
@@ -30,6 +33,9 @@ static inline heap_dpu* heap_dpu_new(uint8_t max_k, mpvoid data_storage) {
     heap_dpu_init(new_heap, max_k);
     new_heap->distance_storage = data_storage;
     new_heap->vector_storage = (mpvector)(data_storage + S64(MAX_KNN_SIZE_DPU));
+#ifdef POINT_PAYLOAD_ON
+    new_heap->payload_storage = (mppayload)(data_storage + S64(MAX_KNN_SIZE_DPU + MULTIPLY_NR_DIMENSION(MAX_KNN_SIZE_DPU)));
+#endif
     return new_heap;
 }
 
@@ -91,7 +97,7 @@ static inline void dequeue(heap_dpu* heap) {
     heapify_down(heap, 0);
 }
 
-static inline void enqueue(heap_dpu* heap, int64_t distance, vectorT *vec) {
+static inline void enqueue(heap_dpu* heap, int64_t distance, vectorT *vec PAYLOAD_ARG(PAYLOAD_TYPE payload)) {
     uint8_t pt;
     if(heap->num >= heap->max_k) {
         pt = heap->arr[0];
@@ -103,9 +109,70 @@ static inline void enqueue(heap_dpu* heap, int64_t distance, vectorT *vec) {
     }
     heap->distance_storage[pt] = distance;
     heap->vector_storage[pt] = *vec;
+#ifdef POINT_PAYLOAD_ON
+    heap->payload_storage[pt] = payload;
+#endif
     heap->arr[heap->num] = pt;
     heapify_up(heap, heap->num);
     heap->num++;
 }
 
+#ifdef KNN_BEST_FIRST_ON
+
+/* A subtree to visit, with the distance from the center to its box */
+typedef struct knn_candidate {
+    int64_t distance;
+    pptr addr;
+} knn_candidate;
+
+typedef __mram_ptr knn_candidate* mpknn_candidate;
+
+/* A min heap of kNN candidates in WRAM */
+typedef struct candidate_heap_dpu {
+    int num;
+    knn_candidate arr[KNN_CANDIDATE_HEAP_SIZE];
+} candidate_heap_dpu;
+
+static inline candidate_heap_dpu* candidate_heap_dpu_new() {
+    candidate_heap_dpu *new_heap = (candidate_heap_dpu*) mem_alloc(sizeof(candidate_heap_dpu));
+    new_heap->num = 0;
+    return new_heap;
+}
+
+/* Return false if the heap is full */
+static inline bool candidate_enqueue(candidate_heap_dpu *heap, int64_t distance, pptr addr) {
+    int index, parent;
+    if(heap->num >= KNN_CANDIDATE_HEAP_SIZE) return false;
+    index = heap->num;
+    heap->num++;
+    while(index > 0) {
+        parent = (index - 1) >> 1;
+        if(heap->arr[parent].distance <= distance) break;
+        heap->arr[index] = heap->arr[parent];
+        index = parent;
+    }
+    heap->arr[index].distance = distance;
+    heap->arr[index].addr = addr;
+    return true;
+}
+
+static inline knn_candidate candidate_dequeue(candidate_heap_dpu *heap) {
+    knn_candidate ret = heap->arr[0], last;
+    int index = 0, child;
+    heap->num--;
+    last = heap->arr[heap->num];
+    while(true) {
+        child = (index << 1) + 1;
+        if(child >= heap->num) break;
+        if(child + 1 < heap->num && heap->arr[child + 1].distance < heap->arr[child].distance) child++;
+        if(last.distance <= heap->arr[child].distance) break;
+        heap->arr[index] = heap->arr[child];
+        index = child;
+    }
+    heap->arr[index] = last;
+    return ret;
+}
+
+#endif
+
 #endif
@@ -31,28 +31,205 @@ bool radius_contained_in_box_dpu(vectorT *v, COORD radius, vectorT *box_min, vec
 
 #ifdef KNN_ON
 
+COORD norm_accumulate(COORD acc, COORD diff);
+COORD norm_accumulate_dpu(COORD acc, COORD diff);
+
+/* Offer the vectors of a P node to the heap. Return the radius, which shrinks once the heap is full. */
+static inline int64_t knn_scan_pnode(vectorT *center, int64_t radius, heap_dpu *heap, mPptr p_addr, Pnode *pnode) {
+    int num = p_addr->num, i;
+    int64_t distance;
+    vectorT vec;
+#ifdef DPU_PNODE_SOA
+    // Partial norms over the columns read so far; the remaining columns are skipped once every vector is out
+    int64_t partial[LEAF_SIZE];
+    uint32_t mask = (((uint32_t)1) << num) - 1;
+    COORD c, *col;
+    int d;
+    for(i = 0; i < LEAF_SIZE; i++) partial[i] = 0;
+    for(d = 0; d < NR_DIMENSION && mask != 0; d++) {
+        col = pnode->cols[d];
+        m_read(p_addr->cols[d], col, S64(LEAF_SIZE));
+        c = VECTOR_COORD(center, d);
+#pragma unroll
+        for(i = 0; i < LEAF_SIZE; i++) {
+#ifdef LX_NORM_ON_DPU
+            partial[i] = norm_accumulate(partial[i], llabs(col[i] - c));
+#else
+            partial[i] = norm_accumulate_dpu(partial[i], llabs(col[i] - c));
+#endif
+            mask &= ~(((uint32_t)(partial[i] > radius)) << i);
+        }
+    }
+    for(i = 0; mask != 0; i++, mask >>= 1) {
+        distance = partial[i];
+        if((mask & 1) && distance <= radius) {
+            pnode_column_vector(pnode, i, &vec);
+            enqueue(heap, distance, &vec PAYLOAD_ARG(p_addr->payloads[i]));
+            if(heap->num == heap->max_k) radius = heap->distance_storage[heap->arr[0]];
+        }
+    }
+#else
+    pnode_read_vectors(p_addr, pnode->v, num);
+    for(i = 0; i < num; i++) {
+        vec = vector_sub(pnode->v + i, center);
+#ifdef LX_NORM_ON_DPU
+        distance = vector_norm(&vec);
+#else
+        distance = vector_norm_dpu(&vec);
+#endif
+        if(distance <= radius) {
+            enqueue(heap, distance, pnode->v + i PAYLOAD_ARG(p_addr->payloads[i]));
+            if(heap->num == heap->max_k) radius = heap->distance_storage[heap->arr[0]];
+        }
+    }
+#endif
+    return radius;
+}
+
+#ifdef KNN_BEST_FIRST_ON
+
+COORD box_distance(vectorT *v, vectorT *box_min, vectorT *box_max);
+COORD box_distance_dpu(vectorT *v, vectorT *box_min, vectorT *box_max);
+
+/* Queue a subtree unless its box is out of the radius. Candidates that do not fit in WRAM go to the MRAM ring buffer. */
+static inline void knn_push_candidate(vectorT *center, int64_t radius, pptr addr, candidate_heap_dpu *candidates,
+                                      mpknn_candidate buf, mpknn_candidate buf_end, mpknn_candidate *tail) {
+    vectorT box[2];
+    int64_t distance;
+    Bnode *cached;
+    if(addr.data_type == B_NODE_DATA_TYPE) {
+        cached = bnode_cache_find(pptr_to_mbptr(addr));
+        if(cached != NULL) {
+            box[0] = cached->box_min;
+            box[1] = cached->box_max;
+        }
+        else m_read(&(pptr_to_mbptr(addr)->box_min), box, S64(MULTIPLY_NR_DIMENSION(2)));
+    }
+    else m_read(&(pptr_to_mpptr(addr)->box_min), box, S64(MULTIPLY_NR_DIMENSION(2)));
+#ifdef LX_NORM_ON_DPU
+    distance = box_distance(center, box, box + 1);
+#else
+    distance = box_distance_dpu(center, box, box + 1);
+#endif
+    if(distance > radius) return;
+    if(!candidate_enqueue(candidates, distance, addr)) {
+        (*tail)->distance = distance;
+        (*tail)->addr = addr;
+        (*tail)++; if(*tail >= buf_end) *tail = buf;
+    }
+}
+
+/*
+    Same walk up from the leaf of the center as the breadth-first version, but the subtrees of each level are visited
+    closest-first, so the radius shrinks before the farther P nodes are read, and P nodes are pruned by their boxes.
+*/
+static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, candidate_heap_dpu *candidates, mpvoid buf, int buf_size) {
+    pptr parent = b_search(coord_to_key(center), true), addr;
+    mpknn_candidate cand_buf = (mpknn_candidate)buf, cand_buf_end = cand_buf + buf_size / sizeof(knn_candidate);
+    mpknn_candidate cand_head, cand_tail;
+    knn_candidate cand;
+    int8_t child_idx = -1;
+    KEY_TYPE key;
+    mBptr b_addr = root;
+    mPptr p_addr;
+    Bnode bnode, *bnode_pt;
+    Pnode pnode;
+    pptr *children;
+    vectorT box_min, box_max;
+    bool continue_signal = true;
+    while(continue_signal) {
+        // Queue the subtrees of this level
+        cand_tail = cand_head = cand_buf;
+        candidates->num = 0;
+        if(parent.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(parent);
+            children = bnode_load_children(b_addr, bnode.children);
+            for(int8_t i = 0; i < DB_SIZE; i++) {
+                if(i != child_idx) {
+                    addr = children[i];
+                    if(valid_pptr(addr)) knn_push_candidate(center, radius, addr, candidates, cand_buf, cand_buf_end, &cand_tail);
+                }
+            }
+        }
+        else if(parent.data_type == P_NODE_DATA_TYPE) {
+            knn_push_candidate(center, radius, parent, candidates, cand_buf, cand_buf_end, &cand_tail);
+        }
+        // Best-first search, then the overflowed candidates
+        while(candidates->num > 0 || cand_tail != cand_head) {
+            if(candidates->num > 0) cand = candidate_dequeue(candidates);
+            else {
+                cand = *cand_head;
+                cand_head++; if(cand_head >= cand_buf_end) cand_head = cand_buf;
+            }
+            if(cand.distance > radius) {
+                // Every candidate left in WRAM is at least as far
+                candidates->num = 0;
+                continue;
+            }
+            addr = cand.addr;
+            if(addr.data_type == P_NODE_DATA_TYPE) {
+                radius = knn_scan_pnode(center, radius, heap, pptr_to_mpptr(addr), &pnode);
+            }
+            else if(addr.data_type == B_NODE_DATA_TYPE) {
+                b_addr = pptr_to_mbptr(addr);
+                children = bnode_load_children(b_addr, bnode.children);
+                for(int8_t i = 0; i < DB_SIZE; i++) {
+                    addr = children[i];
+                    if(valid_pptr(addr)) knn_push_candidate(center, radius, addr, candidates, cand_buf, cand_buf_end, &cand_tail);
+                }
+            }
+        };
+        // Prepare for the next iteration
+        if(parent.data_type == B_NODE_DATA_TYPE) {
+            b_addr = pptr_to_mbptr(parent);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            key = bnode_pt->key;
+            box_min = bnode_pt->box_min;
+            box_max = bnode_pt->box_max;
+            b_addr = load_node_parent(bnode_pt->parent);
+        }
+        else if(parent.data_type == P_NODE_DATA_TYPE) {
+            p_addr = pptr_to_mpptr(parent);
+            m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+            key = pnode.key;
+            box_min = pnode.box_min;
+            box_max = pnode.box_max;
+            b_addr = load_node_parent(pnode.parent);
+        }
+        parent = mbptr_to_pptr(b_addr);
+#ifdef LX_NORM_ON_DPU
+        continue_signal = !radius_contained_in_box(center, radius, &box_min, &box_max) && b_addr != INVALID_MBPTR;
+#else
+        continue_signal = !radius_contained_in_box_dpu(center, radius, &box_min, &box_max) && b_addr != INVALID_MBPTR;
+#endif
+        if(continue_signal) child_idx = lookup_next_bit_chunk(key, b_addr->height);
+    };
+}
+
+#else
+
 static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, mpvoid buf, int buf_size) {
     pptr parent = b_search(coord_to_key(center), true), addr;
     mppptr pptr_buf = (mppptr)buf, pptr_buf_end = pptr_buf + buf_size / sizeof(pptr);
     mppptr pptr_head, pptr_tail;
     int8_t child_idx = -1;
-    uint64_t key;
+    KEY_TYPE key;
     mBptr b_addr = root;
     mPptr p_addr;
-    Bnode bnode;
+    Bnode bnode, *bnode_pt;
     Pnode pnode;
+    pptr *children;
     vectorT box_min, box_max;
-    int64_t distance;
     bool continue_signal = true;
     while(continue_signal) {
         // Load subtree nodes into stack
         pptr_tail = pptr_head = pptr_buf;
         if(parent.data_type == B_NODE_DATA_TYPE) {
             b_addr = pptr_to_mbptr(parent);
-            m_read(b_addr->children, bnode.children, S64(DB_SIZE));
+            children = bnode_load_children(b_addr, bnode.children);
             for(int8_t i = 0; i < DB_SIZE; i++) {
                 if(i != child_idx) {
-                    addr = bnode.children[i];
+                    addr = children[i];
                     if(valid_pptr(addr)) {
                         *pptr_tail = addr;
                         pptr_tail++;
@@ -68,21 +245,7 @@ static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, mpvoid b
         while(pptr_tail != pptr_head) {
             addr = *pptr_head;
             if(addr.data_type == P_NODE_DATA_TYPE) {
-                p_addr = pptr_to_mpptr(addr);
-                key = p_addr->num;
-                m_read(p_addr->v, pnode.v, S64(MULTIPLY_NR_DIMENSION(key)));
-                for(uint64_t i = 0; i < key; i++) {
-                    box_max = vector_sub(pnode.v + i, center);
-#ifdef LX_NORM_ON_DPU
-                    distance = vector_norm(&box_max);
-#else
-                    distance = vector_norm_dpu(&box_max);
-#endif
-                    if(distance <= radius) {
-                        enqueue(heap, distance, pnode.v + i);
-                        if(heap->num == heap->max_k) radius = heap->distance_storage[heap->arr[0]];
-                    }
-                }
+                radius = knn_scan_pnode(center, radius, heap, pptr_to_mpptr(addr), &pnode);
             }
             else if(addr.data_type == B_NODE_DATA_TYPE) {
                 b_addr = pptr_to_mbptr(addr);
@@ -93,9 +256,9 @@ static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, mpvoid b
                 continue_signal = radius_intersect_box_dpu(center, radius, &box_min, &box_max);
 #endif
                 if(continue_signal) {
-                    m_read(b_addr->children, bnode.children, S64(DB_SIZE));
+                    children = bnode_load_children(b_addr, bnode.children);
                     for(int8_t i = 0; i < DB_SIZE; i++) {
-                        addr = bnode.children[i];
+                        addr = children[i];
                         if(valid_pptr(addr)) {
                             *pptr_tail = addr;
                             pptr_tail++; if(pptr_tail >= pptr_buf_end) pptr_tail = pptr_buf;
@@ -108,11 +271,11 @@ static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, mpvoid b
         // Prepare for the next iteration
         if(parent.data_type == B_NODE_DATA_TYPE) {
             b_addr = pptr_to_mbptr(parent);
-            m_read(b_addr, &bnode, BNODE_METADATA_SIZE);
-            key = bnode.key;
-            box_min = bnode.box_min;
-            box_max = bnode.box_max;
-            b_addr = load_node_parent(bnode.parent);
+            bnode_pt = bnode_load_metadata(b_addr, &bnode);
+            key = bnode_pt->key;
+            box_min = bnode_pt->box_min;
+            box_max = bnode_pt->box_max;
+            b_addr = load_node_parent(bnode_pt->parent);
         }
         else if(parent.data_type == P_NODE_DATA_TYPE) {
             p_addr = pptr_to_mpptr(parent);
@@ -132,6 +295,8 @@ static inline void knn(vectorT *center, int64_t radius, heap_dpu *heap, mpvoid b
     };
 }
 
+#endif
+
 static inline int64_t sqrt_dpu(uint64_t x) {
     // x is smaller than (1<<(64-__builtin_clzll))
     return ((int64_t)1) << (((64-__builtin_clzll(x)) >> 1) + 1);
@@ -144,10 +309,19 @@ static inline bool knn_first_round_finished(vectorT *center, int64_t radius) {
 #endif
     vector_ones(&vec, radius);
     vec = vector_sub_zero_bounded(center, &vec);
-    if(coord_to_key(&vec) < local_range_start) return false;
+#ifdef HILBERT_KEY_ON
+    // The corners of a box do not bound its keys on the Hilbert curve
+    vectorT vec_max;
+    vector_ones(&vec_max, radius);
+    vec_max = vector_add(center, &vec_max);
+    if(hilbert_box_key_bound(&vec, &vec_max, false) < local_range_start) return false;
+    return hilbert_box_key_bound(&vec, &vec_max, true) <= local_range_end;
+#else
+    if(key_prefix(coord_to_key(&vec)) < local_range_start) return false;
     vector_ones(&vec, radius);
     vec = vector_add(center, &vec);
-    return coord_to_key(&vec) <= local_range_end;
+    return key_prefix(coord_to_key(&vec)) <= local_range_end;
+#endif
 }
 
 #endif
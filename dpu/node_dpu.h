@@ -10,46 +10,109 @@
 #include "common.h"
 #include "configs_dpu.h"
 
+// Store the P node vectors column by column in MRAM
+// #define DPU_PNODE_SOA
+// Store the P node coordinates as 32-bit offsets from box_min in MRAM (needs COORD_MAX <= UINT32_MAX)
+// #define DPU_PNODE_COMPRESSED
+
+#if (defined DPU_PNODE_SOA) && (defined DPU_PNODE_COMPRESSED)
+#error "DPU_PNODE_SOA and DPU_PNODE_COMPRESSED are exclusive"
+#endif
+#if (defined DPU_PNODE_COMPRESSED) && (defined KEY_128_BIT_ON)
+#error "DPU_PNODE_COMPRESSED needs 32-bit coordinates, which KEY_128_BIT_ON does not use"
+#endif
+
+// Compressed P nodes recompute the keys from the coordinates
+#ifndef DPU_PNODE_COMPRESSED
 #define DPU_KEYS_STORED_IN_PNODE
+#endif
 
 /* -------------------------- Make Sure! sizeof(Everything) = 8x -------------------------- */
 typedef __mram_ptr pptr* mppptr;
 typedef __mram_ptr int64_t* mpint64_t;
 typedef __mram_ptr uint8_t* mpuint8_t;
 typedef __mram_ptr uint64_t* mpuint64_t;
+typedef __mram_ptr KEY_TYPE* mpkey;
+#ifdef POINT_PAYLOAD_ON
+typedef __mram_ptr PAYLOAD_TYPE* mppayload;
+#endif
 
 typedef __mram_ptr void* mpvoid;
 
 typedef __mram_ptr struct Bnode* mBptr;
+#ifdef DPU_PNODE_COMPRESSED
+typedef __mram_ptr struct Pnode_mram* mPptr;
+#else
 typedef __mram_ptr struct Pnode* mPptr;
+#endif
 
 #define INVALID_MPPTR ((mPptr)-10)
 #define INVALID_MBPTR ((mBptr)-10)
 
+/* Coordinate sums and tight bounding box of a set of points. Empty sets have box_min > box_max. Sums wrap on int64_t overflow (see BNODE_AGGREGATE_ON). */
+typedef struct Bnode_aggregate {
+    vectorT sum;
+    vectorT box_min;
+    vectorT box_max;
+} Bnode_aggregate;
+
 typedef struct Bnode {
     int16_t height;
-    int16_t subtree_size;
     int32_t parent;
-    uint64_t key;
+    int64_t subtree_size;  // Exact number of points in the subtree
+    KEY_TYPE key;
     vectorT box_min __attribute__((aligned (8)));
     vectorT box_max __attribute__((aligned (8)));
     pptr children[DB_SIZE];
+#ifdef BNODE_AGGREGATE_ON
+    Bnode_aggregate agg;  // Maintained with subtree_size
+#endif
 } Bnode;
-#define BNODE_METADATA_SIZE S64(2 + MULTIPLY_NR_DIMENSION(2))
+#define BNODE_METADATA_SIZE S64(2 + KEY_WORDS + MULTIPLY_NR_DIMENSION(2))
 
 typedef struct Pnode {
     int16_t height;
     int16_t num;
     int32_t parent;
-    uint64_t key;
+    KEY_TYPE key;
     vectorT box_min __attribute__((aligned (8)));
     vectorT box_max __attribute__((aligned (8)));
+#ifdef DPU_PNODE_SOA
+    // cols in MRAM; WRAM copies filled by pnode_load / pnode_read_vectors use v
+    union {
+        vectorT v[LEAF_SIZE];
+        COORD cols[NR_DIMENSION][LEAF_SIZE];
+    };
+#else
     vectorT v[LEAF_SIZE];
+#endif
 #ifdef DPU_KEYS_STORED_IN_PNODE
-    uint64_t keys[LEAF_SIZE];
+    KEY_TYPE keys[LEAF_SIZE];
+#endif
+#ifdef POINT_PAYLOAD_ON
+    PAYLOAD_TYPE payloads[LEAF_SIZE];  // Payload i belongs to vector i
 #endif
 } Pnode;
-#define PNODE_METADATA_SIZE S64(2 + MULTIPLY_NR_DIMENSION(2))
+#define PNODE_METADATA_SIZE S64(1 + KEY_WORDS + MULTIPLY_NR_DIMENSION(2))
+
+/* P nodes as stored in MRAM. The metadata matches Pnode, which WRAM copies always use. */
+#ifdef DPU_PNODE_COMPRESSED
+#define PNODE_OFFSET_NUM (LEAF_SIZE * NR_DIMENSION)
+typedef struct Pnode_mram {
+    int16_t height;
+    int16_t num;
+    int32_t parent;
+    KEY_TYPE key;
+    vectorT box_min __attribute__((aligned (8)));
+    vectorT box_max __attribute__((aligned (8)));
+    uint32_t offsets[PNODE_OFFSET_NUM];  // Coordinate d of vector i at [i * NR_DIMENSION + d]
+#ifdef POINT_PAYLOAD_ON
+    PAYLOAD_TYPE payloads[LEAF_SIZE];
+#endif
+} Pnode_mram;
+#else
+typedef struct Pnode Pnode_mram;
+#endif
 
 
 /* Auxiliary Functions */
@@ -111,3 +174,187 @@ static inline pptr mpptr_to_pptr(const mPptr addr) {
 static inline mPptr pptr_to_mpptr(pptr x) {
     return (valid_pptr(x) ? (mPptr)(p_buffer + x.addr) : INVALID_MPPTR);
 }
+
+/* P node vectors: always go through these, as the MRAM layout depends on DPU_PNODE_SOA */
+
+#ifdef DPU_PNODE_COMPRESSED
+// Offsets of the first num vectors, rounded up to 8 bytes
+#define PNODE_OFFSET_SIZE(num) ((((num) * NR_DIMENSION + 1) >> 1) << 3)
+
+static inline void pnode_decode(vectorT *base, uint32_t *offsets, vectorT *dst, int num) {
+    for(int i = 0; i < num; i++, offsets += NR_DIMENSION) {
+        for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(dst + i, d) = VECTOR_COORD(base, d) + offsets[d];
+    }
+}
+
+static inline void pnode_encode(vectorT *base, vectorT *src, uint32_t *offsets, int num) {
+    for(int i = 0; i < num; i++, offsets += NR_DIMENSION) {
+        for(int d = 0; d < NR_DIMENSION; d++) offsets[d] = (uint32_t)(VECTOR_COORD(src + i, d) - VECTOR_COORD(base, d));
+    }
+}
+#endif
+
+/* Read the first num vectors into dst */
+static inline void pnode_read_vectors(mPptr addr, vectorT *dst, int num) {
+#if defined(DPU_PNODE_COMPRESSED)
+    vectorT base;
+    uint32_t offsets[PNODE_OFFSET_NUM];
+    if(num <= 0) return;
+    m_read(&(addr->box_min), &base, S64(NR_DIMENSION));
+    m_read(addr->offsets, offsets, PNODE_OFFSET_SIZE(num));
+    pnode_decode(&base, offsets, dst, num);
+#elif defined(DPU_PNODE_SOA)
+    COORD col[LEAF_SIZE];
+    if(num <= 0) return;
+    for(int d = 0; d < NR_DIMENSION; d++) {
+        m_read(addr->cols[d], col, S64(num));
+        for(int i = 0; i < num; i++) VECTOR_COORD(dst + i, d) = col[i];
+    }
+#else
+    m_read(addr->v, dst, S64(MULTIPLY_NR_DIMENSION(num)));
+#endif
+}
+
+/* Write num vectors from src into the slots starting at start. Compressed nodes need box_min to be written first. */
+static inline void pnode_write_vectors(vectorT *src, mPptr addr, int start, int num) {
+#if defined(DPU_PNODE_COMPRESSED)
+    vectorT base;
+    uint32_t offsets[PNODE_OFFSET_NUM];
+    if(num <= 0) return;
+    m_read(&(addr->box_min), &base, S64(NR_DIMENSION));
+    m_read(addr->offsets, offsets, sizeof(offsets));
+    pnode_encode(&base, src, offsets + start * NR_DIMENSION, num);
+    m_write(offsets, addr->offsets, sizeof(offsets));
+#elif defined(DPU_PNODE_SOA)
+    COORD col[LEAF_SIZE];
+    if(num <= 0) return;
+    for(int d = 0; d < NR_DIMENSION; d++) {
+        for(int i = 0; i < num; i++) col[i] = VECTOR_COORD(src + i, d);
+        m_write(col, addr->cols[d] + start, S64(num));
+    }
+#else
+    m_write(src, addr->v + start, S64(MULTIPLY_NR_DIMENSION(num)));
+#endif
+}
+
+static inline vectorT pnode_read_vector(mPptr addr, int i) {
+#if defined(DPU_PNODE_COMPRESSED)
+    vectorT ret = addr->box_min;
+    for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&ret, d) += addr->offsets[i * NR_DIMENSION + d];
+    return ret;
+#elif defined(DPU_PNODE_SOA)
+    vectorT ret;
+    for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&ret, d) = addr->cols[d][i];
+    return ret;
+#else
+    return addr->v[i];
+#endif
+}
+
+#ifdef POINT_PAYLOAD_ON
+/* P node payloads: the same slots in every layout */
+static inline void pnode_read_payloads(mPptr addr, PAYLOAD_TYPE *dst, int num) {
+    if(num <= 0) return;
+    m_read(addr->payloads, dst, S64(PAYLOAD_WORDS * num));
+}
+
+static inline void pnode_write_payloads(PAYLOAD_TYPE *src, mPptr addr, int start, int num) {
+    if(num <= 0) return;
+    m_write(src, addr->payloads + start, S64(PAYLOAD_WORDS * num));
+}
+#endif
+
+/* Whole node, with every slot */
+static inline void pnode_load(mPptr addr, Pnode *pnode) {
+#if defined(DPU_PNODE_COMPRESSED)
+    uint32_t offsets[PNODE_OFFSET_NUM];
+    m_read(addr, pnode, PNODE_METADATA_SIZE);
+    m_read(addr->offsets, offsets, sizeof(offsets));
+    pnode_decode(&(pnode->box_min), offsets, pnode->v, pnode->num);
+    memset(pnode->v + pnode->num, 0, sizeof(vectorT) * (LEAF_SIZE - pnode->num));
+#ifdef POINT_PAYLOAD_ON
+    m_read(addr->payloads, pnode->payloads, S64(PAYLOAD_WORDS * LEAF_SIZE));
+#endif
+#elif defined(DPU_PNODE_SOA)
+    m_read(addr, pnode, PNODE_METADATA_SIZE);
+    pnode_read_vectors(addr, pnode->v, LEAF_SIZE);
+#ifdef DPU_KEYS_STORED_IN_PNODE
+    m_read(addr->keys, pnode->keys, S64(KEY_WORDS * LEAF_SIZE));
+#endif
+#ifdef POINT_PAYLOAD_ON
+    m_read(addr->payloads, pnode->payloads, S64(PAYLOAD_WORDS * LEAF_SIZE));
+#endif
+#else
+    m_read(addr, pnode, sizeof(Pnode));
+#endif
+}
+
+static inline void pnode_store(Pnode *pnode, mPptr addr) {
+#if defined(DPU_PNODE_COMPRESSED)
+    uint32_t offsets[PNODE_OFFSET_NUM];
+    int i;
+    pnode_encode(&(pnode->box_min), pnode->v, offsets, pnode->num);
+    for(i = pnode->num * NR_DIMENSION; i < PNODE_OFFSET_NUM; i++) offsets[i] = 0;
+    m_write(pnode, addr, PNODE_METADATA_SIZE);
+    m_write(offsets, addr->offsets, sizeof(offsets));
+#ifdef POINT_PAYLOAD_ON
+    m_write(pnode->payloads, addr->payloads, S64(PAYLOAD_WORDS * LEAF_SIZE));
+#endif
+#elif defined(DPU_PNODE_SOA)
+    m_write(pnode, addr, PNODE_METADATA_SIZE);
+    pnode_write_vectors(pnode->v, addr, 0, LEAF_SIZE);
+#ifdef DPU_KEYS_STORED_IN_PNODE
+    m_write(pnode->keys, addr->keys, S64(KEY_WORDS * LEAF_SIZE));
+#endif
+#ifdef POINT_PAYLOAD_ON
+    m_write(pnode->payloads, addr->payloads, S64(PAYLOAD_WORDS * LEAF_SIZE));
+#endif
+#else
+    m_write(pnode, addr, sizeof(Pnode));
+#endif
+}
+
+#ifdef DPU_PNODE_SOA
+/* Vector i of a WRAM P node whose cols were read directly from MRAM */
+static inline void pnode_column_vector(Pnode *pnode, int i, vectorT *dst) {
+    for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(dst, d) = pnode->cols[d][i];
+}
+#endif
+
+/* Aggregates */
+
+static inline void aggregate_reset(Bnode_aggregate *agg) {
+    for(int d = 0; d < NR_DIMENSION; d++) {
+        VECTOR_COORD(&(agg->sum), d) = 0;
+        VECTOR_COORD(&(agg->box_min), d) = INT64_MAX;
+        VECTOR_COORD(&(agg->box_max), d) = INT64_MIN;
+    }
+}
+
+static inline void aggregate_add_vector(Bnode_aggregate *agg, vectorT *v) {
+    COORD c;
+    for(int d = 0; d < NR_DIMENSION; d++) {
+        c = VECTOR_COORD(v, d);
+        VECTOR_COORD(&(agg->sum), d) += c;
+        if(c < VECTOR_COORD(&(agg->box_min), d)) VECTOR_COORD(&(agg->box_min), d) = c;
+        if(c > VECTOR_COORD(&(agg->box_max), d)) VECTOR_COORD(&(agg->box_max), d) = c;
+    }
+}
+
+static inline void aggregate_merge(Bnode_aggregate *dst, Bnode_aggregate *src) {
+    for(int d = 0; d < NR_DIMENSION; d++) {
+        VECTOR_COORD(&(dst->sum), d) += VECTOR_COORD(&(src->sum), d);
+        if(VECTOR_COORD(&(src->box_min), d) < VECTOR_COORD(&(dst->box_min), d)) VECTOR_COORD(&(dst->box_min), d) = VECTOR_COORD(&(src->box_min), d);
+        if(VECTOR_COORD(&(src->box_max), d) > VECTOR_COORD(&(dst->box_max), d)) VECTOR_COORD(&(dst->box_max), d) = VECTOR_COORD(&(src->box_max), d);
+    }
+}
+
+// Aggregate of num vectors in MRAM
+static inline void aggregate_vectors(Bnode_aggregate *agg, mpvector vec, int num) {
+    vectorT tmp_vec;
+    aggregate_reset(agg);
+    for(int i = 0; i < num; i++) {
+        tmp_vec = vec[i];
+        aggregate_add_vector(agg, &tmp_vec);
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <defs.h>
+#include <mram.h>
+#include <alloc.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "macro.h"
+#include "task_utils.h"
+#include "task_framework_dpu.h"
+#include "node_dpu.h"
+#include "storage.h"
+#include "utils_dpu.h"
+#include "buffer_dpu.h"
+
+/* ----------------- Repartitioning ----------------- */
+
+// Points leave a DPU through the host, which erases and re-inserts them
+#ifdef DELETE_NODE_ON
+
+#define REBALANCE_WRAM_STACK_SIZE (10)
+
+/* Iterate over the P nodes, skipping B node subtrees entirely inside [range_start, range_end) of key prefixes */
+typedef struct pnode_iterator {
+    uint64_t range_start, range_end;
+    mppptr stack_mram;
+    int mram_num, wram_num;
+    pptr stack_wram[REBALANCE_WRAM_STACK_SIZE];
+} pnode_iterator;
+
+// An empty range (range_start > range_end) keeps every subtree
+static inline bool key_in_range(uint64_t key, uint64_t range_start, uint64_t range_end) {
+    return key >= range_start && (key < range_end || range_end == UINT64_MAX);
+}
+
+static inline void pnode_iterator_init(pnode_iterator *it, uint64_t range_start, uint64_t range_end, mpvoid buf) {
+    it->range_start = range_start;
+    it->range_end = range_end;
+    it->stack_mram = (mppptr)buf;
+    it->mram_num = 0;
+    it->wram_num = 1;
+    it->stack_wram[0] = mbptr_to_pptr(root);
+}
+
+static inline mPptr pnode_iterator_next(pnode_iterator *it) {
+    pptr addr;
+    mBptr b_addr;
+    Bnode bnode;
+    uint64_t key_max;
+    int i;
+    while(it->wram_num > 0 || it->mram_num > 0) {
+        if(it->wram_num > 0) {
+            it->wram_num--;
+            addr = it->stack_wram[it->wram_num];
+        }
+        else {
+            m_read(it->stack_mram + it->mram_num - (REBALANCE_WRAM_STACK_SIZE >> 1), it->stack_wram, S64(REBALANCE_WRAM_STACK_SIZE >> 1));
+            it->wram_num = (REBALANCE_WRAM_STACK_SIZE >> 1) - 1;
+            addr = it->stack_wram[it->wram_num];
+            it->mram_num -= (REBALANCE_WRAM_STACK_SIZE >> 1);
+        }
+        if(addr.data_type == P_NODE_DATA_TYPE) return pptr_to_mpptr(addr);
+        b_addr = pptr_to_mbptr(addr);
+        m_read(b_addr, &bnode, BNODE_METADATA_SIZE);
+        key_max = key_prefix(fill_tail_bits(bnode.key, bnode.height));
+        if(key_in_range(key_prefix(bnode.key), it->range_start, it->range_end) && key_in_range(key_max, it->range_start, it->range_end)) continue;
+        m_read(b_addr->children, bnode.children, S64(DB_SIZE));
+        for(i = 0; i < DB_SIZE; i++) {
+            addr = bnode.children[i];
+            if(valid_pptr(addr)) {
+                if(it->wram_num < REBALANCE_WRAM_STACK_SIZE) {
+                    it->stack_wram[it->wram_num] = addr;
+                    it->wram_num++;
+                }
+                else {
+                    m_write(it->stack_wram, it->stack_mram + it->mram_num, S64(it->wram_num));
+                    it->mram_num += it->wram_num;
+                    it->stack_wram[0] = addr;
+                    it->wram_num = 1;
+                }
+            }
+        }
+    }
+    return INVALID_MPPTR;
+}
+
+/* Number of points stored on this DPU */
+static inline int64_t dpu_point_count(mpvoid buf) {
+    pnode_iterator it;
+    mPptr p_addr;
+    int64_t count = 0;
+    pnode_iterator_init(&it, 1, 0, buf);
+    while((p_addr = pnode_iterator_next(&it)) != INVALID_MPPTR) {
+        count += p_addr->num;
+    }
+    return count;
+}
+
+/* Push the keys of sample_num points spread evenly over the count points of this DPU. Return the number of keys. */
+static inline int dpu_sample_keys(int64_t count, int sample_num, varlen_buffer_in_mram *varlen_buf, mpvoid buf) {
+    pnode_iterator it;
+    mPptr p_addr;
+    Pnode pnode;
+    int64_t stride, pos = 0;
+    int i, len = 0;
+    if(count <= 0 || sample_num <= 0) return 0;
+    stride = count / sample_num;
+    if(stride < 1) stride = 1;
+    pnode_iterator_init(&it, 1, 0, buf);
+    while(len < sample_num && (p_addr = pnode_iterator_next(&it)) != INVALID_MPPTR) {
+        m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+        if(pnode.num == 0) continue;
+        pnode_read_vectors(p_addr, pnode.v, pnode.num);
+        for(i = 0; i < pnode.num && len < sample_num; i++, pos++) {
+            if(pos % stride == (stride >> 1)) {
+                varlen_buffer_in_mram_push(varlen_buf, (int64_t)key_prefix(coord_to_key(pnode.v + i)));
+                len++;
+            }
+        }
+    }
+    return len;
+}
+
+/* Push up to limit points whose keys are outside [range_start, range_end), with their payloads when POINT_PAYLOAD_ON. Return the number of points. */
+static inline int dpu_export_outside(uint64_t range_start, uint64_t range_end, int limit, varlen_buffer_in_mram *varlen_buf
+        PAYLOAD_ARG(varlen_buffer_in_mram *payload_buf), mpvoid buf) {
+    pnode_iterator it;
+    mPptr p_addr;
+    Pnode pnode;
+    int i, len = 0;
+    pnode_iterator_init(&it, range_start, range_end, buf);
+    while(len < limit && (p_addr = pnode_iterator_next(&it)) != INVALID_MPPTR) {
+        m_read(p_addr, &pnode, PNODE_METADATA_SIZE);
+        if(pnode.num == 0) continue;
+        pnode_read_vectors(p_addr, pnode.v, pnode.num);
+        for(i = 0; i < pnode.num && len < limit; i++) {
+            if(!key_in_range(key_prefix(coord_to_key(pnode.v + i)), range_start, range_end)) {
+                varlen_buffer_in_mram_push_vector(varlen_buf, pnode.v + i);
+#ifdef POINT_PAYLOAD_ON
+                varlen_buffer_in_mram_push(payload_buf, (int64_t)p_addr->payloads[i]);
+#endif
+                len++;
+            }
+        }
+    }
+    return len;
+}
+
+#endif
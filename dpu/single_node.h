@@ -14,29 +14,38 @@
 
 void vector_min(vectorT *src, vectorT *dst);
 void vector_max(vectorT *src, vectorT *dst);
+bool vector_equal(vectorT *v1, vectorT *v2);
 
 /* ----------------- Search Leaf Node -------------------- */
 
 typedef struct Bnode_metadata_for_search {
     int16_t height;
-    int16_t subtree_size;
     int32_t parent;
-    uint64_t key;
+    int64_t subtree_size;
+    KEY_TYPE key;
 } Bnode_metadata_for_search;
-#define BNODE_METADATA_FOR_SEARCH_SIZE (16)
+#define BNODE_METADATA_FOR_SEARCH_SIZE S64(2 + KEY_WORDS)
 
-static inline pptr b_search(uint64_t key, bool mismatch_return_parent) {
-    mBptr tmp = root;
+/* Search from a B node on the path of the key; b_search starts from the root */
+static inline pptr b_search_from(mBptr start, KEY_TYPE key, bool mismatch_return_parent) {
+    mBptr tmp = start;
     int idx = -1;
     bool continue_sign = true;
     pptr addr;
     Bnode_metadata_for_search bnode;
+    Bnode *cached;
     while(continue_sign) {
         continue_sign = false;
-        m_read(tmp, &bnode, BNODE_METADATA_FOR_SEARCH_SIZE);
+        cached = bnode_cache_find(tmp);
+        if(cached != NULL) {
+            bnode.height = cached->height;
+            bnode.parent = cached->parent;
+            bnode.key = cached->key;
+        }
+        else m_read(tmp, &bnode, BNODE_METADATA_FOR_SEARCH_SIZE);
         if(check_match_height(key, bnode.key, bnode.height)) {
             idx = lookup_next_bit_chunk(key, bnode.height);
-            addr = tmp->children[idx];
+            addr = (cached != NULL ? cached->children[idx] : tmp->children[idx]);
             if(valid_pptr(addr)) {
                 if(addr.data_type == B_NODE_DATA_TYPE) {
                     tmp = pptr_to_mbptr(addr);
@@ -59,21 +68,56 @@ static inline pptr b_search(uint64_t key, bool mismatch_return_parent) {
     return addr;
 }
 
+static inline pptr b_search(KEY_TYPE key, bool mismatch_return_parent) {
+    return b_search_from(root, key, mismatch_return_parent);
+}
+
+/* ----------------- Exact Point Lookup -------------------- */
+
+/* Return the slot of a stored copy of the vector, or -1. Only the P node on the path of its key can hold it. */
+static inline int point_lookup(vectorT *vec, mPptr *p_addr_out) {
+    KEY_TYPE key = coord_to_key(vec);
+    pptr addr = b_search(key, false);
+    if(addr.data_type != P_NODE_DATA_TYPE) return -1;
+    mPptr p_addr = pptr_to_mpptr(addr);
+    int num = p_addr->num, i;
+    *p_addr_out = p_addr;
+    if(num <= 0) return -1;
+#ifdef DPU_KEYS_STORED_IN_PNODE
+    // Compare the keys first, and read a vector only on a key match
+    KEY_TYPE keys[LEAF_SIZE];
+    vectorT tmp_vec;
+    m_read(p_addr->keys, keys, S64(KEY_WORDS * num));
+    for(i = 0; i < num; i++) {
+        if(!key_equal(keys[i], key)) continue;
+        tmp_vec = pnode_read_vector(p_addr, i);
+        if(vector_equal(&tmp_vec, vec)) return i;
+    }
+#else
+    vectorT v[LEAF_SIZE];
+    pnode_read_vectors(p_addr, v, num);
+    for(i = 0; i < num; i++) {
+        if(vector_equal(v + i, vec)) return i;
+    }
+#endif
+    return -1;
+}
+
 #ifdef SEARCH_TEST_ON
-static inline uint64_t p_search(mPptr addr, uint64_t key) {
-    uint64_t tmp_key;
+static inline KEY_TYPE p_search(mPptr addr, KEY_TYPE key) {
+    KEY_TYPE tmp_key;
 #ifdef DPU_KEYS_STORED_IN_PNODE
-    uint64_t res = addr->keys[0];
+    KEY_TYPE res = addr->keys[0];
 #else
-    vectorT vec = addr->v[0];
-    uint64_t res = coord_to_key(&vec);
+    vectorT vec = pnode_read_vector(addr, 0);
+    KEY_TYPE res = coord_to_key(&vec);
 #endif
     int height = maximum_match_height(res, key), num = addr->num, tmp_height;
     for(int i = 1; i < num; i++) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
         tmp_key = addr->keys[i];
 #else
-        vec = addr->v[i];
+        vec = pnode_read_vector(addr, i);
         tmp_key = coord_to_key(&vec);
 #endif
         tmp_height = maximum_match_height(key, tmp_key);
@@ -91,27 +135,35 @@ static inline uint64_t p_search(mPptr addr, uint64_t key) {
 
 #ifdef INSERT_NODE_ON
 
-#define INSERT_WRAM_KEY_BUF_SIZE (32)
+#define INSERT_WRAM_KEY_BUF_SIZE (32 / KEY_WORDS)
 
 /* Auxiliary functions */
 
-static inline void p_insert_naive(mPptr addr, int8_t num, mpvector vec) {
+static inline void p_insert_naive(mPptr addr, int8_t num, mpvector vec PAYLOAD_ARG(mppayload payload)) {
+#ifdef DPU_PNODE_COMPRESSED
+    // The new vectors may move box_min, which every stored offset is relative to
+    bool insert_mode = false;
+#else
     bool insert_mode = num <= (LEAF_SIZE >> 1);
+#endif
     int8_t i = 0;
     int height;
     Pnode pnode;
     if(insert_mode) m_read(addr, &pnode, PNODE_METADATA_SIZE);
-    else m_read(addr, &pnode, sizeof(Pnode));
+    else pnode_load(addr, &pnode);
     vectorT *vec_pt = pnode.v + pnode.num;
-    uint64_t key_tmp;
+    KEY_TYPE key_tmp;
 #ifdef DPU_KEYS_STORED_IN_PNODE
-    uint64_t *key_addr = pnode.keys + pnode.num;
+    KEY_TYPE *key_addr = pnode.keys + pnode.num;
 #endif
     m_read(vec, vec_pt, S64(MULTIPLY_NR_DIMENSION(num)));
+#ifdef POINT_PAYLOAD_ON
+    m_read(payload, pnode.payloads + pnode.num, S64(PAYLOAD_WORDS * num));
+#endif
     if(pnode.num == 0) {
         i = 1;
         vec_pt++;
-        pnode.height = 64;
+        pnode.height = KEY_BITS;
         pnode.key = coord_to_key(pnode.v);
         pnode.box_min = pnode.v[0];
         pnode.box_max = pnode.v[0];
@@ -133,9 +185,12 @@ static inline void p_insert_naive(mPptr addr, int8_t num, mpvector vec) {
     }
     pnode.key = prune_tail_bits(pnode.key, pnode.height);
     if(insert_mode) {
-        m_write(pnode.v + pnode.num, addr->v + pnode.num, S64(MULTIPLY_NR_DIMENSION(num)));
+        pnode_write_vectors(pnode.v + pnode.num, addr, pnode.num, num);
 #ifdef DPU_KEYS_STORED_IN_PNODE
-        m_write(pnode.keys + pnode.num, addr->keys + pnode.num, S64(num));
+        m_write(pnode.keys + pnode.num, addr->keys + pnode.num, S64(KEY_WORDS * num));
+#endif
+#ifdef POINT_PAYLOAD_ON
+        pnode_write_payloads(pnode.payloads + pnode.num, addr, pnode.num, num);
 #endif
         pnode.num += num;
         m_write(&pnode, addr, PNODE_METADATA_SIZE);
@@ -144,11 +199,11 @@ static inline void p_insert_naive(mPptr addr, int8_t num, mpvector vec) {
         pnode.num += num;
         for(i = pnode.num; i < LEAF_SIZE; i++) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
-            pnode.keys[i] = 0;
+            pnode.keys[i] = KEY_ZERO;
 #endif
             vector_ones(pnode.v + i, 0);
         }
-        m_write(&pnode, addr, sizeof(Pnode));
+        pnode_store(&pnode, addr);
     }
 }
 
@@ -160,36 +215,167 @@ typedef struct int64_pair {
 } int64_pair __attribute__((aligned (8)));
 
 
-/* Maintain ancestor counters: Max subtree size pruned by MAX_RANGE_QUERY_SIZE to avoid locks */
-static inline void maintain_ancestor_counter(mBptr addr, int num) {
-    int lock_idx;
-    int64_t subtree_size_1 = 0, subtree_size_2 = 0;
+/*
+    Add num points, with their aggregate when BNODE_AGGREGATE_ON, to the counter of one B node and return its parent.
+    Deletions (num < 0) only subtract the sums: bnode_refresh_box shrinks the boxes afterwards.
+    The parent is read under the lock of the node, so that B nodes split by other tasklets are not skipped.
+*/
+static inline mBptr bnode_add_counter(mBptr addr, int64_t num, Bnode_aggregate *agg) {
+    int lock_idx = bnode_mutex_hash(addr);
     mBptr parent;
-    bool continue_signal = true;
-    while(continue_signal && addr != INVALID_MBPTR) {
-        lock_idx = bnode_mutex_hash(addr);
-        mutex_pool_lock(&bnode_lock_pool, lock_idx);
-        parent = load_node_parent(addr->parent);
-        subtree_size_1 = addr->subtree_size;
-        subtree_size_1 += num;
-        addr->subtree_size = subtree_size_1;
-        mutex_pool_unlock(&bnode_lock_pool, lock_idx);
-        subtree_size_2 = (parent == INVALID_MBPTR ? 0 : parent->subtree_size);
-        continue_signal = (subtree_size_1 - num < MAX_RANGE_QUERY_SIZE) || (subtree_size_2 < MAX_RANGE_QUERY_SIZE);
-        addr = parent;
+#ifdef BNODE_AGGREGATE_ON
+    __dma_aligned Bnode_aggregate node_agg;
+    int d;
+#endif
+    mutex_pool_lock(&bnode_lock_pool, lock_idx);
+    parent = load_node_parent(addr->parent);
+#ifdef BNODE_AGGREGATE_ON
+    m_read(&(addr->agg), &node_agg, sizeof(Bnode_aggregate));
+    if(num > 0) aggregate_merge(&node_agg, agg);
+    else {
+        for(d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&(node_agg.sum), d) -= VECTOR_COORD(&(agg->sum), d);
+    }
+    m_write(&node_agg, &(addr->agg), sizeof(Bnode_aggregate));
+#endif
+    addr->subtree_size += num;
+    mutex_pool_unlock(&bnode_lock_pool, lock_idx);
+    return parent;
+}
+
+/* Maintain ancestor counters: add num to addr and all its ancestors, locking one node at a time */
+static inline void maintain_ancestor_counter(mBptr addr, int num, Bnode_aggregate *agg) {
+    while(addr != INVALID_MBPTR) {
+        addr = bnode_add_counter(addr, num, agg);
+    }
+}
+
+/*
+    Deferred ancestor counters: insert and delete tasks log (B node, num) entries per tasklet, and counter_log_apply
+    adds them to all the ancestors after a barrier, once the block no longer changes the tree.
+    Tasks are sorted by key, so consecutive entries of a tasklet share most of their paths. The deltas are accumulated
+    along the current path and carried to the parent when a node leaves it, which locks each ancestor once per run
+    of entries below it instead of once per task. Entries beyond COUNTER_LOG_SIZE use maintain_ancestor_counter.
+*/
+#define COUNTER_LOG_SIZE (1 << 10)
+#define COUNTER_PATH_SIZE (KEY_BITS / DB_SIZE_LOG + 2)  // B node heights grow by at least DB_SIZE_LOG per level
+
+typedef struct counter_log_entry {
+    int32_t addr;  // B node, stored like parent fields
+    int32_t num;
+#ifdef BNODE_AGGREGATE_ON
+    Bnode_aggregate agg;
+#endif
+} counter_log_entry;
+
+__mram_noinit counter_log_entry counter_log[NR_TASKLETS][COUNTER_LOG_SIZE];
+#ifdef BNODE_AGGREGATE_ON
+__mram_noinit Bnode_aggregate counter_path_agg[NR_TASKLETS][COUNTER_PATH_SIZE];
+#endif
+int counter_log_num[NR_TASKLETS];
+
+static inline void counter_log_push(mBptr addr, int num, Bnode_aggregate *agg) {
+    uint32_t tasklet_id = me();
+    int pos = counter_log_num[tasklet_id];
+    __dma_aligned counter_log_entry entry;
+    if(addr == INVALID_MBPTR || num == 0) return;
+    if(pos >= COUNTER_LOG_SIZE) {
+        maintain_ancestor_counter(addr, num, agg);
+        return;
+    }
+    entry.addr = store_node_parent(addr);
+    entry.num = num;
+#ifdef BNODE_AGGREGATE_ON
+    entry.agg = *agg;
+#endif
+    m_write(&entry, &counter_log[tasklet_id][pos], sizeof(counter_log_entry));
+    counter_log_num[tasklet_id] = pos + 1;
+}
+
+/* Apply the delta accumulated at path[top] and carry it to path[top - 1], its parent */
+static inline void counter_path_pop(mBptr *path, int64_t *path_num, int top) {
+    __dma_aligned Bnode_aggregate agg;
+#ifdef BNODE_AGGREGATE_ON
+    __dma_aligned Bnode_aggregate parent_agg;
+    uint32_t tasklet_id = me();
+    m_read(&counter_path_agg[tasklet_id][top], &agg, sizeof(Bnode_aggregate));
+#endif
+    if(path_num[top] == 0) return;
+    bnode_add_counter(path[top], path_num[top], &agg);
+    if(top > 0) {
+        path_num[top - 1] += path_num[top];
+#ifdef BNODE_AGGREGATE_ON
+        m_read(&counter_path_agg[tasklet_id][top - 1], &parent_agg, sizeof(Bnode_aggregate));
+        aggregate_merge(&parent_agg, &agg);
+        m_write(&parent_agg, &counter_path_agg[tasklet_id][top - 1], sizeof(Bnode_aggregate));
+#endif
     }
 }
 
+/* Called by every tasklet after a barrier of the block that logged the entries */
+static inline void counter_log_apply() {
+    uint32_t tasklet_id = me();
+    int num = counter_log_num[tasklet_id];
+    mBptr path[COUNTER_PATH_SIZE], chain[COUNTER_PATH_SIZE];
+    int64_t path_num[COUNTER_PATH_SIZE];
+    __dma_aligned counter_log_entry entry;
+    mBptr addr;
+    int i, j, h = 0, c;
+#ifdef BNODE_AGGREGATE_ON
+    __dma_aligned Bnode_aggregate agg;
+#endif
+    for(i = 0; i < num; i++) {
+        m_read(&counter_log[tasklet_id][i], &entry, sizeof(counter_log_entry));
+        // Climb to the first node on the current path, the root always is once the path is not empty
+        addr = load_node_parent(entry.addr);
+        c = 0;
+        j = -1;
+        while(addr != INVALID_MBPTR) {
+            for(j = h - 1; j >= 0 && path[j] != addr; j--);
+            if(j >= 0) break;
+            chain[c++] = addr;
+            addr = load_node_parent(addr->parent);
+        }
+        while(h > j + 1) {
+            h--;
+            counter_path_pop(path, path_num, h);
+        }
+        while(c > 0) {
+            c--;
+            path[h] = chain[c];
+            path_num[h] = 0;
+#ifdef BNODE_AGGREGATE_ON
+            aggregate_reset(&agg);
+            m_write(&agg, &counter_path_agg[tasklet_id][h], sizeof(Bnode_aggregate));
+#endif
+            h++;
+        }
+        path_num[h - 1] += entry.num;
+#ifdef BNODE_AGGREGATE_ON
+        m_read(&counter_path_agg[tasklet_id][h - 1], &agg, sizeof(Bnode_aggregate));
+        aggregate_merge(&agg, &entry.agg);
+        m_write(&agg, &counter_path_agg[tasklet_id][h - 1], sizeof(Bnode_aggregate));
+#endif
+    }
+    while(h > 0) {
+        h--;
+        counter_path_pop(path, path_num, h);
+    }
+    counter_log_num[tasklet_id] = 0;
+}
+
 /* Main function for insert vectors */
-static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int buf_size, uint64_t *key_buf_wram) {
+static void p_insert(mPptr addr, int idx, int num, mpvector vec PAYLOAD_ARG(mppayload payload), mpvoid buf, int buf_size, KEY_TYPE *key_buf_wram) {
     int addr_num = addr->num;
     if(num + addr_num <= LEAF_SIZE) {
-        p_insert_naive(addr, num, vec);
+        p_insert_naive(addr, num, vec PAYLOAD_ARG(payload));
     }
     else {
-        // Vector and key buffer takes 75% of the buf space
+        // Vector, key and payload buffers take 75% of the buf space
         mpvector vec_buf = (mpvector)buf;
-        mpuint64_t key_buf = (mpuint64_t)(buf + buf_size * 3 * NR_DIMENSION / 4 / (NR_DIMENSION + 1));
+        mpkey key_buf = (mpkey)(buf + ((buf_size * 3 * NR_DIMENSION / 4 / (NR_DIMENSION + KEY_WORDS + PAYLOAD_WORDS)) & ~7));
+#ifdef POINT_PAYLOAD_ON
+        mppayload payload_buf = (mppayload)(buf + ((buf_size * 3 * (NR_DIMENSION + KEY_WORDS) / 4 / (NR_DIMENSION + KEY_WORDS + PAYLOAD_WORDS)) & ~7));
+#endif
         __mram_ptr struct int64_pair *stack_buf = (__mram_ptr struct int64_pair*)(buf + buf_size * 3 / 4);
         __mram_ptr struct int64_pair *stack_buf_end = stack_buf + buf_size / sizeof(struct int64_pair);
         int total_num = addr_num + num;
@@ -199,34 +385,34 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
         // Assume input vectors from the tasks are already sorted on CPU
         // Sort input vectors and current vectors
         {
-            int16_t key_idx[LEAF_SIZE];
+            int16_t key_idx[LEAF_SIZE], idx_tmp;
             for(int i = 0; i < addr_num; i++) key_idx[i] = i;
-            uint64_t key1, key2;
+            KEY_TYPE key1, key2;
             vectorT tmp_vec;
 
             for(i = 0; i < addr_num - 1; i++) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
                 key1 = addr->keys[key_idx[i]];
 #else
-                tmp_vec = addr->v[key_idx[i]];
+                tmp_vec = pnode_read_vector(addr, key_idx[i]);
                 key1 = coord_to_key(&tmp_vec);
 #endif
                 for(j = i + 1; j < addr_num; j++) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
                     key2 = addr->keys[key_idx[j]];
 #else
-                    tmp_vec = addr->v[key_idx[j]];
+                    tmp_vec = pnode_read_vector(addr, key_idx[j]);
                     key2 = coord_to_key(&tmp_vec);
 #endif
-                    if(key1 > key2) {
+                    if(key_less(key2, key1)) {
                         // Swap
                         key1 = key2;
-                        key2 = key_idx[j]; key_idx[j] = key_idx[i]; key_idx[i] = key2;
+                        idx_tmp = key_idx[j]; key_idx[j] = key_idx[i]; key_idx[i] = idx_tmp;
                     }
                 }
             }
 
-            uint64_t key_idx_j;
+            KEY_TYPE key_idx_j;
 #ifndef DPU_KEYS_STORED_IN_PNODE
             vectorT tmp_vec_1;
 #endif
@@ -236,37 +422,49 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
 #ifdef DPU_KEYS_STORED_IN_PNODE
                 while(j < addr_num) {
                     key_idx_j = addr->keys[key_idx[j]];
-                    if(key_idx_j > key1) break;
+                    if(key_less(key1, key_idx_j)) break;
                     if(use_wram_key_buf) key_buf_wram[k] = key_idx_j;
                     else key_buf[k] = key_idx_j;
-                    vec_buf[k] = addr->v[key_idx[j]];
+                    vec_buf[k] = pnode_read_vector(addr, key_idx[j]);
+#ifdef POINT_PAYLOAD_ON
+                    payload_buf[k] = addr->payloads[key_idx[j]];
+#endif
                     j++; k++;
                 }
 #else
                 while(j < addr_num) {
-                    tmp_vec_1 = addr->v[key_idx[j]];
+                    tmp_vec_1 = pnode_read_vector(addr, key_idx[j]);
                     key_idx_j = coord_to_key(&tmp_vec_1);
-                    if(key_idx_j > key1) break;
+                    if(key_less(key1, key_idx_j)) break;
                     if(use_wram_key_buf) key_buf_wram[k] = key_idx_j;
                     else key_buf[k] = key_idx_j;
                     vec_buf[k] = tmp_vec_1;
+#ifdef POINT_PAYLOAD_ON
+                    payload_buf[k] = addr->payloads[key_idx[j]];
+#endif
                     j++; k++;
                 }
 #endif
                 vec_buf[k] = tmp_vec;
+#ifdef POINT_PAYLOAD_ON
+                payload_buf[k] = payload[i];
+#endif
                 if(use_wram_key_buf) key_buf_wram[k] = key1;
                 else key_buf[k] = key1;
             }
             while(j < addr_num) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
-                vec_buf[k] = addr->v[key_idx[j]];
+                vec_buf[k] = pnode_read_vector(addr, key_idx[j]);
                 if(use_wram_key_buf) key_buf_wram[k] = addr->keys[key_idx[j]];
                 else key_buf[k] = addr->keys[key_idx[j]];
 #else
-                tmp_vec_1 = addr->v[key_idx[j]];
+                tmp_vec_1 = pnode_read_vector(addr, key_idx[j]);
                 vec_buf[k] = tmp_vec_1;
                 if(use_wram_key_buf) key_buf_wram[k] = coord_to_key(&tmp_vec_1);
                 else key_buf[k] = coord_to_key(&tmp_vec_1);
+#endif
+#ifdef POINT_PAYLOAD_ON
+                payload_buf[k] = addr->payloads[key_idx[j]];
 #endif
                 j++; k++;
             }
@@ -276,8 +474,9 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
 
         int32_t child_start[DB_SIZE], child_end[DB_SIZE];
         int vec_start, vec_end, tmp_int, step;
-        int8_t height, tmp_idx;
-        uint64_t key;
+        INT_HEIGHT height;
+        int8_t tmp_idx;
+        KEY_TYPE key;
         mPptr p_addr = addr;
         mBptr b_addr = INVALID_MBPTR;
         __dma_aligned Bnode bnode;
@@ -294,7 +493,7 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
         for(i = 0; i < DB_SIZE; i++) child_end[i] = -1;
         for(i = 1; i < LEAF_SIZE; i++) {
 #ifdef DPU_KEYS_STORED_IN_PNODE
-            pnode.keys[i] = 0;
+            pnode.keys[i] = KEY_ZERO;
 #endif
             vector_ones(pnode.v + i, 0);
         }
@@ -315,9 +514,10 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
             key = prune_tail_bits(key, height);
             bnode.key = key;
             bnode.subtree_size = vec_end - vec_start + 1;
-            bnode.box_min = key_to_coord(key, false);
-            key |= ((((uint64_t)1) << (64 - height)) - (uint64_t)1);
-            bnode.box_max = key_to_coord(key, true);
+            key_prefix_box(key, height, &bnode.box_min, &bnode.box_max);
+#ifdef BNODE_AGGREGATE_ON
+            aggregate_vectors(&bnode.agg, vec_buf + vec_start, vec_end - vec_start + 1);
+#endif
 
             // Count children point num
             step = vec_end - vec_start + 1;
@@ -387,10 +587,13 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
 #endif
                         tmp_vec = vec_buf[j + k];
                         pnode.v[j] = tmp_vec;
+#ifdef POINT_PAYLOAD_ON
+                        pnode.payloads[j] = payload_buf[j + k];
+#endif
                         vector_min(&tmp_vec, &pnode.box_min);
                         vector_max(&tmp_vec, &pnode.box_max);
                     }
-                    m_write(&pnode, p_addr, sizeof(Pnode));
+                    pnode_store(&pnode, p_addr);
                     p_addr = INVALID_MPPTR;
                 }
                 else bnode.children[i] = null_pptr;
@@ -401,12 +604,22 @@ static void p_insert(mPptr addr, int idx, int num, mpvector vec, mpvoid buf, int
     }
 }
 
-static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid buf, int buf_size, uint64_t *key_buf_wram) {
+/* agg holds the inserted vectors when BNODE_AGGREGATE_ON. The counters of the ancestors are left to the caller. */
+static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec PAYLOAD_ARG(mppayload payload), mpvoid buf, int buf_size, KEY_TYPE *key_buf_wram,
+                             Bnode_aggregate *agg) {
     // Assume input vectors from the tasks are already sorted on CPU
     mPptr p_addr;
     mBptr parent;
+#ifdef BNODE_AGGREGATE_ON
+    __dma_aligned Bnode_aggregate node_agg;
+#endif
     int lock_idx = bnode_mutex_hash(addr);
     mutex_pool_lock(&bnode_lock_pool, lock_idx);
+#ifdef BNODE_AGGREGATE_ON
+    m_read(&(addr->agg), &node_agg, sizeof(Bnode_aggregate));
+    aggregate_merge(&node_agg, agg);
+    m_write(&node_agg, &(addr->agg), sizeof(Bnode_aggregate));
+#endif
     addr->subtree_size += num;
     parent = load_node_parent(addr->parent);
     mutex_pool_unlock(&bnode_lock_pool, lock_idx);
@@ -414,21 +627,22 @@ static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid
         p_addr = alloc_new_pnode();
         addr->children[idx] = mpptr_to_pptr(p_addr);
         p_addr->parent = store_node_parent(addr);
-        p_insert(p_addr, idx, num, vec, buf, buf_size, key_buf_wram);
+        p_insert(p_addr, idx, num, vec PAYLOAD_ARG(payload), buf, buf_size, key_buf_wram);
     }
     else {
         // Allocate new B node
         mBptr b_addr;
-        vectorT tmp_vec = vec[0];
-        int8_t height_min, height_tmp, idx_tmp, idx2;
+        vectorT tmp_vec = vec[0], tmp_vec_max;
+        INT_HEIGHT height_min, height_tmp;
+        int8_t idx_tmp, idx2;
         mBptr original_b;
         pptr original_b_addr;
-        uint64_t key_original_b, key1;
+        KEY_TYPE key_original_b, key1;
         int32_t ll = 0, rr = num - 1, i, j, tmp_int, range_num;
         {
             key1 = coord_to_key(&tmp_vec);
             tmp_vec = vec[rr];
-            uint64_t key2 = coord_to_key(&tmp_vec);
+            KEY_TYPE key2 = coord_to_key(&tmp_vec);
             original_b_addr = addr->children[idx];
             original_b = pptr_to_mbptr(original_b_addr);
             key_original_b = original_b->key;
@@ -447,14 +661,25 @@ static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid
             b_addr->parent = store_node_parent(addr);
             addr->children[idx] = mbptr_to_pptr(b_addr);
             b_addr->children[height_tmp] = original_b_addr;
-            b_addr->box_min = key_to_coord(key1, false);
-            key1 |= ((((uint64_t)1) << (64 - height_min)) - (uint64_t)1);
-            b_addr->box_max = key_to_coord(key1, true);
+            key_prefix_box(key1, height_min, &tmp_vec, &tmp_vec_max);
+            b_addr->box_min = tmp_vec;
+            b_addr->box_max = tmp_vec_max;
             lock_idx = bnode_mutex_hash(original_b);
             mutex_pool_lock(&bnode_lock_pool, lock_idx);
             original_b->parent = store_node_parent(b_addr);
             b_addr->subtree_size = original_b->subtree_size + rr - ll + 1;
+#ifdef BNODE_AGGREGATE_ON
+            m_read(&(original_b->agg), &node_agg, sizeof(Bnode_aggregate));
+#endif
             mutex_pool_unlock(&bnode_lock_pool, lock_idx);
+#ifdef BNODE_AGGREGATE_ON
+            {
+                Bnode_aggregate range_agg;
+                aggregate_vectors(&range_agg, vec + ll, rr - ll + 1);
+                aggregate_merge(&node_agg, &range_agg);
+                m_write(&node_agg, &(b_addr->agg), sizeof(Bnode_aggregate));
+            }
+#endif
 
             // Build children
             j = -1;
@@ -477,7 +702,7 @@ static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid
                         p_addr = alloc_new_pnode();
                         b_addr->children[idx_tmp] = mpptr_to_pptr(p_addr);
                         p_addr->parent = store_node_parent(b_addr);
-                        p_insert(p_addr, idx_tmp, range_num, vec + tmp_int, buf, buf_size, key_buf_wram);
+                        p_insert(p_addr, idx_tmp, range_num, vec + tmp_int PAYLOAD_ARG(payload + tmp_int), buf, buf_size, key_buf_wram);
                     }
                     tmp_int = i;
                     idx_tmp = idx2;
@@ -488,7 +713,7 @@ static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid
                 p_addr = alloc_new_pnode();
                 b_addr->children[idx_tmp] = mpptr_to_pptr(p_addr);
                 p_addr->parent = store_node_parent(b_addr);
-                p_insert(p_addr, idx_tmp, range_num, vec + tmp_int, buf, buf_size, key_buf_wram);
+                p_insert(p_addr, idx_tmp, range_num, vec + tmp_int PAYLOAD_ARG(payload + tmp_int), buf, buf_size, key_buf_wram);
             }
             rr = j;
             idx = height_tmp;
@@ -499,6 +724,199 @@ static inline mBptr b_insert(mBptr addr, int idx, int num, mpvector vec, mpvoid
     return parent;
 }
 
+/* Insert a sorted group of vectors at the node returned by b_search. The ancestor counters are logged for counter_log_apply. */
+static inline void single_insert(pptr addr, int len, mpvector vec PAYLOAD_ARG(mppayload payload), mpvoid buf, int buf_size, KEY_TYPE *key_buf_wram) {
+    mBptr b_addr;
+    Bnode_aggregate agg;
+#ifdef BNODE_AGGREGATE_ON
+    aggregate_vectors(&agg, vec, len);
+#endif
+    if(addr.data_type == P_NODE_DATA_TYPE) {
+        mPptr p_addr = pptr_to_mpptr(addr);
+        b_addr = load_node_parent(p_addr->parent);
+        p_insert(p_addr, addr.info, len, vec PAYLOAD_ARG(payload), buf, buf_size, key_buf_wram);
+        counter_log_push(b_addr, len, &agg);
+    }
+    else if(addr.data_type == B_NODE_DATA_TYPE) {
+        b_addr = pptr_to_mbptr(addr);
+        b_addr = b_insert(b_addr, addr.info, len, vec PAYLOAD_ARG(payload), buf, buf_size, key_buf_wram, &agg);
+        counter_log_push(b_addr, len, &agg);
+    }
+}
+
+/*
+    Insert sorted vectors below a B node the host knows to be on all their paths.
+    Targets are searched one vector at a time, and consecutive vectors sharing a target are inserted together.
+*/
+static inline void single_insert_from(mBptr start, int len, mpvector vec PAYLOAD_ARG(mppayload payload), mpvoid buf, int buf_size, KEY_TYPE *key_buf_wram) {
+    vectorT tmp_vec = vec[0];
+    pptr addr = b_search_from(start, coord_to_key(&tmp_vec), true), next = addr;
+    int i = 0, j;
+    while(i < len) {
+        for(j = i + 1; j < len; j++) {
+            tmp_vec = vec[j];
+            next = b_search_from(start, coord_to_key(&tmp_vec), true);
+            if(!equal_pptr(next, addr) || next.info != addr.info) break;
+        }
+        single_insert(addr, j - i, vec + i PAYLOAD_ARG(payload + i), buf, buf_size, key_buf_wram);
+        i = j;
+        addr = next;
+    }
+}
+
+#endif
+
+
+/* ----------------- Delete Vectors ----------------- */
+
+// Relies on the search round and ancestor counters of INSERT_NODE_ON
+#ifdef DELETE_NODE_ON
+
+/*
+    Remove up to num vectors from a P node, each input vector removes at most one stored copy.
+    The P node is unlinked from its parent when it becomes empty. Return the number of removed vectors,
+    which are added to deleted_agg when BNODE_AGGREGATE_ON.
+*/
+static inline int p_delete(mPptr addr, int idx, int num, mpvector vec, Bnode_aggregate *deleted_agg) {
+    __dma_aligned Pnode pnode;
+    vectorT tmp_vec;
+    KEY_TYPE key_tmp;
+    int i, j, last, deleted = 0;
+    int height;
+    pnode_load(addr, &pnode);
+    for(i = 0; i < num && pnode.num > 0; i++) {
+        tmp_vec = vec[i];
+        key_tmp = coord_to_key(&tmp_vec);
+        for(j = 0; j < pnode.num; j++) {
+#ifdef DPU_KEYS_STORED_IN_PNODE
+            if(key_equal(pnode.keys[j], key_tmp) && vector_equal(pnode.v + j, &tmp_vec)) break;
+#else
+            if(vector_equal(pnode.v + j, &tmp_vec)) break;
+#endif
+        }
+        if(j < pnode.num) {
+#ifdef BNODE_AGGREGATE_ON
+            aggregate_add_vector(deleted_agg, pnode.v + j);
+#endif
+            last = pnode.num - 1;
+            pnode.v[j] = pnode.v[last];
+            vector_ones(pnode.v + last, 0);
+#ifdef DPU_KEYS_STORED_IN_PNODE
+            pnode.keys[j] = pnode.keys[last];
+            pnode.keys[last] = KEY_ZERO;
+#endif
+#ifdef POINT_PAYLOAD_ON
+            pnode.payloads[j] = pnode.payloads[last];
+#endif
+            pnode.num--;
+            deleted++;
+        }
+    }
+    if(deleted == 0) return 0;
+    if(pnode.num == 0) {
+        load_node_parent(pnode.parent)->children[idx] = null_pptr;
+        m_write(&pnode, addr, PNODE_METADATA_SIZE);
+        return deleted;
+    }
+    // Recompute the key prefix and the bounding box of the remaining vectors
+#ifdef DPU_KEYS_STORED_IN_PNODE
+    pnode.key = pnode.keys[0];
+#else
+    pnode.key = coord_to_key(pnode.v);
+#endif
+    pnode.height = KEY_BITS;
+    pnode.box_min = pnode.v[0];
+    pnode.box_max = pnode.v[0];
+    for(j = 1; j < pnode.num; j++) {
+#ifdef DPU_KEYS_STORED_IN_PNODE
+        key_tmp = pnode.keys[j];
+#else
+        key_tmp = coord_to_key(pnode.v + j);
+#endif
+        height = maximum_match_height(key_tmp, pnode.key);
+        if(height < pnode.height) pnode.height = height;
+        vector_min(pnode.v + j, &pnode.box_min);
+        vector_max(pnode.v + j, &pnode.box_max);
+    }
+    pnode.key = prune_tail_bits(pnode.key, pnode.height);
+    pnode_store(&pnode, addr);
+    return deleted;
+}
+
+/*
+    Collapse B nodes that become empty or only hold one child, bottom-up from addr.
+    Removed B nodes are returned to the free lists. Not thread-safe: run by a single tasklet.
+*/
+static inline void b_collapse(mBptr addr) {
+    __dma_aligned Bnode bnode;
+    mBptr parent;
+    pptr child;
+    int i, child_num, child_idx = 0, idx;
+    while(addr != root && addr != INVALID_MBPTR) {
+        m_read(addr, &bnode, sizeof(Bnode));
+        if(bnode.height == INVALID_NODE_HEIGHT) return;
+        child_num = 0;
+        for(i = 0; i < DB_SIZE; i++) {
+            if(valid_pptr(bnode.children[i])) {
+                child_num++;
+                child_idx = i;
+            }
+        }
+        if(child_num > 1) return;
+        parent = load_node_parent(bnode.parent);
+        idx = lookup_next_bit_chunk(bnode.key, parent->height);
+        free_bnode(addr);
+        if(child_num == 1) {
+            // Splice the only child into the parent, the path compression keeps its key valid
+            child = bnode.children[child_idx];
+            if(child.data_type == B_NODE_DATA_TYPE) pptr_to_mbptr(child)->parent = bnode.parent;
+            else pptr_to_mpptr(child)->parent = bnode.parent;
+            parent->children[idx] = child;
+            return;
+        }
+        parent->children[idx] = null_pptr;
+        addr = parent;
+    }
+}
+
+#ifdef BNODE_AGGREGATE_ON
+/*
+    Shrink the aggregate boxes after deletions, rebuilding them from the children bottom-up from addr.
+    Stops at the first unchanged box. Not thread-safe: run by a single tasklet.
+*/
+static inline void bnode_refresh_box(mBptr addr) {
+    __dma_aligned Bnode_aggregate agg, child_agg;
+    __dma_aligned Pnode pnode;
+    pptr children[DB_SIZE];
+    vectorT box_min, box_max;
+    int i;
+    while(addr != INVALID_MBPTR) {
+        m_read(&(addr->agg), &agg, sizeof(Bnode_aggregate));
+        box_min = agg.box_min;
+        box_max = agg.box_max;
+        vector_ones(&agg.box_min, INT64_MAX);
+        vector_ones(&agg.box_max, INT64_MIN);
+        m_read(addr->children, children, S64(DB_SIZE));
+        for(i = 0; i < DB_SIZE; i++) {
+            if(children[i].data_type == B_NODE_DATA_TYPE) {
+                m_read(&(pptr_to_mbptr(children[i])->agg), &child_agg, sizeof(Bnode_aggregate));
+                vector_min(&child_agg.box_min, &agg.box_min);
+                vector_max(&child_agg.box_max, &agg.box_max);
+            }
+            else if(children[i].data_type == P_NODE_DATA_TYPE) {
+                m_read(pptr_to_mpptr(children[i]), &pnode, PNODE_METADATA_SIZE);
+                if(pnode.num == 0) continue;
+                vector_min(&pnode.box_min, &agg.box_min);
+                vector_max(&pnode.box_max, &agg.box_max);
+            }
+        }
+        if(vector_equal(&box_min, &agg.box_min) && vector_equal(&box_max, &agg.box_max)) return;
+        m_write(&agg, &(addr->agg), sizeof(Bnode_aggregate));
+        addr = load_node_parent(addr->parent);
+    }
+}
+#endif
+
 #endif
 
 
@@ -510,7 +928,14 @@ static inline void fetch_single_node(pptr addr, int i) {
     tsr.addr = addr;
     tsr.len = 0;
     for(int j = 0; j < LEAF_SIZE; j++) tsr.keys[j] = INVALID_KEY;
-    if(addr.data_type == P_NODE_DATA_TYPE) {
+    // Unused slab slots and free-listed nodes hold no node: reply with a null address
+    if((addr.data_type == P_NODE_DATA_TYPE && (in_unused_slab(addr.addr, p_slab_next, p_slab_end)
+                                               || pptr_to_mpptr(addr)->height == INVALID_NODE_HEIGHT))
+       || (addr.data_type == B_NODE_DATA_TYPE && (in_unused_slab(addr.addr, b_slab_next, b_slab_end)
+                                                  || pptr_to_mbptr(addr)->height == INVALID_NODE_HEIGHT))) {
+        tsr.addr = null_pptr;
+    }
+    else if(addr.data_type == P_NODE_DATA_TYPE) {
         mPptr p_addr = pptr_to_mpptr(addr);
         tsr.parent = mbptr_to_pptr(load_node_parent(p_addr->parent));
         tsr.key = p_addr->key;
@@ -521,11 +946,11 @@ static inline void fetch_single_node(pptr addr, int i) {
 #else
         vectorT vec;
         for(int j = 0; j < tsr.len; j++) {
-            vec = p_addr->v[j];
+            vec = pnode_read_vector(p_addr, j);
             tsr.keys[j] = coord_to_key(&vec);
         }
 #endif
-        for(int j = tsr.len; j < LEAF_SIZE; j++) tsr.keys[j] = PPTR_TO_U64(null_pptr);
+        for(int j = tsr.len; j < LEAF_SIZE; j++) tsr.keys[j] = key_from_prefix(PPTR_TO_U64(null_pptr));
     }
     else if(addr.data_type == B_NODE_DATA_TYPE) {
         mBptr b_addr = pptr_to_mbptr(addr);
@@ -536,7 +961,7 @@ static inline void fetch_single_node(pptr addr, int i) {
         pptr tmp_addr;
         for(int j = 0; j < DB_SIZE; j++) {
             tmp_addr = b_addr->children[j];
-            tsr.keys[j] = PPTR_TO_U64(tmp_addr);
+            tsr.keys[j] = key_from_prefix(PPTR_TO_U64(tmp_addr));
         }
     }
     push_fixed_reply(i, &tsr);
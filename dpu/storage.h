@@ -25,15 +25,18 @@ uint64_t local_range_end;
 static inline void dpu_init_func(int32_t dpu_id, int32_t nr_of_dpus) {
     DPU_ID = dpu_id;
     range_per_dpu = UINT64_MAX / nr_of_dpus + 1;
-    local_range_start = local_range_end * dpu_id;
+    local_range_start = range_per_dpu * dpu_id;
     local_range_end = range_per_dpu + local_range_start - 1;
 }
 
 
 /* Memory Management */
 
-__mram_noinit Bnode b_buffer_tmp[B_BUFFER_SIZE / sizeof(Bnode)];
-__mram_noinit Pnode p_buffer_tmp[P_BUFFER_SIZE / sizeof(Pnode)];
+#define B_NODE_CAPACITY (B_BUFFER_SIZE / sizeof(Bnode))
+#define P_NODE_CAPACITY (P_BUFFER_SIZE / sizeof(Pnode_mram))
+
+__mram_noinit Bnode b_buffer_tmp[B_NODE_CAPACITY];
+__mram_noinit Pnode_mram p_buffer_tmp[P_NODE_CAPACITY];
 
 MUTEX_INIT(b_lock);
 MUTEX_INIT(p_lock);
@@ -55,10 +58,60 @@ __mram_noinit uint8_t send_varlen_buffer_tmp[NR_TASKLETS][MAX_TASK_BUFFER_SIZE_P
 extern mpint64_t send_varlen_offset[];
 extern mpuint8_t send_varlen_buffer[];
 
+/*
+    Per-tasklet free lists of recycled nodes, linked through the parent field of the freed nodes.
+    Freed nodes are marked with INVALID_NODE_HEIGHT.
+*/
+#define FREE_LIST_END INVALID_PARENT
+
+int32_t b_free_list[NR_TASKLETS];
+int32_t p_free_list[NR_TASKLETS];
+uint32_t b_free_num[NR_TASKLETS];
+uint32_t p_free_num[NR_TASKLETS];
+
+/*
+    Per-tasklet allocation slabs: [next, end) ranges of the node buffers claimed in chunks,
+    so that b_lock / p_lock are only taken once per chunk.
+*/
+uint32_t b_slab_next[NR_TASKLETS];
+uint32_t b_slab_end[NR_TASKLETS];
+uint32_t p_slab_next[NR_TASKLETS];
+uint32_t p_slab_end[NR_TASKLETS];
+
+static inline void slab_reset() {
+    for(int i = 0; i < NR_TASKLETS; i++) {
+        b_slab_next[i] = b_slab_end[i] = 0;
+        p_slab_next[i] = p_slab_end[i] = 0;
+    }
+}
+
+static inline uint64_t slab_unused_total(uint32_t *slab_next, uint32_t *slab_end) {
+    uint64_t total = 0;
+    for(int i = 0; i < NR_TASKLETS; i++) total += slab_end[i] - slab_next[i];
+    return total;
+}
+
+/* Whether a claimed slot is in the unused part of a slab, and was never written */
+static inline bool in_unused_slab(uint32_t idx, uint32_t *slab_next, uint32_t *slab_end) {
+    for(int i = 0; i < NR_TASKLETS; i++) {
+        if(idx >= slab_next[i] && idx < slab_end[i]) return true;
+    }
+    return false;
+}
+
+static inline void free_list_reset() {
+    for(int i = 0; i < NR_TASKLETS; i++) {
+        b_free_list[i] = p_free_list[i] = FREE_LIST_END;
+        b_free_num[i] = p_free_num[i] = 0;
+    }
+}
+
 static inline void storage_init() {
     bcnt = 1; pcnt = 0;
     b_buffer = b_buffer_tmp;
     p_buffer = p_buffer_tmp;
+    slab_reset();
+    free_list_reset();
 }
 
 /* B Nodes */
@@ -66,37 +119,261 @@ static inline void storage_init() {
 static inline void bnode_init() {
     root = b_buffer;
     root->height = 0;
-    root->key = 0;
+    root->key = KEY_ZERO;
     root->parent = store_node_parent(INVALID_MBPTR);
     root->subtree_size = 0;
     vectorT v;
     vector_ones(&v, INT64_MIN); root->box_min = v;
     vector_ones(&v, INT64_MAX); root->box_max = v;
     for(int8_t i = 0; i < DB_SIZE; i++) root->children[i] = null_pptr;
+#ifdef BNODE_AGGREGATE_ON
+    Bnode_aggregate agg;
+    aggregate_reset(&agg);
+    root->agg = agg;
+#endif
 }
 
 static inline mBptr alloc_new_bnode() {
     mBptr addr;
-    mutex_lock(b_lock);
-    addr = &(b_buffer[bcnt]);
-    bcnt++;
-    mutex_unlock(b_lock);
+    uint32_t tasklet_id = me();
+    if(b_free_list[tasklet_id] != FREE_LIST_END) {
+        addr = b_buffer + b_free_list[tasklet_id];
+        b_free_list[tasklet_id] = addr->parent;
+        b_free_num[tasklet_id]--;
+    }
+    else {
+        if(b_slab_next[tasklet_id] == b_slab_end[tasklet_id]) {
+            mutex_lock(b_lock);
+            b_slab_next[tasklet_id] = bcnt;
+            bcnt += BNODE_SLAB_SIZE;
+            // The last slab is cut at the end of the buffer
+            if(bcnt > B_NODE_CAPACITY) bcnt = B_NODE_CAPACITY;
+            b_slab_end[tasklet_id] = bcnt;
+            mutex_unlock(b_lock);
+            SPACE_IN_DPU_ASSERT(b_slab_next[tasklet_id] < b_slab_end[tasklet_id], "alloc_new_bnode: B node buffer full\n");
+        }
+        addr = &(b_buffer[b_slab_next[tasklet_id]]);
+        b_slab_next[tasklet_id]++;
+    }
     addr->subtree_size = 0;
+#ifdef BNODE_AGGREGATE_ON
+    Bnode_aggregate agg;
+    aggregate_reset(&agg);
+    addr->agg = agg;
+#endif
     return addr;
 }
 
+/* Nodes are only freed in single-tasklet phases, so they are spread over all free lists by address */
+static inline void free_bnode(mBptr addr) {
+    int32_t idx = (int32_t)(addr - b_buffer);
+    int list_idx = idx % NR_TASKLETS;
+    addr->height = INVALID_NODE_HEIGHT;
+    addr->parent = b_free_list[list_idx];
+    b_free_list[list_idx] = idx;
+    b_free_num[list_idx]++;
+}
+
 /* P Nodes */
 
 static inline mPptr alloc_new_pnode() {
     mPptr addr;
-    mutex_lock(p_lock);
-    addr = &(p_buffer[pcnt]);
-    pcnt++;
-    mutex_unlock(p_lock);
+    uint32_t tasklet_id = me();
+    if(p_free_list[tasklet_id] != FREE_LIST_END) {
+        addr = p_buffer + p_free_list[tasklet_id];
+        p_free_list[tasklet_id] = addr->parent;
+        p_free_num[tasklet_id]--;
+    }
+    else {
+        if(p_slab_next[tasklet_id] == p_slab_end[tasklet_id]) {
+            mutex_lock(p_lock);
+            p_slab_next[tasklet_id] = pcnt;
+            pcnt += PNODE_SLAB_SIZE;
+            // The last slab is cut at the end of the buffer
+            if(pcnt > P_NODE_CAPACITY) pcnt = P_NODE_CAPACITY;
+            p_slab_end[tasklet_id] = pcnt;
+            mutex_unlock(p_lock);
+            SPACE_IN_DPU_ASSERT(p_slab_next[tasklet_id] < p_slab_end[tasklet_id], "alloc_new_pnode: P node buffer full\n");
+        }
+        addr = &(p_buffer[p_slab_next[tasklet_id]]);
+        p_slab_next[tasklet_id]++;
+    }
     addr->num = 0;
     return addr;
 }
 
+static inline void free_pnode(mPptr addr) {
+    int32_t idx = (int32_t)(addr - p_buffer);
+    int list_idx = idx % NR_TASKLETS;
+    addr->height = INVALID_NODE_HEIGHT;
+    addr->num = 0;
+    addr->parent = p_free_list[list_idx];
+    p_free_list[list_idx] = idx;
+    p_free_num[list_idx]++;
+}
+
+static inline uint64_t free_list_total(uint32_t *free_num) {
+    uint64_t total = 0;
+    for(int i = 0; i < NR_TASKLETS; i++) total += free_num[i];
+    return total;
+}
+
+
+/* Compaction */
+
+// Redirect the parent of a moved node to its new address
+static inline void relink_moved_node(int32_t parent, pptr old_addr, pptr new_addr) {
+    mBptr b_addr = load_node_parent(parent);
+    pptr child;
+    if(b_addr == INVALID_MBPTR) return;
+    for(int i = 0; i < DB_SIZE; i++) {
+        child = b_addr->children[i];
+        if(equal_pptr(child, old_addr)) {
+            b_addr->children[i] = new_addr;
+            return;
+        }
+    }
+}
+
+/*
+    Offline compaction: move live nodes from the tail of both buffers into freed and unused slab slots,
+    so that bcnt and pcnt only count live nodes afterwards. All pptrs handed out before are invalidated.
+    Must run on a single tasklet with no other operation in flight.
+*/
+static inline void storage_compact() {
+    __dma_aligned Bnode bnode;
+    __dma_aligned Pnode pnode;
+    pptr child;
+    int64_t lo, hi;
+    int i;
+
+    // Unused slab slots are never written, mark them as free before scanning
+    for(i = 0; i < NR_TASKLETS; i++) {
+        for(lo = b_slab_next[i]; lo < b_slab_end[i]; lo++) b_buffer[lo].height = INVALID_NODE_HEIGHT;
+        for(lo = p_slab_next[i]; lo < p_slab_end[i]; lo++) p_buffer[lo].height = INVALID_NODE_HEIGHT;
+    }
+    slab_reset();
+
+    // B nodes: the root stays at index 0
+    lo = 1; hi = bcnt;
+    while(true) {
+        while(lo < hi && b_buffer[lo].height != INVALID_NODE_HEIGHT) lo++;
+        while(hi > lo && b_buffer[hi - 1].height == INVALID_NODE_HEIGHT) hi--;
+        if(lo >= hi) break;
+        hi--;
+        m_read(b_buffer + hi, &bnode, sizeof(Bnode));
+        m_write(&bnode, b_buffer + lo, sizeof(Bnode));
+        b_buffer[hi].height = INVALID_NODE_HEIGHT;
+        relink_moved_node(bnode.parent, mbptr_to_pptr(b_buffer + hi), mbptr_to_pptr(b_buffer + lo));
+        for(i = 0; i < DB_SIZE; i++) {
+            child = bnode.children[i];
+            if(child.data_type == B_NODE_DATA_TYPE) pptr_to_mbptr(child)->parent = (int32_t)lo;
+            else if(child.data_type == P_NODE_DATA_TYPE) pptr_to_mpptr(child)->parent = (int32_t)lo;
+        }
+        lo++;
+    }
+    bcnt = hi;
+
+    // P nodes
+    lo = 0; hi = pcnt;
+    while(true) {
+        while(lo < hi && p_buffer[lo].height != INVALID_NODE_HEIGHT) lo++;
+        while(hi > lo && p_buffer[hi - 1].height == INVALID_NODE_HEIGHT) hi--;
+        if(lo >= hi) break;
+        hi--;
+        m_read(p_buffer + hi, &pnode, sizeof(Pnode_mram));
+        m_write(&pnode, p_buffer + lo, sizeof(Pnode_mram));
+        p_buffer[hi].height = INVALID_NODE_HEIGHT;
+        relink_moved_node(pnode.parent, mpptr_to_pptr(p_buffer + hi), mpptr_to_pptr(p_buffer + lo));
+        lo++;
+    }
+    pcnt = hi;
+
+    free_list_reset();
+}
+
+
+/*
+    WRAM copies of the top B node levels, looked up by b_buffer index, so that descents from the root skip their MRAM reads.
+    Blocks that change B nodes invalidate the copies in init(). The next read-only block, or the end of the launch, rebuilds them.
+*/
+typedef struct wram_bnode_cache {
+    int32_t num;  // 0 while invalid
+    uint8_t hash[WRAM_BNODE_CACHE_HASH_SIZE];  // 1 + position of the copy, 0 if empty
+    uint32_t idx[WRAM_BNODE_CACHE_SIZE];
+    Bnode nodes[WRAM_BNODE_CACHE_SIZE];
+} wram_bnode_cache __attribute__((aligned (8)));
+
+wram_bnode_cache bnode_cache;
+
+static inline Bnode* bnode_cache_find(mBptr addr) {
+    uint32_t idx = (uint32_t)(addr - b_buffer);
+    uint8_t pos = bnode_cache.hash[idx & (WRAM_BNODE_CACHE_HASH_SIZE - 1)];
+    if(pos == 0 || bnode_cache.idx[pos - 1] != idx) return NULL;
+    return bnode_cache.nodes + (pos - 1);
+}
+
+static inline void bnode_cache_invalidate() {
+    bnode_cache.num = 0;
+    for(int i = 0; i < WRAM_BNODE_CACHE_HASH_SIZE; i++) bnode_cache.hash[i] = 0;
+}
+
+// Nodes colliding in the hash are left in MRAM
+static inline void bnode_cache_add(mBptr addr) {
+    uint32_t idx = (uint32_t)(addr - b_buffer);
+    uint8_t *slot = bnode_cache.hash + (idx & (WRAM_BNODE_CACHE_HASH_SIZE - 1));
+    if(*slot != 0 || bnode_cache.num >= WRAM_BNODE_CACHE_SIZE) return;
+    m_read(addr, bnode_cache.nodes + bnode_cache.num, sizeof(Bnode));
+    bnode_cache.idx[bnode_cache.num] = idx;
+    bnode_cache.num++;
+    *slot = (uint8_t)bnode_cache.num;
+}
+
+/* Called by a single tasklet, while no other tasklet descends */
+static inline void bnode_cache_build() {
+    int level, level_start = 0, level_end, pos, i;
+    pptr child;
+    bnode_cache_invalidate();
+    if(DPU_ID < 0) return;  // No root before INIT_TSK
+    bnode_cache_add(root);
+    for(level = 1; level < WRAM_BNODE_CACHE_LEVELS; level++) {
+        level_end = bnode_cache.num;
+        for(pos = level_start; pos < level_end; pos++) {
+            for(i = 0; i < DB_SIZE; i++) {
+                child = bnode_cache.nodes[pos].children[i];
+                if(child.data_type == B_NODE_DATA_TYPE) bnode_cache_add(pptr_to_mbptr(child));
+            }
+        }
+        level_start = level_end;
+    }
+}
+
+/* Metadata of a B node, from its WRAM copy or read into buf */
+static inline Bnode* bnode_load_metadata(mBptr addr, Bnode *buf) {
+    Bnode *cached = bnode_cache_find(addr);
+    if(cached != NULL) return cached;
+    m_read(addr, buf, BNODE_METADATA_SIZE);
+    return buf;
+}
+
+/* Children of a B node, from its WRAM copy or read into buf */
+static inline pptr* bnode_load_children(mBptr addr, pptr *buf) {
+    Bnode *cached = bnode_cache_find(addr);
+    if(cached != NULL) return cached->children;
+    m_read(addr->children, buf, S64(DB_SIZE));
+    return buf;
+}
+
+#ifdef BNODE_AGGREGATE_ON
+/* Aggregate of a B node subtree, from its WRAM copy or read into buf */
+static inline Bnode_aggregate* bnode_load_aggregate(mBptr addr, Bnode_aggregate *buf) {
+    Bnode *cached = bnode_cache_find(addr);
+    if(cached != NULL) return &(cached->agg);
+    m_read(&(addr->agg), buf, sizeof(Bnode_aggregate));
+    return buf;
+}
+#endif
+
 
 /* Used for WRAM heap stroage for DPU program reloading */
 
@@ -104,6 +381,8 @@ typedef struct WRAMHeap {
 
     int64_t DPU_ID;
     uint64_t range_per_dpu;
+    uint64_t local_range_start;  // Set by INIT_RANGE_TSK, and moved by repartitioning
+    uint64_t local_range_end;
 
     uint64_t bcnt;
     mBptr root;
@@ -112,6 +391,16 @@ typedef struct WRAMHeap {
     uint64_t pcnt;
     mPptr pbuffer;
 
+    int32_t b_free_list[NR_TASKLETS];
+    int32_t p_free_list[NR_TASKLETS];
+    uint32_t b_free_num[NR_TASKLETS];
+    uint32_t p_free_num[NR_TASKLETS];
+
+    uint32_t b_slab_next[NR_TASKLETS];
+    uint32_t b_slab_end[NR_TASKLETS];
+    uint32_t p_slab_next[NR_TASKLETS];
+    uint32_t p_slab_end[NR_TASKLETS];
+
     mpint64_t send_varlen_offset[NR_TASKLETS];
     mpuint8_t send_varlen_buffer[NR_TASKLETS];
 
@@ -125,13 +414,16 @@ typedef struct WRAMHeap {
 
 __host mpuint8_t wram_heap_save_addr = NULL_pt(mpuint8_t);  // IRAM friendly
 __host uint64_t wram_load_consensus_location = (uint64_t)CPU_DPU_CONSENSUS_NO;
-__mram_noinit uint8_t wram_heap_save_addr_tmp[sizeof(WRAMHeap) << 1];
+// The B node cache is saved right after the WRAMHeap
+__mram_noinit uint8_t wram_heap_save_addr_tmp[(sizeof(WRAMHeap) << 1) + sizeof(wram_bnode_cache)];
 
 void wram_heap_save() {
     mpuint8_t saveAddr = wram_heap_save_addr;
     WRAMHeap heapInfo;
     heapInfo.DPU_ID = DPU_ID;
     heapInfo.range_per_dpu = range_per_dpu;
+    heapInfo.local_range_start = local_range_start;
+    heapInfo.local_range_end = local_range_end;
     heapInfo.root = root;
     heapInfo.bcnt = bcnt;
     heapInfo.bbuffer = b_buffer;
@@ -143,16 +435,27 @@ void wram_heap_save() {
     heapInfo.cycle_cnt = cycle_count;
 #endif
     for(int i = 0; i < NR_TASKLETS; i++){
+        heapInfo.b_free_list[i] = b_free_list[i];
+        heapInfo.p_free_list[i] = p_free_list[i];
+        heapInfo.b_free_num[i] = b_free_num[i];
+        heapInfo.p_free_num[i] = p_free_num[i];
+        heapInfo.b_slab_next[i] = b_slab_next[i];
+        heapInfo.b_slab_end[i] = b_slab_end[i];
+        heapInfo.p_slab_next[i] = p_slab_next[i];
+        heapInfo.p_slab_end[i] = p_slab_end[i];
         heapInfo.send_varlen_offset[i] = send_varlen_offset[i];
         heapInfo.send_varlen_buffer[i] = send_varlen_buffer[i];
     }
     if(saveAddr == NULL_pt(mpuint8_t)) saveAddr = wram_heap_save_addr_tmp;
     mram_write(&heapInfo, saveAddr, sizeof(WRAMHeap));
+    if(bnode_cache.num == 0) bnode_cache_build();
+    m_write(&bnode_cache, saveAddr + sizeof(WRAMHeap), sizeof(wram_bnode_cache));
     wram_heap_save_addr = saveAddr;
 }
 
 void wram_heap_init() {
     storage_init();
+    bnode_cache_invalidate();
     wram_heap_save_addr = NULL_pt(mpuint8_t);
     for(int i = 0; i < NR_TASKLETS; i++) {
         send_varlen_offset[i] = send_varlen_offset_tmp[i];
@@ -173,11 +476,12 @@ void wram_heap_load() {
         else {
             WRAMHeap heapInfo;
             mram_read((mpuint8_t)saveAddr, &heapInfo, sizeof(WRAMHeap));
+            m_read((mpuint8_t)saveAddr + sizeof(WRAMHeap), &bnode_cache, sizeof(wram_bnode_cache));
 
             DPU_ID = heapInfo.DPU_ID;
             range_per_dpu = heapInfo.range_per_dpu;
-            local_range_start = local_range_end * DPU_ID;
-            local_range_end = range_per_dpu + local_range_start - 1;
+            local_range_start = heapInfo.local_range_start;
+            local_range_end = heapInfo.local_range_end;
 
             root = heapInfo.root;
             bcnt = heapInfo.bcnt;
@@ -186,6 +490,14 @@ void wram_heap_load() {
             p_buffer = heapInfo.pbuffer;
 
             for(int i = 0; i < NR_TASKLETS; i++) {
+                b_free_list[i] = heapInfo.b_free_list[i];
+                p_free_list[i] = heapInfo.p_free_list[i];
+                b_free_num[i] = heapInfo.b_free_num[i];
+                p_free_num[i] = heapInfo.p_free_num[i];
+                b_slab_next[i] = heapInfo.b_slab_next[i];
+                b_slab_end[i] = heapInfo.b_slab_end[i];
+                p_slab_next[i] = heapInfo.p_slab_next[i];
+                p_slab_end[i] = heapInfo.p_slab_end[i];
                 send_varlen_offset[i] = heapInfo.send_varlen_offset[i];
                 send_varlen_buffer[i] = heapInfo.send_varlen_buffer[i];
             }
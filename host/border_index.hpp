@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <immintrin.h>
+
+/* Keys per node: one cache line of borders */
+#define BORDER_INDEX_NODE_SIZE (8)
+
+/*
+    Static B-tree layout of the partition borders, searched with one SIMD compare per level.
+    Node k holds BORDER_INDEX_NODE_SIZE sorted keys, and its child i is node k * (BORDER_INDEX_NODE_SIZE + 1) + i + 1.
+    Borders 1 .. nr_of_dpus - 1 are stored; search(key) returns the DPU whose range holds the key.
+*/
+class partition_border_index {
+public:
+    struct alignas(64) border_node {
+        uint64_t keys[BORDER_INDEX_NODE_SIZE];
+    };
+
+    border_node *nodes;
+    uint16_t (*ids)[BORDER_INDEX_NODE_SIZE];
+    int node_num;
+
+    partition_border_index() {
+        this->nodes = nullptr;
+        this->ids = nullptr;
+        this->node_num = 0;
+    }
+
+    ~partition_border_index() {
+        delete [] this->nodes;
+        delete [] this->ids;
+    }
+
+    void build(const uint64_t *borders, int dpu_num) {
+        int key_num = dpu_num - 1;
+        int new_node_num = (key_num + BORDER_INDEX_NODE_SIZE - 1) / BORDER_INDEX_NODE_SIZE;
+        if(new_node_num < 1) new_node_num = 1;
+        if(new_node_num != this->node_num) {
+            delete [] this->nodes;
+            delete [] this->ids;
+            this->nodes = new border_node[new_node_num];
+            this->ids = new uint16_t[new_node_num][BORDER_INDEX_NODE_SIZE];
+            this->node_num = new_node_num;
+        }
+        int next = 1;
+        build_node(0, borders, dpu_num, next);
+    }
+
+    /* Number of keys in the node that are <= key. Keys are sorted, so this is also the child to descend into. */
+    static inline int count_le(const uint64_t *keys, uint64_t key) {
+#if defined(__AVX512F__)
+        __m512i k = _mm512_load_si512((const void*)keys);
+        return __builtin_popcount((unsigned)_mm512_cmple_epu64_mask(k, _mm512_set1_epi64((int64_t)key)));
+#elif defined(__AVX2__)
+        // No unsigned 64-bit compare in AVX2: flip the sign bits and compare as signed
+        const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+        __m256i x = _mm256_xor_si256(_mm256_set1_epi64x((int64_t)key), sign);
+        __m256i k0 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)keys), sign);
+        __m256i k1 = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(keys + 4)), sign);
+        int gt0 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k0, x)));
+        int gt1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k1, x)));
+        return BORDER_INDEX_NODE_SIZE - __builtin_popcount(gt0 | (gt1 << 4));
+#else
+        int ret = 0;
+        for(int i = 0; i < BORDER_INDEX_NODE_SIZE; i++) ret += (keys[i] <= key);
+        return ret;
+#endif
+    }
+
+    inline uint16_t search(uint64_t key) const {
+        uint16_t ret = 0;
+        int k = 0, i;
+        while(k < this->node_num) {
+            i = count_le(this->nodes[k].keys, key);
+            if(i > 0) ret = this->ids[k][i - 1];
+            k = k * (BORDER_INDEX_NODE_SIZE + 1) + i + 1;
+        }
+        return ret;
+    }
+
+private:
+    /* In-order fill; slots past the last border are padded with UINT64_MAX, owned by the last DPU */
+    void build_node(int k, const uint64_t *borders, int dpu_num, int &next) {
+        if(k >= this->node_num) return;
+        for(int i = 0; i < BORDER_INDEX_NODE_SIZE; i++) {
+            build_node(k * (BORDER_INDEX_NODE_SIZE + 1) + i + 1, borders, dpu_num, next);
+            if(next < dpu_num) {
+                this->nodes[k].keys[i] = borders[next];
+                this->ids[k][i] = (uint16_t)next;
+                next++;
+            }
+            else {
+                this->nodes[k].keys[i] = UINT64_MAX;
+                this->ids[k][i] = (uint16_t)(dpu_num - 1);
+            }
+        }
+        build_node(k * (BORDER_INDEX_NODE_SIZE + 1) + BORDER_INDEX_NODE_SIZE + 1, borders, dpu_num, next);
+    }
+};
@@ -14,6 +14,7 @@ const string dpu_box_fetch_binary = "build/zd_tree_dpu_box_fetch";
 const string dpu_box_count_binary = "build/zd_tree_dpu_box_count";
 const string dpu_knn_binary = "build/zd_tree_dpu_knn";
 const string dpu_misc_binary = "build/zd_tree_dpu_misc";
+const string dpu_unified_binary = "build/zd_tree_dpu_unified";
 
 int32_t wram_save_pos[NR_DPUS];
 
@@ -49,7 +50,8 @@ enum dpu_binary {
     box_fetch_binary,
     box_count_binary,
     knn_binary,
-    misc_binary
+    misc_binary,
+    unified_binary
 };
 dpu_binary current_dpu_binary = dpu_binary::empty;
 
@@ -75,6 +77,10 @@ inline void dpu_binary_switch_core(dpu_binary target) {
             dpu_control::load(dpu_misc_binary);
             break;
         }
+        case dpu_binary::unified_binary: {
+            dpu_control::load(dpu_unified_binary);
+            break;
+        }
         default: {
             ASSERT(false);
             break;
@@ -86,6 +92,11 @@ mutex switch_mutex;
 
 inline void dpu_binary_switch_to(dpu_binary target) {
     unique_lock wLock(switch_mutex);
+#ifdef DPU_UNIFIED_BINARY
+    // Every task handler lives in one program, so only the first call loads it
+    target = dpu_binary::unified_binary;
+    if (current_dpu_binary == target) return;
+#endif
     time_nested("switchto" + std::to_string(target), [&]() {
         if (current_dpu_binary != target) {
             cpu_coverage_timer->end();
@@ -18,14 +18,23 @@ public:
     uint8_t max_k;
     int64_t *distance_storage;
     vectorT *vector_storage;
+#ifdef POINT_PAYLOAD_ON
+    PAYLOAD_TYPE *payload_storage;
+#endif
 
     heap_host(uint8_t max_k = MAX_KNN_SIZE): max_k(max_k), num(0) {
         distance_storage = new int64_t[max_k];
         vector_storage = new vectorT[max_k];
+#ifdef POINT_PAYLOAD_ON
+        payload_storage = new PAYLOAD_TYPE[max_k];
+#endif
     }
     ~heap_host() {
         delete [] distance_storage;
         delete [] vector_storage;
+#ifdef POINT_PAYLOAD_ON
+        delete [] payload_storage;
+#endif
     }
 
     void heapify_up(uint8_t index) {
@@ -36,6 +45,9 @@ public:
             if (index && this->distance_storage[idx_half] < this->distance_storage[index]) {
                 swap_int(this->distance_storage[idx_half], this->distance_storage[index]);
                 swap_object(this->vector_storage[idx_half], this->vector_storage[index]);
+#ifdef POINT_PAYLOAD_ON
+                swap_int(this->payload_storage[idx_half], this->payload_storage[index]);
+#endif
                 index = idx_half;
             }
             else continue_signal = false;
@@ -69,6 +81,9 @@ public:
             if(largest != index) {
                 swap_int(this->distance_storage[index], this->distance_storage[largest]);
                 swap_object(this->vector_storage[index], this->vector_storage[largest]);
+#ifdef POINT_PAYLOAD_ON
+                swap_int(this->payload_storage[index], this->payload_storage[largest]);
+#endif
                 index = largest;
             }
             else continue_signal = false;
@@ -79,10 +94,13 @@ public:
         this->num--;
         this->distance_storage[0] = this->distance_storage[this->num];
         this->vector_storage[0] = this->vector_storage[this->num];
+#ifdef POINT_PAYLOAD_ON
+        this->payload_storage[0] = this->payload_storage[this->num];
+#endif
         this->heapify_down(0);
     }
 
-    void enqueue(int64_t distance, vectorT *vec) {
+    void enqueue(int64_t distance, vectorT *vec PAYLOAD_ARG(PAYLOAD_TYPE payload)) {
         uint8_t pt;
         if(this->num >= this->max_k) {
             if(distance >= this->distance_storage[0]) return;
@@ -90,6 +108,9 @@ public:
         }
         this->distance_storage[this->num] = distance;
         this->vector_storage[this->num] = *vec;
+#ifdef POINT_PAYLOAD_ON
+        this->payload_storage[this->num] = payload;
+#endif
         this->heapify_up(this->num);
         this->num++;
     }
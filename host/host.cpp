@@ -30,6 +30,7 @@ int search_batch_size;
 int search_type; /* 1: Point search; 2: Box range count; 3: Box fetch; 4: kNN */
 int expected_box_size;
 bool print_timer;
+bool rebalance_after_init;
 bool debug_print;
 int test_type;
 int top_level_threads;
@@ -89,6 +90,10 @@ void host_parse_arguments(int argc, char *argv[]) {
         .help("Print timing information")
         .default_value(true)
         .implicit_value(true);
+    parser.add_argument("--rebalance")
+        .help("Repartition the DPU key ranges after the initial inserts")
+        .default_value(false)
+        .implicit_value(true);
     parser.add_argument("--top-level-threads")
         .help("Number of top-level threads")
         .default_value(1)
@@ -109,6 +114,7 @@ void host_parse_arguments(int argc, char *argv[]) {
     debug_print        = parser.get<bool>("--debug");
     print_timer        = parser.get<bool>("--print-timer");
     top_level_threads  = parser.get<int>("--top-level-threads");
+    rebalance_after_init = parser.get<bool>("--rebalance");
 
     for (int i = 0; i < NR_DIMENSION; ++i)
         input_coord_max[i] = INT32_MAX;
@@ -152,9 +158,10 @@ int main(int argc, char *argv[]) {
 #endif
             });
         }
-        if(search_type == 2 || search_type == 3 || search_type == 4)
-            vec_dataset = new vectorT[total_insert_size];
     }
+    // The searches and the mixed batch tests check their answers against the dataset
+    bool keep_dataset = (need_to_search && search_type != 1) || test_type == 6 || test_type == 7 || rebalance_after_init;
+    if(keep_dataset) vec_dataset = new vectorT[total_insert_size];
 
     cpu_coverage_timer->start();
     dpu_binary_switch_to(dpu_binary::insert_binary);
@@ -165,12 +172,12 @@ int main(int argc, char *argv[]) {
     parlay::sequence<uint64_t> sorted_idx_from_file;
     parlay::sequence<vectorT> vectors_from_varden(1);
     size_t varden_counter = 0;
-    zd_tree.key_to_dpu_id_mode = 0;
     zd_tree.partition_borders[0] = 0;
     zd_tree.partition_borders[nr_of_dpus] = UINT64_MAX;
     parfor_wrap(1, nr_of_dpus, [&](size_t i) {
         zd_tree.partition_borders[i] = UINT64_MAX / nr_of_dpus * i;
     });
+    zd_tree.set_partition_borders(0, zd_tree.partition_borders);
     COORD tmp_coord_max[NR_DIMENSION];
     for(int i = 0; i < NR_DIMENSION; i++) {
         tmp_coord_max[i] = COORD_MAX;
@@ -190,12 +197,65 @@ int main(int argc, char *argv[]) {
 #else
             for(int j = 0; j < NR_DIMENSION; j++) zd_tree.vector_input[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
 #endif
-            if(need_to_search && search_type != 1) vec_dataset[j * insert_batch_size + i] = zd_tree.vector_input[i];
+#ifdef POINT_PAYLOAD_ON
+            zd_tree.payload_input[i] = j * insert_batch_size + i;  // Index in the inserted dataset
+#endif
+            if(keep_dataset) vec_dataset[j * insert_batch_size + i] = zd_tree.vector_input[i];
             if(need_to_search && i < search_per_batch && search_type < 4 && search_type > 0)
                 vecs[j * search_per_batch + i] = zd_tree.vector_input[i];
         });
         zd_tree.insert(zd_tree.vector_input, debug_print);
     }
+    if(rebalance_after_init) {
+        zd_tree.rebalance(128, debug_print);
+
+        // kNN in another binary must use the repartitioned ownership ranges to end queries after the first round
+        cpu_coverage_timer->start();
+        dpu_binary_switch_to(dpu_binary::knn_binary);
+        cpu_coverage_timer->end();
+        int knn_k = (expected_box_size > 0 && expected_box_size <= MAX_KNN_SIZE) ? expected_box_size : 10;
+        zd_tree.length = min((int64_t)1024, total_insert_size / knn_k);
+        parfor_wrap(0, zd_tree.length, [&](size_t i) {
+#if NR_DIMENSION == 2
+            zd_tree.vector_input[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            zd_tree.vector_input[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#elif NR_DIMENSION == 3
+            zd_tree.vector_input[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            zd_tree.vector_input[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            zd_tree.vector_input[i].z = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#else
+            for(int j = 0; j < NR_DIMENSION; j++) zd_tree.vector_input[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#endif
+        });
+        zd_tree.knn(knn_k);
+        auto knn_errs = parlay::tabulate(zd_tree.length, [&](size_t i) -> int64_t {
+            int64_t distance = 0, tmp;
+            vectorT vec;
+            for(int j = 0; j < knn_k; j++) {
+                vec = vector_sub(&zd_tree.vector_input[i], &zd_tree.vector_output[i * knn_k + j]);
+                tmp = vector_norm(&vec);
+                if(tmp > distance) distance = tmp;
+            }
+            heap_host heap(knn_k);
+            for(int64_t j = 0; j < total_insert_size; j++) {
+                vec = vector_sub(&zd_tree.vector_input[i], &vec_dataset[j]);
+                heap.enqueue(vector_norm(&vec), &vec_dataset[j] PAYLOAD_ARG((PAYLOAD_TYPE)j));
+            }
+            if(distance != heap.distance_storage[0]) {
+                printf("Query %lu after rebalance: %lld %lld\n", i, distance, heap.distance_storage[0]);
+                return 1;
+            }
+            return 0;
+        });
+        printf("Total kNN err after rebalance: %lld\n", (int64_t)parlay::reduce(knn_errs));
+        cpu_coverage_timer->start();
+        dpu_binary_switch_to(dpu_binary::insert_binary);
+        cpu_coverage_timer->end();
+        for(int i = 1; i < top_level_threads; i++) {
+            if(zd_forest[i] == nullptr) continue;
+            zd_forest[i]->set_partition_borders(zd_tree.key_to_dpu_id_mode, zd_tree.partition_borders);
+        }
+    }
     
     if(print_timer) {
         cout<<"Total dataset size: "<<pim_zd_tree::nr_points.load()<<endl;
@@ -218,6 +278,8 @@ int main(int argc, char *argv[]) {
     
     total_communication = 0;
     total_actual_communication = 0;
+    pim_zd_tree::box_query_num = pim_zd_tree::box_dpu_task_num = 0;
+    pim_zd_tree::knn_query_num = pim_zd_tree::knn_dpu_task_num = 0;
 
     if(test_type == 1) {
         cpu_coverage_timer->start();
@@ -374,7 +436,221 @@ int main(int argc, char *argv[]) {
         program_duration = std::chrono::duration_cast<microseconds>(timer_program_stop - timer_program_start);
         total_test_time = program_duration.count();
     }
+    else if(test_type == 5) {
+        cpu_coverage_timer->start();
+        dpu_binary_switch_to(dpu_binary::insert_binary);
+        cpu_coverage_timer->end();
 
+        // Insert the points to be deleted first, only the deletions are timed
+        zd_tree.length = test_batch_size;
+        vectorT *vec_to_search = new vectorT[test_round * test_batch_size];
+        parfor_wrap(0, test_round * test_batch_size, [&](size_t i) {
+#if NR_DIMENSION == 2
+            vec_to_search[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#elif NR_DIMENSION == 3
+            vec_to_search[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].z = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#else
+            for(int j = 0; j < NR_DIMENSION; j++) vec_to_search[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#endif
+        });
+        for(int j = 0; j < test_round; j++) {
+            zd_tree.insert(vec_to_search + j * test_batch_size, debug_print);
+        }
+        reset_all_timers();
+        zd_tree.reset_epoch_num();
+        cpu_coverage_timer->reset();
+        pim_coverage_timer->reset();
+        total_communication = 0;
+        total_actual_communication = 0;
+
+        int64_t nr_points_before = pim_zd_tree::nr_points.load();
+        timer_program_start = std::chrono::high_resolution_clock::now();
+#ifdef USE_PAPI
+        papi_reset_counters();
+        papi_turn_counters(true);
+        papi_check_counters(parlay::worker_id());
+        papi_wait_counters(true, parlay::num_workers());
+#endif
+        for(int j = 0; j < test_round; j++) {
+            zd_tree.erase(vec_to_search + j * test_batch_size, debug_print);
+        }
+#ifdef USE_PAPI
+        papi_turn_counters(false);
+        papi_check_counters(parlay::worker_id());
+        papi_wait_counters(false, parlay::num_workers());
+#endif
+        timer_program_stop = std::chrono::high_resolution_clock::now();
+
+        // Every inserted copy is gone: the point count is back, and no deleted point is found
+        int64_t err_num = 0;
+        if(nr_points_before - pim_zd_tree::nr_points.load() != (int64_t)test_round * test_batch_size) {
+            printf("Deleted %lld points instead of %lld\n", nr_points_before - pim_zd_tree::nr_points.load(),
+                   (int64_t)test_round * test_batch_size);
+            err_num++;
+        }
+        for(int j = 0; j < test_round; j++) {
+            zd_tree.length = test_batch_size;
+            zd_tree.contains(vec_to_search + j * test_batch_size);
+            for(int64_t i = 0; i < test_batch_size; i++) err_num += zd_tree.i64_io[i];
+        }
+        printf("Total delete err: %lld\n", err_num);
+        delete [] vec_to_search;
+        program_duration = std::chrono::duration_cast<microseconds>(timer_program_stop - timer_program_start);
+        total_test_time = program_duration.count();
+    }
+    else if(test_type == 6 || test_type == 7) {
+        cpu_coverage_timer->start();
+        dpu_binary_switch_to(dpu_binary::unified_binary);
+        cpu_coverage_timer->end();
+        cpu_coverage_timer->reset();
+        pim_coverage_timer->reset();
+
+        // Each batch: half inserts, a quarter box counts and a quarter kNN queries
+        int64_t insert_num = test_batch_size / 2, box_num = test_batch_size / 4;
+        int64_t knn_num = test_batch_size - insert_num - box_num;
+        int64_t batch_input_size = insert_num + (box_num << 1) + knn_num;
+        int knn_k = (expected_box_size > 0 && expected_box_size <= MAX_KNN_SIZE) ? expected_box_size : 10;
+        int64_t box_edge_size = COORD_MAX / pow(pim_zd_tree::nr_points.load() / expected_box_size, 1.0 / NR_DIMENSION) / 2.0;
+        vectorT boxes;
+#if NR_DIMENSION == 2
+        boxes = (vectorT){.x = box_edge_size, .y = box_edge_size};
+#elif NR_DIMENSION == 3
+        boxes = (vectorT){.x = box_edge_size, .y = box_edge_size, .z = box_edge_size};
+#else
+        for(int j = 0; j < NR_DIMENSION; j++) boxes.x[j] = box_edge_size;
+#endif
+        vectorT *vec_to_search = new vectorT[test_round * batch_input_size];
+        parfor_wrap(0, test_round * batch_input_size, [&](size_t i) {
+#if NR_DIMENSION == 2
+            vec_to_search[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#elif NR_DIMENSION == 3
+            vec_to_search[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+            vec_to_search[i].z = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#else
+            for(int j = 0; j < NR_DIMENSION; j++) vec_to_search[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#endif
+        });
+        parfor_wrap(0, test_round * box_num, [&](size_t i) {
+            vectorT *box_pt = vec_to_search + (i / box_num) * batch_input_size + insert_num + ((i % box_num) << 1);
+            vectorT vec = box_pt[0];
+            box_pt[0] = vector_sub_zero_bounded(&vec, &boxes);
+            box_pt[1] = vector_add(&vec, &boxes);
+        });
+#ifdef POINT_PAYLOAD_ON
+        PAYLOAD_TYPE *payload_to_search = new PAYLOAD_TYPE[test_round * batch_input_size];
+        parfor_wrap(0, test_round * batch_input_size, [&](size_t i) {payload_to_search[i] = total_insert_size + i;});
+#endif
+
+        // Answers of the first queries of every batch, checked against brute force after the timed region
+        int64_t check_box_num = min(box_num, (int64_t)32), check_knn_num = min(knn_num, (int64_t)32);
+        int64_t *box_answers = new int64_t[test_round * check_box_num];
+        vectorT *knn_answers = new vectorT[test_round * check_knn_num * knn_k];
+#ifdef POINT_PAYLOAD_ON
+        PAYLOAD_TYPE *knn_answer_payloads = new PAYLOAD_TYPE[test_round * check_knn_num * knn_k];
+#endif
+        auto record_answers = [&](int j, const int64_t *box_counts, const vectorT *knn_results
+                                  PAYLOAD_ARG(const PAYLOAD_TYPE *knn_payloads)) {
+            memcpy(box_answers + j * check_box_num, box_counts, sizeof(int64_t) * check_box_num);
+            memcpy(knn_answers + j * check_knn_num * knn_k, knn_results, sizeof(vectorT) * check_knn_num * knn_k);
+#ifdef POINT_PAYLOAD_ON
+            memcpy(knn_answer_payloads + j * check_knn_num * knn_k, knn_payloads, sizeof(PAYLOAD_TYPE) * check_knn_num * knn_k);
+#endif
+        };
+
+        timer_program_start = std::chrono::high_resolution_clock::now();
+#ifdef USE_PAPI
+        papi_reset_counters();
+        papi_turn_counters(true);
+        papi_check_counters(parlay::worker_id());
+        papi_wait_counters(true, parlay::num_workers());
+#endif
+        if(test_type == 6) {
+            for(int j = 0; j < test_round; j++) {
+#ifdef POINT_PAYLOAD_ON
+                memcpy(zd_tree.payload_input, payload_to_search + j * batch_input_size, sizeof(PAYLOAD_TYPE) * insert_num);
+#endif
+                zd_tree.execute_mixed(insert_num, box_num, knn_num, knn_k, vec_to_search + j * batch_input_size);
+                record_answers(j, zd_tree.i64_io, zd_tree.vector_output PAYLOAD_ARG(zd_tree.payload_output));
+            }
+        }
+        else {
+            zd_tree.execute_mixed_pipelined(test_round, insert_num, box_num, knn_num, knn_k, vec_to_search PAYLOAD_ARG(payload_to_search),
+                                            record_answers);
+        }
+#ifdef USE_PAPI
+        papi_turn_counters(false);
+        papi_check_counters(parlay::worker_id());
+        papi_wait_counters(false, parlay::num_workers());
+#endif
+        timer_program_stop = std::chrono::high_resolution_clock::now();
+
+        // Batch j observes the dataset and the inserts of the batches before it
+        auto stored_point = [&](int64_t idx) -> vectorT* {
+            if(idx < total_insert_size) return &vec_dataset[idx];
+            idx -= total_insert_size;
+            return &vec_to_search[(idx / insert_num) * batch_input_size + idx % insert_num];
+        };
+        int64_t err_num = 0;
+        for(int j = 0; j < test_round; j++) {
+            int64_t point_num = total_insert_size + j * insert_num;
+            vectorT *batch = vec_to_search + j * batch_input_size;
+            auto box_errs = parlay::tabulate(check_box_num, [&](size_t i) -> int64_t {
+                int64_t count = 0;
+                for(int64_t p = 0; p < point_num; p++) {
+                    if(vector_in_box(stored_point(p), &batch[insert_num + (i << 1)], &batch[insert_num + (i << 1) + 1])) count++;
+                }
+                if(count != box_answers[j * check_box_num + i]) {
+                    printf("Mixed batch %d, box %lu: %lld %lld\n", j, i, count, box_answers[j * check_box_num + i]);
+                    return 1;
+                }
+                return 0;
+            });
+            auto knn_errs = parlay::tabulate(check_knn_num, [&](size_t i) -> int64_t {
+                vectorT *center = &batch[insert_num + (box_num << 1) + i], vec;
+                int64_t res_pos = (j * check_knn_num + i) * knn_k, distance = 0, tmp, errs = 0;
+                for(int t = 0; t < knn_k; t++) {
+                    vec = vector_sub(center, &knn_answers[res_pos + t]);
+                    tmp = vector_norm(&vec);
+                    if(tmp > distance) distance = tmp;
+#ifdef POINT_PAYLOAD_ON
+                    // Payloads are dataset indices, or total_insert_size plus the index in vec_to_search
+                    PAYLOAD_TYPE id = knn_answer_payloads[res_pos + t];
+                    if(id >= (PAYLOAD_TYPE)(total_insert_size + test_round * batch_input_size)) errs++;
+                    else if(!vector_equal(id < (PAYLOAD_TYPE)total_insert_size ? &vec_dataset[id] : &vec_to_search[id - total_insert_size],
+                                          &knn_answers[res_pos + t])) errs++;
+#endif
+                }
+                heap_host heap(knn_k);
+                for(int64_t p = 0; p < point_num; p++) {
+                    vec = vector_sub(center, stored_point(p));
+                    heap.enqueue(vector_norm(&vec), stored_point(p) PAYLOAD_ARG((PAYLOAD_TYPE)p));
+                }
+                if(distance != heap.distance_storage[0]) {
+                    printf("Mixed batch %d, kNN query %lu: %lld %lld\n", j, i, distance, heap.distance_storage[0]);
+                    errs++;
+                }
+                return errs;
+            });
+            err_num += parlay::reduce(box_errs) + parlay::reduce(knn_errs);
+        }
+        printf("Total mixed batch err: %lld\n", err_num);
+        delete [] box_answers;
+        delete [] knn_answers;
+#ifdef POINT_PAYLOAD_ON
+        delete [] knn_answer_payloads;
+#endif
+        delete [] vec_to_search;
+#ifdef POINT_PAYLOAD_ON
+        delete [] payload_to_search;
+#endif
+        program_duration = std::chrono::duration_cast<microseconds>(timer_program_stop - timer_program_start);
+        total_test_time = program_duration.count();
+    }
     if(print_timer) {
         cout<<dec<<"------------- Test timers -------------"<<endl;
         print_all_timers(print_type::pt_full);
@@ -384,6 +660,15 @@ int main(int argc, char *argv[]) {
         cout<<"Total time in test (us): "<<dec<<total_test_time<<endl;
         cout<<"Total communication: "<<total_communication<<endl;
         cout<<"Total actual communication: "<<total_actual_communication<<endl;
+#ifdef HILBERT_KEY_ON
+        const char *key_order = "Hilbert";
+#else
+        const char *key_order = "Morton";
+#endif
+        if(pim_zd_tree::box_query_num > 0)
+            cout<<"DPUs touched per box query ("<<key_order<<" order): "<<(double)pim_zd_tree::box_dpu_task_num / pim_zd_tree::box_query_num<<endl;
+        if(pim_zd_tree::knn_query_num > 0)
+            cout<<"DPUs touched per kNN query ("<<key_order<<" order): "<<(double)pim_zd_tree::knn_dpu_task_num / pim_zd_tree::knn_query_num<<endl;
 #ifdef USE_PAPI
         papi_print_counters(1);
 #endif
@@ -440,8 +725,8 @@ int main(int argc, char *argv[]) {
             zd_tree.box_range(search_type == 2, expected_box_size);
             bool correct_in_check, printed;
             for(int i = 0; i < acutal_batch_num; i++) {
-                uint64_t key1 = coord_to_key(&zd_tree.vector_input[i << 1]);
-                uint64_t key2 = coord_to_key(&zd_tree.vector_input[(i << 1) + 1]);
+                uint64_t key1 = key_prefix(coord_to_key(&zd_tree.vector_input[i << 1]));
+                uint64_t key2 = key_prefix(coord_to_key(&zd_tree.vector_input[(i << 1) + 1]));
                 if(search_type == 2 && counts[i] != zd_tree.i64_io[i]) {
                     err_num++;
                     printf("Query %d: %d %lld\n", i, counts[i], zd_tree.i64_io[i]);
@@ -467,6 +752,14 @@ int main(int argc, char *argv[]) {
                                 }
 #endif
                             }
+#ifdef POINT_PAYLOAD_ON
+                            // Payloads are the indices in vec_dataset
+                            PAYLOAD_TYPE id = zd_tree.payload_output[j];
+                            if(id >= (PAYLOAD_TYPE)total_insert_size || !vector_equal(&vec_dataset[id], &zd_tree.vector_output[j])) {
+                                correct_in_check = false;
+                                sub_err_num++;
+                            }
+#endif
                         }
                     }
                     if(!correct_in_check) {
@@ -476,6 +769,136 @@ int main(int argc, char *argv[]) {
                 }
             }
             printf("Total err num: %d\n", err_num);
+
+            if(search_type == 2) {
+                // Ball counts with the half edge of the boxes as radius
+                int64_t radius = box_edge_size;
+#if LX_NORM == 2
+                radius = (radius < L2_NORM_MAX ? radius * radius : INT64_MAX);
+#endif
+                parfor_wrap(0, acutal_batch_num, [&](size_t i) {
+                    zd_tree.vector_input[i] = vecs[i];
+                    zd_tree.i64_io[i] = radius;
+                    counts[i] = 0;
+                    for(int j = 0; j < total_insert_size; j++) {
+                        vectorT diff = vector_sub(&vec_dataset[j], &vecs[i]);
+                        if(vector_norm(&diff) <= radius) counts[i]++;
+                    }
+                });
+                zd_tree.ball_range(true, expected_box_size);
+                err_num = 0;
+                for(int i = 0; i < acutal_batch_num; i++) {
+                    if(counts[i] != zd_tree.i64_io[i]) {
+                        err_num++;
+                        printf("Ball query %d: %d %lld\n", i, counts[i], zd_tree.i64_io[i]);
+                    }
+                }
+                printf("Total ball err num: %d\n", err_num);
+
+                // Aggregates of the same boxes
+                zd_tree.box_aggregate();
+                err_num = 0;
+                parfor_wrap(0, acutal_batch_num, [&](size_t i) {
+                    vectorT sum, box_min, box_max;
+                    int64_t count = 0;
+                    vector_ones(&sum, 0);
+                    vector_ones(&box_min, INT64_MAX);
+                    vector_ones(&box_max, INT64_MIN);
+                    for(int j = 0; j < total_insert_size; j++) {
+                        if(vector_in_box(&vec_dataset[j], &zd_tree.vector_input[i << 1], &zd_tree.vector_input[(i << 1) + 1])) {
+                            count++;
+                            for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&sum, d) += VECTOR_COORD(&vec_dataset[j], d);
+                            vector_min(&vec_dataset[j], &box_min);
+                            vector_max(&vec_dataset[j], &box_max);
+                        }
+                    }
+                    counts[i] = (count == zd_tree.i64_io[i] && vector_equal(&sum, &zd_tree.vector_output[i << 2])
+                                 && vector_equal(&box_min, &zd_tree.vector_output[(i << 2) + 2])
+                                 && vector_equal(&box_max, &zd_tree.vector_output[(i << 2) + 3]));
+                });
+                for(int i = 0; i < acutal_batch_num; i++) err_num += (counts[i] == 0);
+                printf("Total aggregate err num: %d\n", err_num);
+
+                // Approximate counts of the same boxes must bound the exact ones
+                parfor_wrap(0, acutal_batch_num, [&](size_t i) {
+                    counts[i] = 0;
+                    for(int j = 0; j < total_insert_size; j++) {
+                        if(vector_in_box(&vec_dataset[j], &zd_tree.vector_input[i << 1], &zd_tree.vector_input[(i << 1) + 1])) counts[i]++;
+                    }
+                });
+                zd_tree.box_range(true, expected_box_size, nullptr, 8);
+                err_num = 0;
+                for(int i = 0; i < acutal_batch_num; i++) {
+                    int64_t estimate = zd_tree.i64_io[i], lower = zd_tree.i64_io[acutal_batch_num + i];
+                    int64_t upper = zd_tree.i64_io[2 * acutal_batch_num + i];
+                    if(lower > counts[i] || counts[i] > upper || lower > estimate || estimate > upper) {
+                        err_num++;
+                        printf("Approximate query %d: %d %lld [%lld, %lld]\n", i, counts[i], estimate, lower, upper);
+                    }
+                }
+                printf("Total approximate count err num: %d\n", err_num);
+            }
+            else {
+                // The same boxes streamed in chunks smaller than the results
+                int *stream_counts = new int[acutal_batch_num];
+                for(int i = 0; i < acutal_batch_num; i++) stream_counts[i] = 0;
+                err_num = 0;
+                zd_tree.box_fetch_stream(expected_box_size / 4, [&](int64_t i, const vectorT *v, int64_t len
+                                                                     PAYLOAD_ARG(const PAYLOAD_TYPE *payloads)) {
+                    stream_counts[i] += len;
+                    for(int64_t j = 0; j < len; j++) {
+                        vectorT vec = v[j];
+                        if(!vector_in_box(&vec, &zd_tree.vector_input[i << 1], &zd_tree.vector_input[(i << 1) + 1])) err_num++;
+#ifdef POINT_PAYLOAD_ON
+                        if(payloads[j] >= (PAYLOAD_TYPE)total_insert_size || !vector_equal(&vec_dataset[payloads[j]], &vec)) err_num++;
+#endif
+                    }
+                });
+                for(int i = 0; i < acutal_batch_num; i++) {
+                    if(counts[i] != stream_counts[i]) {
+                        err_num++;
+                        printf("Stream query %d: %d %d\n", i, counts[i], stream_counts[i]);
+                    }
+                }
+                printf("Total stream err num: %d\n", err_num);
+                delete [] stream_counts;
+
+                // Ball fetches with the half edge of the boxes as radius
+                int64_t radius = box_edge_size;
+#if LX_NORM == 2
+                radius = (radius < L2_NORM_MAX ? radius * radius : INT64_MAX);
+#endif
+                parfor_wrap(0, acutal_batch_num, [&](size_t i) {
+                    zd_tree.vector_input[i] = vecs[i];
+                    zd_tree.i64_io[i] = radius;
+                    counts[i] = 0;
+                    for(int j = 0; j < total_insert_size; j++) {
+                        vectorT diff = vector_sub(&vec_dataset[j], &vecs[i]);
+                        if(vector_norm(&diff) <= radius) counts[i]++;
+                    }
+                });
+                zd_tree.ball_range(false, expected_box_size);
+                err_num = 0;
+                for(int i = 0; i < acutal_batch_num; i++) {
+                    int sub_err_num = 0;
+                    if(counts[i] == zd_tree.i64_io[i + 1] - zd_tree.i64_io[i]) {
+                        for(int j = zd_tree.i64_io[i]; j < zd_tree.i64_io[i + 1]; j++) {
+                            vectorT diff = vector_sub(&zd_tree.vector_output[j], &vecs[i]);
+                            if(vector_norm(&diff) > radius) sub_err_num++;
+#ifdef POINT_PAYLOAD_ON
+                            PAYLOAD_TYPE id = zd_tree.payload_output[j];
+                            if(id >= (PAYLOAD_TYPE)total_insert_size || !vector_equal(&vec_dataset[id], &zd_tree.vector_output[j])) sub_err_num++;
+#endif
+                        }
+                    }
+                    else sub_err_num++;
+                    if(sub_err_num > 0) {
+                        err_num++;
+                        printf("Ball query %d: %d %lld; %d\n", i, counts[i], zd_tree.i64_io[i + 1] - zd_tree.i64_io[i], sub_err_num);
+                    }
+                }
+                printf("Total ball fetch err num: %d\n", err_num);
+            }
             delete [] counts;
         }
         else if(search_type == 4) {
@@ -506,6 +929,7 @@ int main(int argc, char *argv[]) {
             vectorT vec;
             heap_host heap(expected_box_size);
             int err_num = 0;
+            int64_t *exact_distances = new int64_t[acutal_batch_num];
             for(int i = 0; i < acutal_batch_num; i++) {
                 distance1 = 0;
                 for(int j = 0; j < expected_box_size; j++) {
@@ -515,14 +939,22 @@ int main(int argc, char *argv[]) {
                     );
                     tmp = vector_norm(&vec);
                     if(tmp > distance1) distance1 = tmp;
+#ifdef POINT_PAYLOAD_ON
+                    PAYLOAD_TYPE id = zd_tree.payload_output[i * expected_box_size + j];
+                    if(id >= (PAYLOAD_TYPE)total_insert_size || !vector_equal(&vec_dataset[id], &zd_tree.vector_output[i * expected_box_size + j])) {
+                        printf("Query %d: wrong payload %llu\n", i, (unsigned long long)id);
+                        err_num++;
+                    }
+#endif
                 }
                 heap.num = 0;
                 for(int j = 0; j < total_insert_size; j++) {
                     vec = vector_sub(&zd_tree.vector_input[i], &vec_dataset[j]);
                     tmp = vector_norm(&vec);
-                    heap.enqueue(tmp, &vec_dataset[j]);
+                    heap.enqueue(tmp, &vec_dataset[j] PAYLOAD_ARG((PAYLOAD_TYPE)j));
                 }
                 distance2 = heap.distance_storage[0];
+                exact_distances[i] = distance2;
                 if(distance1 != distance2) {
                     printf("Query %d: %lld %lld\n", i, distance1, distance2);
                     printf("Second round radius: %lld\n", zd_tree.i64_io[i]);
@@ -550,6 +982,201 @@ int main(int argc, char *argv[]) {
                 }
             }
             printf("Total err: %d\n", err_num);
+
+            // Epsilon-approximate kNN: k-th distances within (1 + eps) of the exact ones
+            double eps = 0.5, bound;
+            zd_tree.knn(expected_box_size, nullptr, eps);
+            err_num = 0;
+            for(int i = 0; i < acutal_batch_num; i++) {
+                distance1 = 0;
+                for(int j = 0; j < expected_box_size; j++) {
+                    vec = vector_sub(&zd_tree.vector_input[i], &zd_tree.vector_output[i * expected_box_size + j]);
+                    tmp = vector_norm(&vec);
+                    if(tmp > distance1) distance1 = tmp;
+                }
+#if LX_NORM == 2
+                bound = (1 + eps) * (1 + eps);
+#else
+                bound = 1 + eps;
+#endif
+                if(distance1 < exact_distances[i] || (double)distance1 > bound * exact_distances[i]) {
+                    printf("Approximate query %d: %lld %lld\n", i, distance1, exact_distances[i]);
+                    err_num++;
+                }
+            }
+            printf("Total approximate err: %d\n", err_num);
+
+            // kNN with a k per query: k = 1 on odd queries, packed output
+            int64_t *k_input = new int64_t[acutal_batch_num];
+            for(int i = 0; i < acutal_batch_num; i++) k_input[i] = (i & 1) ? 1 : expected_box_size;
+            zd_tree.knn_per_query_k(k_input);
+            err_num = 0;
+            for(int i = 0; i < acutal_batch_num; i++) {
+                if(zd_tree.i64_io[i + 1] - zd_tree.i64_io[i] != k_input[i]) {
+                    printf("Per-query k query %d: offsets %lld %lld\n", i, zd_tree.i64_io[i], zd_tree.i64_io[i + 1]);
+                    err_num++;
+                    continue;
+                }
+                distance1 = 0;
+                for(int64_t j = zd_tree.i64_io[i]; j < zd_tree.i64_io[i + 1]; j++) {
+                    vec = vector_sub(&zd_tree.vector_input[i], &zd_tree.vector_output[j]);
+                    tmp = vector_norm(&vec);
+                    if(tmp > distance1) distance1 = tmp;
+                }
+                if(k_input[i] == 1) {
+                    distance2 = INT64_MAX;
+                    for(int j = 0; j < total_insert_size; j++) {
+                        vec = vector_sub(&zd_tree.vector_input[i], &vec_dataset[j]);
+                        tmp = vector_norm(&vec);
+                        if(tmp < distance2) distance2 = tmp;
+                    }
+                }
+                else distance2 = exact_distances[i];
+                if(distance1 != distance2) {
+                    printf("Per-query k query %d: %lld %lld\n", i, distance1, distance2);
+                    err_num++;
+                }
+            }
+            printf("Total per-query k err: %d\n", err_num);
+            delete [] k_input;
+            delete [] exact_distances;
+        }
+
+        if(search_type != 1) {
+            // Exact lookups in a query binary: inserted points, the same points after erasing half of them, and random points
+            int64_t lookup_num = min((int64_t)1024, total_insert_size), erase_num = lookup_num / 2;
+            vectorT *lookup_vecs = new vectorT[lookup_num * 2];
+            int64_t *expected = new int64_t[lookup_num * 2];
+            parfor_wrap(0, lookup_num * 2, [&](size_t i) {
+                if(i < lookup_num) lookup_vecs[i] = vec_dataset[i];
+                else {
+#if NR_DIMENSION == 2
+                    lookup_vecs[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    lookup_vecs[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#elif NR_DIMENSION == 3
+                    lookup_vecs[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    lookup_vecs[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    lookup_vecs[i].z = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#else
+                    for(int j = 0; j < NR_DIMENSION; j++) lookup_vecs[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#endif
+                }
+            });
+            int err_num = 0;
+            for(int round = 0; round < 2; round++) {
+                if(round == 1) {
+                    cpu_coverage_timer->start();
+                    dpu_binary_switch_to(dpu_binary::insert_binary);
+                    cpu_coverage_timer->end();
+                    zd_tree.length = erase_num;
+                    parfor_wrap(0, erase_num, [&](size_t i) {zd_tree.vector_input[i] = vec_dataset[i];});
+                    zd_tree.erase(zd_tree.vector_input, debug_print);
+                    cpu_coverage_timer->start();
+                    dpu_binary_switch_to(dpu_binary::knn_binary);
+                    cpu_coverage_timer->end();
+                }
+                // Stored copies left of each point
+                parfor_wrap(0, lookup_num * 2, [&](size_t i) {
+                    expected[i] = 0;
+                    for(int64_t j = 0; j < total_insert_size; j++) {
+                        if(vector_equal(&lookup_vecs[i], &vec_dataset[j])) expected[i]++;
+                    }
+                    if(round == 1) {
+                        for(int64_t j = 0; j < erase_num; j++) {
+                            if(vector_equal(&lookup_vecs[i], &vec_dataset[j])) expected[i]--;
+                        }
+                    }
+                });
+                zd_tree.length = lookup_num * 2;
+                zd_tree.contains(lookup_vecs);
+                for(int64_t i = 0; i < lookup_num * 2; i++) {
+                    if(zd_tree.i64_io[i] != (expected[i] > 0 ? 1 : 0)) {
+                        printf("Lookup %lld, round %d: %lld %lld\n", i, round, zd_tree.i64_io[i], expected[i]);
+                        err_num++;
+                    }
+#ifdef POINT_PAYLOAD_ON
+                    else if(expected[i] > 0) {
+                        PAYLOAD_TYPE id = zd_tree.payload_output[i];
+                        if(id >= (PAYLOAD_TYPE)total_insert_size || !vector_equal(&vec_dataset[id], &lookup_vecs[i])) {
+                            printf("Lookup %lld, round %d: wrong payload %llu\n", i, round, (unsigned long long)id);
+                            err_num++;
+                        }
+                    }
+#endif
+                }
+            }
+            printf("Total lookup err: %d\n", err_num);
+
+            if(search_type == 2) {
+                // Counts of large boxes, far above the former shortcut cap, after a mix of inserts and deletes
+                int64_t update_num = min((int64_t)insert_batch_size, total_insert_size);
+                int64_t erase_old_num = min(update_num / 2, total_insert_size - erase_num);
+                vectorT *new_vecs = new vectorT[update_num];
+                parfor_wrap(0, update_num, [&](size_t i) {
+#if NR_DIMENSION == 2
+                    new_vecs[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    new_vecs[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#elif NR_DIMENSION == 3
+                    new_vecs[i].x = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    new_vecs[i].y = abs(rn_gen::parallel_rand()) & COORD_MAX;
+                    new_vecs[i].z = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#else
+                    for(int j = 0; j < NR_DIMENSION; j++) new_vecs[i].x[j] = abs(rn_gen::parallel_rand()) & COORD_MAX;
+#endif
+                });
+                cpu_coverage_timer->start();
+                dpu_binary_switch_to(dpu_binary::insert_binary);
+                cpu_coverage_timer->end();
+                zd_tree.length = update_num;
+                parfor_wrap(0, update_num, [&](size_t i) {
+                    zd_tree.vector_input[i] = new_vecs[i];
+#ifdef POINT_PAYLOAD_ON
+                    zd_tree.payload_input[i] = total_insert_size + i;
+#endif
+                });
+                zd_tree.insert(zd_tree.vector_input, debug_print);
+                // Erase the first half of the new points and as many of the old ones
+                zd_tree.length = update_num / 2 + erase_old_num;
+                parfor_wrap(0, zd_tree.length, [&](size_t i) {
+                    zd_tree.vector_input[i] = (i < update_num / 2 ? new_vecs[i] : vec_dataset[erase_num + i - update_num / 2]);
+                });
+                zd_tree.erase(zd_tree.vector_input, debug_print);
+                cpu_coverage_timer->start();
+                dpu_binary_switch_to(dpu_binary::box_count_binary);
+                cpu_coverage_timer->end();
+
+                // Each box covers half of every dimension, so 2^-NR_DIMENSION of the space
+                int large_box_num = 16;
+                int64_t *large_counts = new int64_t[large_box_num];
+                zd_tree.length = large_box_num;
+                parfor_wrap(0, large_box_num, [&](size_t i) {
+                    for(int d = 0; d < NR_DIMENSION; d++) {
+                        VECTOR_COORD(&zd_tree.vector_input[i << 1], d) = VECTOR_COORD(&lookup_vecs[lookup_num + i % lookup_num], d) / 2;
+                        VECTOR_COORD(&zd_tree.vector_input[(i << 1) + 1], d) = VECTOR_COORD(&zd_tree.vector_input[i << 1], d) + COORD_MAX / 2;
+                    }
+                    vectorT *box_min = &zd_tree.vector_input[i << 1], *box_max = &zd_tree.vector_input[(i << 1) + 1];
+                    large_counts[i] = 0;
+                    for(int64_t j = erase_num + erase_old_num; j < total_insert_size; j++) {
+                        if(vector_in_box(&vec_dataset[j], box_min, box_max)) large_counts[i]++;
+                    }
+                    for(int64_t j = update_num / 2; j < update_num; j++) {
+                        if(vector_in_box(&new_vecs[j], box_min, box_max)) large_counts[i]++;
+                    }
+                });
+                zd_tree.box_range(true, expected_box_size);
+                err_num = 0;
+                for(int i = 0; i < large_box_num; i++) {
+                    if(large_counts[i] != zd_tree.i64_io[i]) {
+                        err_num++;
+                        printf("Large box %d: %lld %lld\n", i, large_counts[i], zd_tree.i64_io[i]);
+                    }
+                }
+                printf("Total large box err num: %d\n", err_num);
+                delete [] large_counts;
+                delete [] new_vecs;
+            }
+            delete [] lookup_vecs;
+            delete [] expected;
         }
     }
     zd_tree.reset_epoch_num();
@@ -557,8 +1184,8 @@ int main(int argc, char *argv[]) {
     host_end();
     if(need_to_search) {
         if(search_type == 2 || search_type == 3 || search_type == 1) delete [] vecs;
-        if(search_type == 2 || search_type == 3 || search_type == 4) delete [] vec_dataset;
     }
+    if(keep_dataset) delete [] vec_dataset;
     if(needs_pipeline) for(int i = 1; i < maxTopLevelThreads; i++) {
         if(zd_forest[i] != nullptr) delete zd_forest[i];
     }
@@ -12,11 +12,16 @@
 #include "geometry.hpp"
 #include "utils.hpp"
 #include "heap.hpp"
+#include "top_cache.hpp"
+#include "border_index.hpp"
 
 #if LX_NORM == 2
 #include <cmath>
 #endif
 
+/* Reply classes of kNN batches with per-query k, enough for k up to MAX_KNN_SIZE, see pim_zd_tree::knn_k_class */
+#define KNN_K_CLASS_NUM (8)
+
 using namespace std;
 
 class pim_zd_tree {
@@ -48,20 +53,34 @@ private:
 public:
     /* Main Operation Functions */
     static atomic<int64_t> nr_points;  // Total number of points stored in the tree
+    static atomic<int64_t> box_query_num, box_dpu_task_num;  // Boxes queried, and the DPU tasks they were split into
+    static atomic<int64_t> knn_query_num, knn_dpu_task_num;  // kNN queries, and their DPU tasks over both rounds
 
     int64_t length;  // Batch size
 
     vectorT *vector_input;
     vectorT *vector_output;
     int64_t *i64_io;
+#ifdef POINT_PAYLOAD_ON
+    PAYLOAD_TYPE *payload_input;  // Payload of vector_input[i], for inserts
+    PAYLOAD_TYPE *payload_output;  // Payload of vector_output[i]
+#endif
 
     int8_t key_to_dpu_id_mode;
     uint64_t *partition_borders;
+    partition_border_index border_index;  // Search layout of partition_borders, rebuilt by set_partition_borders
+
+    inline static host_top_cache top_cache;  // Shared by all instances, as they operate on the same DPUs
+    bool use_top_cache;  // Route inserts with the host replica instead of a search round
 
     pim_zd_tree() {
         this->vector_input = new vectorT[BATCH_SIZE];
         this->vector_output = new vectorT[BATCH_SIZE];
-        this->i64_io = new int64_t[BATCH_SIZE];
+        this->i64_io = new int64_t[(int64_t)BATCH_SIZE * KEY_WORDS];  // Also holds the sorted keys
+#ifdef POINT_PAYLOAD_ON
+        this->payload_input = new PAYLOAD_TYPE[BATCH_SIZE];
+        this->payload_output = new PAYLOAD_TYPE[BATCH_SIZE];
+#endif
         this->op_addrs = new pptr[BATCH_SIZE];
         this->op_taskpos = new int32_t[BATCH_SIZE];
         this->target_dpu = new int[BATCH_SIZE];
@@ -69,685 +88,1897 @@ public:
         this->epoch_num = 0;
         this->key_to_dpu_id_mode = 0;
         this->partition_borders = new uint64_t[nr_of_dpus + 1];
+        this->use_top_cache = true;
+        if(top_cache.node_num == 0) top_cache.reset();
     }
 
     ~pim_zd_tree() {
         delete [] this->vector_input;
         delete [] this->vector_output;
         delete [] this->i64_io;
+#ifdef POINT_PAYLOAD_ON
+        delete [] this->payload_input;
+        delete [] this->payload_output;
+#endif
         delete [] this->op_addrs;
         delete [] this->op_taskpos;
         delete [] this->target_dpu;
         delete [] this->partition_borders;
     }
 
+    /* Switch to the borders (nr_of_dpus + 1 of them) and rebuild their search layout. Modes 1 and 2 need this after any change. */
+    void set_partition_borders(int8_t mode, const uint64_t *borders) {
+        if(borders != this->partition_borders) memcpy(this->partition_borders, borders, sizeof(uint64_t) * (nr_of_dpus + 1));
+        this->key_to_dpu_id_mode = mode;
+        this->border_index.build(this->partition_borders, nr_of_dpus);
+    }
+
+    /* The owner DPU of a key prefix (key_prefix of a key) */
     uint16_t key_to_dpu_id(uint64_t key) {
         if(key_to_dpu_id_mode == 0) return (uint16_t)(key / this->range_size_each_dpu);
         else if(key_to_dpu_id_mode == 1) {
-            // Binary search
-            uint16_t ll = 0, rr = nr_of_dpus, mid;
-            while(ll + 16 < rr) {
-                mid = (ll + rr) / 2;
-                if(key < this->partition_borders[mid]) {
-                    rr = mid;
-                }
-                else if(key >= this->partition_borders[mid + 1]) {
-                    ll = mid + 1;
-                }
-                else {
-                    return mid;
-                }
-            }
-            for(mid = ll; mid < nr_of_dpus; mid++) {
-                if(key >= this->partition_borders[mid] && key < this->partition_borders[mid + 1]) {
-                    break;
-                }
-            }
-            return mid;
+            // B-tree layout search
+            return this->border_index.search(key);
         }
         else if(key_to_dpu_id_mode == 2) {
-            // Interpolation search
+            // Interpolation guess, then B-tree layout search if the guess misses
             uint16_t ret = (uint16_t)(key / this->range_size_each_dpu);
-            while(this->partition_borders[ret + 1] <= key && ret < nr_of_dpus - 1) {
-                ret++;
+            if(ret < nr_of_dpus && this->partition_borders[ret] <= key && (key < this->partition_borders[ret + 1] || ret == nr_of_dpus - 1)) {
+                return ret;
             }
-            while(this->partition_borders[ret] > key && ret > 0) {
-                ret--;
-            }
-            return ret;
+            return this->border_index.search(key);
         }
         else return -1;
     }
+
+#ifdef HILBERT_KEY_ON
+    /*
+        Call f on the DPUs whose key ranges meet the keys of the box, in increasing order.
+        Cells are split in curve order until their key interval falls on a single DPU or they lie inside the box.
+    */
+    template<typename F>
+    void hilbert_box_dpus(vectorT *box_min, vectorT *box_max, F f) {
+        struct hilbert_cell {
+            uint64_t key;
+            uint64_t cell_min[NR_DIMENSION];
+            uint32_t e;
+            int d;
+            int level;
+            bool inside;
+        };
+        uint64_t b_min[NR_DIMENSION], b_max[NR_DIMENSION], child_min[NR_DIMENSION];
+        int last = -1, lo, hi, relation, i, j;
+        std::vector<hilbert_cell> stack;
+        hilbert_coord_bits(box_min, b_min);
+        hilbert_coord_bits(box_max, b_max);
+        stack.push_back(hilbert_cell{});
+        while(!stack.empty()) {
+            hilbert_cell cell = stack.back();
+            stack.pop_back();
+            lo = key_to_dpu_id(cell.key);
+            hi = key_to_dpu_id(fill_tail_bits(cell.key, cell.level * NR_DIMENSION));
+            if(lo == hi || cell.inside || cell.level == HILBERT_LEVELS) {
+                for(j = std::max(lo, last + 1); j <= hi; j++) f(j);
+                last = std::max(last, hi);
+                continue;
+            }
+            // Push the children backwards, so that they are split in curve order
+            for(i = HILBERT_DIGIT_MASK; i >= 0; i--) {
+                relation = hilbert_child_cell(cell.cell_min, hilbert_child_label(i, cell.e, cell.d), cell.level + 1, b_min, b_max, child_min);
+                if(relation == 0) continue;
+                hilbert_cell child;
+                child.key = cell.key | (((uint64_t)i) << (64 - (cell.level + 1) * NR_DIMENSION));
+                memcpy(child.cell_min, child_min, sizeof(child_min));
+                child.e = cell.e;
+                child.d = cell.d;
+                hilbert_next_state(i, &child.e, &child.d);
+                child.level = cell.level + 1;
+                child.inside = (relation == 2);
+                stack.push_back(child);
+            }
+        }
+    }
+#endif
     void reset_epoch_num() { this->epoch_num = 0; }
     void print_current_epoch() { printf("Current epoch: %llu\n", this->epoch_num); }
 
 
-/* Interfaces for database operations */
+/* Operation stages, shared by the single-type operations and the mixed batches */
 
-public:
-    void init_range() {
-        print_current_epoch();
-        cpu_coverage_timer->start();
-        printf("\n********** INIT RANGES **********\n");
-#ifdef DPU_INIT_ON
-        auto io = alloc_io_manager();
-        ASSERT(io == io_managers[0]);
-        io->init();
-        IO_Task_Batch* batch = io->alloc<dpu_init_range_task, empty_task_reply>(direct);
-        parfor_wrap(0, nr_of_dpus, [&](size_t i) {
-            auto it = (dpu_init_range_task*)batch->push_task_zero_copy(i, -1, false);
-            it->range_start = this->partition_borders[i];
-            it->range_end = this->partition_borders[i + 1];
+private:
+    /* Sort the points by key. key_seq receives the sorted keys; the returned sequence maps them back to vec_input. */
+    parlay::sequence<int32_t> sort_by_key(int64_t n, vectorT *vec_input, KEY_TYPE *key_seq) {
+        auto key_wrap_seq = parlay::tabulate(n, [&](int32_t i) {
+            return std::make_pair(coord_to_key(&(vec_input[i])), i);
         });
-        io->finish_task_batch();
-        ASSERT(io->exec());
-        io->reset();
+#ifdef KEY_128_BIT_ON
+        parlay::sort_inplace(key_wrap_seq, [&](const std::pair<key128, int32_t> &a, const std::pair<key128, int32_t> &b) {
+            return key_less(a.first, b.first);
+        });
+#else
+        parlay::integer_sort_inplace(key_wrap_seq, [&](std::pair<uint64_t, int32_t> kw) {return kw.first;});
 #endif
-        printf("\n****** INIT RANGES Finished ******\n");
-        cpu_coverage_timer->end();
+        return parlay::tabulate(n, [&](int32_t i) {
+            key_seq[i] = key_wrap_seq[i].first;
+            return key_wrap_seq[i].second;
+        });
     }
 
-    void insert(vectorT *vec_input = nullptr, bool debug_print = false) {
-#ifdef INSERT_NODE_ON
-        print_current_epoch();
-        cpu_coverage_timer->start();
-        time_start("insert");
+    /* Search for the deepest existing node of each sorted key */
+    IO_Task_Batch* search_taskgen(IO_Manager *io, int64_t n, KEY_TYPE *key_seq, int *tdpu, int32_t *tpos) {
+        parfor_wrap(0, n, [&](size_t i) {
+            tdpu[i] = key_to_dpu_id(key_prefix(key_seq[i]));
+        });
+        IO_Task_Batch *batch = io->alloc<Single_search_task, Single_search_reply>(direct);
+        batch->push_task_sorted(
+            n, nr_of_dpus,
+            [&](size_t i) { return (Single_search_task){.key = key_seq[i]}; },
+            [&](size_t i) { return tdpu[i]; },
+            parlay::make_slice(tpos, tpos + n)
+        );
+        io->finish_task_batch();
+        return batch;
+    }
 
-        time_start("init");
-        if(vec_input == nullptr) vec_input = this->vector_input;
-        IO_Manager *io;
-        IO_Task_Batch *single_search_batch, *single_insert_batch;
-        auto key_wrap_seq = parlay::tabulate(this->length, [&](int32_t i) {
-            return std::make_pair(coord_to_key(&(vec_input[i])), i);
+    void search_result(IO_Task_Batch *batch, int64_t n, int *tdpu, int32_t *tpos, pptr *addrs) {
+        parfor_wrap(0, n, [&](size_t i) {
+            Single_search_reply *rep = (Single_search_reply*)batch->ith(tdpu[i], tpos[i]);
+            addrs[i] = rep->addr;
         });
-        parlay::integer_sort_inplace(key_wrap_seq, [&](std::pair<uint64_t, int32_t> kw) {return kw.first;});
-        uint64_t *key_seq = (uint64_t*)this->i64_io;
-        auto key_idx_seq = parlay::tabulate(this->length, [&](int32_t i) {
-            key_seq[i] = key_wrap_seq[i].first;
-            return key_wrap_seq[i].second;
+    }
+
+    /* Send each point to the DPU owning its key */
+    IO_Task_Batch* point_lookup_taskgen(IO_Manager *io, int64_t n, vectorT *vec_input, int *tdpu, int32_t *tpos) {
+        parfor_wrap(0, n, [&](size_t i) {
+            tdpu[i] = key_to_dpu_id(key_prefix(coord_to_key(&(vec_input[i]))));
         });
-        time_end("init");
+        IO_Task_Batch *batch = io->alloc<Point_lookup_task, Point_lookup_reply>(direct);
+        batch->push_task_from_array_by_isort<false>(
+            n,
+            [&](size_t i) { return (Point_lookup_task){.v = vec_input[i]}; },
+            parlay::make_slice(tdpu, tdpu + n),
+            parlay::make_slice(tpos, tpos + n)
+        );
+        io->finish_task_batch();
+        return batch;
+    }
 
-        time_nested("search", [&]() {
-            time_nested("taskgen", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    this->target_dpu[i] = key_to_dpu_id(key_seq[i]);
-                });
-                io = alloc_io_manager();
-                io->init();
-                single_search_batch = io->alloc<Single_search_task, Single_search_reply>(direct);
-                single_search_batch->push_task_sorted(
-                    this->length, nr_of_dpus,
-                    [&](size_t i) { return (Single_search_task){.key = key_seq[i]}; },
-                    [&](size_t i) { return this->target_dpu[i]; },
-                    parlay::make_slice(this->op_taskpos, this->op_taskpos + this->length)
-                );
-                io->finish_task_batch();
-            });
-            time_nested("exec", [&](){ASSERT(io->exec());});
-            time_nested("get result", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    Single_search_reply *rep = (Single_search_reply*)single_search_batch->ith(this->target_dpu[i], this->op_taskpos[i]);
-                    this->op_addrs[i] = rep->addr;
-                });
-                io->reset();
-            });
+    void point_lookup_result(IO_Task_Batch *batch, int64_t n, int *tdpu, int32_t *tpos, int64_t *i64_out
+                             PAYLOAD_ARG(PAYLOAD_TYPE *payload_out)) {
+        parfor_wrap(0, n, [&](size_t i) {
+            Point_lookup_reply *rep = (Point_lookup_reply*)batch->ith(tdpu[i], tpos[i]);
+            i64_out[i] = rep->found;
+#ifdef POINT_PAYLOAD_ON
+            payload_out[i] = rep->payload[0];
+#endif
         });
+    }
 
-        time_nested("insert_vector", [&]() {
-            time_nested("taskgen", [&]() {
-                io = alloc_io_manager();
-                io->init();
-                single_insert_batch = io->alloc_task_batch(direct, variable_length, fixed_length, SINGLE_INSERT_TSK, -1, 0);
+#ifdef INSERT_NODE_ON
+    /* One insert task per group of sorted points sharing a target node */
+    IO_Task_Batch* insert_taskgen(IO_Manager *io, int64_t n, pptr *addrs, int32_t *key_idx_seq, vectorT *vec_input
+                                  PAYLOAD_ARG(PAYLOAD_TYPE *payload_input)) {
+        IO_Task_Batch *batch = io->alloc_task_batch(direct, variable_length, fixed_length, SINGLE_INSERT_TSK, -1, 0);
 
-                auto pptr_diff_seq = parlay::delayed_tabulate(this->length, [&](size_t i)->bool {
-                    return (i == 0) || !equal_pptr_strong(this->op_addrs[i], this->op_addrs[i - 1]);
-                });
-                int pptr_diff_num = parlay::count(pptr_diff_seq, true);
-                if(pptr_diff_num >= this->length / 5) {
-                    parfor_wrap(0, this->length, [&](int i) {
-                        if(pptr_diff_seq[i]) {
-                            int len = 1, j;
-                            for(j = i + 1; j < this->length; j++, len++) {
-                                if(!equal_pptr_strong(this->op_addrs[j], this->op_addrs[j - 1])) {
-                                    break;
-                                }
-                            }
-                            pptr addr = this->op_addrs[i];
-                            Single_insert_task *tsk = (Single_insert_task*)(single_insert_batch->push_task_zero_copy(
-                                addr.id,
-                                SINGLE_INSERT_TSK_SIZE(len),
-                                true
-                            ));
-                            tsk->addr = addr;
-                            tsk->len = len;
-                            for(j = 0; j < len; j++, i++) {
-                                tsk->v[j] = vec_input[key_idx_seq[i]];
-                            }
+        auto pptr_diff_seq = parlay::delayed_tabulate(n, [&](size_t i)->bool {
+            return (i == 0) || !equal_pptr_strong(addrs[i], addrs[i - 1]);
+        });
+        int pptr_diff_num = parlay::count(pptr_diff_seq, true);
+        if(pptr_diff_num >= n / 5) {
+            parfor_wrap(0, n, [&](int i) {
+                if(pptr_diff_seq[i]) {
+                    int len = 1, j;
+                    for(j = i + 1; j < n; j++, len++) {
+                        if(!equal_pptr_strong(addrs[j], addrs[j - 1])) {
+                            break;
                         }
-                    });
+                    }
+                    pptr addr = addrs[i];
+                    Single_insert_task *tsk = (Single_insert_task*)(batch->push_task_zero_copy(
+                        addr.id,
+                        SINGLE_INSERT_TSK_SIZE(len),
+                        true
+                    ));
+                    tsk->addr = addr;
+                    tsk->len = len;
+#ifdef POINT_PAYLOAD_ON
+                    PAYLOAD_TYPE *tsk_payloads = (PAYLOAD_TYPE*)(tsk->v + len);
+                    for(j = 0; j < len; j++) tsk_payloads[j] = payload_input[key_idx_seq[i + j]];
+#endif
+                    for(j = 0; j < len; j++, i++) {
+                        tsk->v[j] = vec_input[key_idx_seq[i]];
+                    }
                 }
-                else {
-                    auto pptr_diff_idx = parlay::pack_index<uint32_t>(pptr_diff_seq);
-                    parfor_wrap(0, pptr_diff_num, [&](int i) {
-                        int len = (
-                            (i == pptr_diff_num - 1) ?
-                            (this->length - pptr_diff_idx[i]) :
-                            (pptr_diff_idx[i + 1] - pptr_diff_idx[i])
-                        );
-                        pptr addr = this->op_addrs[pptr_diff_idx[i]];
-                        Single_insert_task *tsk = (Single_insert_task*)(single_insert_batch->push_task_zero_copy(
-                            addr.id,
-                            SINGLE_INSERT_TSK_SIZE(len),
-                            true
-                        ));
-                        tsk->addr = addr;
-                        tsk->len = len;
-                        for(int j = 0, k = pptr_diff_idx[i]; j < len; j++, k++) {
-                            tsk->v[j] = vec_input[key_idx_seq[k]];
-                        }
-                    });
+            });
+        }
+        else {
+            auto pptr_diff_idx = parlay::pack_index<uint32_t>(pptr_diff_seq);
+            parfor_wrap(0, pptr_diff_num, [&](int i) {
+                int len = (
+                    (i == pptr_diff_num - 1) ?
+                    (n - pptr_diff_idx[i]) :
+                    (pptr_diff_idx[i + 1] - pptr_diff_idx[i])
+                );
+                pptr addr = addrs[pptr_diff_idx[i]];
+                Single_insert_task *tsk = (Single_insert_task*)(batch->push_task_zero_copy(
+                    addr.id,
+                    SINGLE_INSERT_TSK_SIZE(len),
+                    true
+                ));
+                tsk->addr = addr;
+                tsk->len = len;
+#ifdef POINT_PAYLOAD_ON
+                PAYLOAD_TYPE *tsk_payloads = (PAYLOAD_TYPE*)(tsk->v + len);
+#endif
+                for(int j = 0, k = pptr_diff_idx[i]; j < len; j++, k++) {
+                    tsk->v[j] = vec_input[key_idx_seq[k]];
+#ifdef POINT_PAYLOAD_ON
+                    tsk_payloads[j] = payload_input[key_idx_seq[k]];
+#endif
                 }
-
-                io->finish_task_batch();
             });
-            time_nested("exec", [&](){ASSERT(io->exec());});
-            time_nested("get result", [&]() {io->reset();});
-        });
+        }
 
-        // nr_points += this->length;
-        std::atomic_fetch_add(&(this->nr_points), this->length);
+        io->finish_task_batch();
+        return batch;
+    }
 
-        time_end("insert");
-        cpu_coverage_timer->end();
-        this->epoch_num++;
+    /*
+        Route the sorted keys through the host replica, and send one insert task per cached node and child slot.
+        cache_slot receives the replica node index times DB_SIZE plus the slot of each task, and the task count is returned.
+    */
+    IO_Task_Batch* insert_from_cache_taskgen(IO_Manager *io, int64_t n, KEY_TYPE *key_seq, int32_t *key_idx_seq, vectorT *vec_input
+                                             PAYLOAD_ARG(PAYLOAD_TYPE *payload_input), int *tdpu, int32_t *tpos, parlay::sequence<int64_t> &cache_slot, int &task_num) {
+        IO_Task_Batch *batch = io->alloc_task_batch(direct, variable_length, fixed_length, SINGLE_INSERT_FROM_TSK, -1, sizeof(Single_insert_from_reply));
+        parlay::sequence<pptr> route_addrs(n);
+        auto route_seq = parlay::tabulate(n, [&](int32_t i) {
+            int32_t node_idx;
+            route_addrs[i] = top_cache.route(key_seq[i], key_to_dpu_id(key_prefix(key_seq[i])), node_idx);
+            return std::make_pair((int64_t)node_idx * DB_SIZE + route_addrs[i].info, i);
+        });
+        // Stable, so the keys of a task stay sorted
+        parlay::integer_sort_inplace(route_seq, [&](std::pair<int64_t, int32_t> rw) {return (uint64_t)rw.first;});
+        auto task_start_idx = parlay::pack_index<uint32_t>(parlay::delayed_tabulate(n, [&](size_t i)->bool {
+            return (i == 0) || route_seq[i].first != route_seq[i - 1].first;
+        }));
+        task_num = task_start_idx.size();
+        cache_slot = parlay::tabulate(task_num, [&](size_t i) {return route_seq[task_start_idx[i]].first;});
+        parfor_wrap(0, task_num, [&](int i) {
+            int k = task_start_idx[i];
+            int len = (i == task_num - 1 ? n : task_start_idx[i + 1]) - k;
+            pptr addr = route_addrs[route_seq[k].second];
+            Single_insert_from_task *tsk = (Single_insert_from_task*)(batch->push_task_zero_copy(
+                addr.id,
+                SINGLE_INSERT_FROM_TSK_SIZE(len),
+                true,
+                tpos + i
+            ));
+            tdpu[i] = addr.id;
+            tsk->addr = addr;
+            tsk->len = len;
+#ifdef POINT_PAYLOAD_ON
+            PAYLOAD_TYPE *tsk_payloads = (PAYLOAD_TYPE*)(tsk->v + len);
 #endif
+            for(int j = 0; j < len; j++, k++) {
+                tsk->v[j] = vec_input[key_idx_seq[route_seq[k].second]];
+#ifdef POINT_PAYLOAD_ON
+                tsk_payloads[j] = payload_input[key_idx_seq[route_seq[k].second]];
+#endif
+            }
+        });
+        io->finish_task_batch();
+        return batch;
     }
 
-    /* 
-        Box range queries. Return the number of existing points in the queried box, or fetch them.
-        count_or_fetch = true, return the counted numbers; false, fetch the points.
-        Set pim_zd_tree::length to be the number of boxes.
-        Put a vector pair in pim_zd_tree::vector_input as box boundaries.
-    */
-    void box_range(bool count_or_fetch = true, int expected_length = 100, vectorT *vec_input = nullptr) {
-#if (defined BOX_RANGE_FETCH_ON) || (defined BOX_RANGE_COUNT_ON)
-        print_current_epoch();
-        cpu_coverage_timer->start();
-        time_start("box");
+    /* Grow the replica with the B nodes reported in the slots of the tasks */
+    void insert_from_cache_result(IO_Task_Batch *batch, int task_num, int *tdpu, int32_t *tpos, parlay::sequence<int64_t> &cache_slot) {
+        parfor_wrap(0, task_num, [&](size_t i) {
+            Single_insert_from_reply *rep = (Single_insert_from_reply*)batch->ith(tdpu[i], tpos[i]);
+            if(valid_pptr(rep->addr)) {
+                top_cache.add_child(cache_slot[i] / DB_SIZE, cache_slot[i] % DB_SIZE, rep->addr, rep->key, rep->height);
+            }
+        });
+    }
+#endif
 
-        if(vec_input == nullptr) vec_input = this->vector_input;
-        parlay::sequence<int> box_dpu_num;
-        int total_query_num;
-        IO_Manager *io;
-        IO_Task_Batch *box_batch;
-        
-        time_nested("taskgen", [&]() {
-            parlay::sequence<box_dpu_id> box_idx(this->length);
-            box_dpu_num = parlay::tabulate(this->length, [&](size_t i) {
-                box_boundary_swap(vec_input[i << 1], vec_input[(i << 1) + 1]);
-                uint64_t key1 = coord_to_key(&(vec_input[i << 1]));
-                uint64_t key2 = coord_to_key(&(vec_input[(i << 1) + 1]));
-                box_idx[i].set_litmin_bigmax(
-                    key_to_dpu_id(key1),
-                    key_to_dpu_id(key2)
+#if (defined BOX_RANGE_FETCH_ON) || (defined BOX_RANGE_COUNT_ON)
+    /*
+        Split each box into the DPUs it covers, writing the target DPUs to tdpu and returning the box of each task.
+        box_dpu_num receives the prefix sums of the task counts, and the total is returned through total_query_num.
+    */
+    parlay::sequence<int64_t> box_route(int64_t n, vectorT *vec_input, int *tdpu, parlay::sequence<int> &box_dpu_num, int &total_query_num) {
+        parlay::sequence<box_dpu_id> box_idx(n);
+        box_dpu_num = parlay::tabulate(n, [&](size_t i) {
+            box_boundary_swap(vec_input[i << 1], vec_input[(i << 1) + 1]);
+#ifdef HILBERT_KEY_ON
+            int num = 0;
+            hilbert_box_dpus(&(vec_input[i << 1]), &(vec_input[(i << 1) + 1]), [&](int j) { num++; });
+            return num;
+#else
+            uint64_t key1 = key_prefix(coord_to_key(&(vec_input[i << 1])));
+            uint64_t key2 = key_prefix(coord_to_key(&(vec_input[(i << 1) + 1])));
+            box_idx[i].set_litmin_bigmax(
+                key_to_dpu_id(key1),
+                key_to_dpu_id(key2)
+            );
+            if(box_idx[i].same_dpu()) return (int)1;
+            else {
+                auto box_split_res = box_split(key1, key2);
+                box_idx[i].set_litmax_bigmin(
+                    key_to_dpu_id(box_split_res.first),
+                    key_to_dpu_id(box_split_res.second)
                 );
-                if(box_idx[i].same_dpu()) return (int)1;
-                else {
-                    auto box_split_res = box_split(key1, key2);
-                    box_idx[i].set_litmax_bigmin(
-                        key_to_dpu_id(box_split_res.first),
-                        key_to_dpu_id(box_split_res.second)
-                    );
-                    return box_idx[i].size();
-                }
-            });
-            total_query_num = parlay::scan_inplace(box_dpu_num);
+                return box_idx[i].size();
+            }
+#endif
+        });
+        total_query_num = parlay::scan_inplace(box_dpu_num);
 
-            io = alloc_io_manager();
-            io->init();
-            if(count_or_fetch) {
-                box_batch = io->alloc<Box_count_task, Box_count_reply>(direct);
+        auto query_seq = parlay::sequence<int64_t>(total_query_num);
+        parfor_wrap(0, n, [&](size_t i) {
+            int start_idx = box_dpu_num[i];
+#ifdef HILBERT_KEY_ON
+            hilbert_box_dpus(&(vec_input[i << 1]), &(vec_input[(i << 1) + 1]), [&](int j) {
+                tdpu[start_idx] = j;
+                query_seq[start_idx] = i;
+                start_idx++;
+            });
+#else
+            int end_idx = (i == n - 1 ? total_query_num : box_dpu_num[i + 1]);
+            if(end_idx - start_idx <= 1) {
+                tdpu[start_idx] = box_idx[i].litmin;
+                query_seq[start_idx] = i;
             } else {
-                box_batch = io->alloc_task_batch(direct, fixed_length, variable_length, BOX_FETCH_TSK, 
-                                                 sizeof(Box_fetch_task), BOX_FETCH_REP_SIZE(expected_length));
-            }
-            auto tsk_seq = parlay::sequence<std::pair<vectorT, vectorT>>(total_query_num);
-
-            parfor_wrap(0, this->length, [&](size_t i) {
-                int start_idx = box_dpu_num[i];
-                int end_idx = (i == this->length - 1 ? total_query_num : box_dpu_num[i + 1]);
-                auto tsk = std::make_pair(vec_input[i << 1], vec_input[(i << 1) + 1]);
-                if(end_idx - start_idx <= 1) {
-                    this->target_dpu[start_idx] = box_idx[i].litmin;
-                    tsk_seq[start_idx] = tsk;
-                } else {
-                    int j;
-                    if(box_idx[i].litmax < box_idx[i].bigmin) {
-                        for(j = box_idx[i].litmin; j <= box_idx[i].litmax; j++, start_idx++) {
-                            this->target_dpu[start_idx] = j;
-                            tsk_seq[start_idx] = tsk;
-                        }
-                        for(j = box_idx[i].bigmin; j <= box_idx[i].bigmax; j++, start_idx++) {
-                            this->target_dpu[start_idx] = j;
-                            tsk_seq[start_idx] = tsk;
-                        }
+                int j;
+                if(box_idx[i].litmax < box_idx[i].bigmin) {
+                    for(j = box_idx[i].litmin; j <= box_idx[i].litmax; j++, start_idx++) {
+                        tdpu[start_idx] = j;
+                        query_seq[start_idx] = i;
                     }
-                    else {
-                        for(j = box_idx[i].litmin; j <= box_idx[i].bigmax; j++, start_idx++) {
-                            this->target_dpu[start_idx] = j;
-                            tsk_seq[start_idx] = tsk;
-                        }
+                    for(j = box_idx[i].bigmin; j <= box_idx[i].bigmax; j++, start_idx++) {
+                        tdpu[start_idx] = j;
+                        query_seq[start_idx] = i;
                     }
                 }
-            });
-            if(count_or_fetch) {
-                box_batch->push_task_from_array_by_isort<false>(
-                    total_query_num,
-                    [&](size_t i) {
-                        Box_count_task tsk;
-                        tsk.vec_min = tsk_seq[i].first;
-                        tsk.vec_max = tsk_seq[i].second;
-                        return tsk;
-                    },
-                    parlay::make_slice(this->target_dpu, this->target_dpu + total_query_num),
-                    parlay::make_slice(this->op_taskpos, this->op_taskpos + total_query_num)
-                );
-            } else {
-                box_batch->push_task_from_array_by_isort<false>(
-                    total_query_num,
-                    [&](size_t i) {
-                        Box_fetch_task tsk;
-                        tsk.vec_min = tsk_seq[i].first;
-                        tsk.vec_max = tsk_seq[i].second;
-                        return tsk;
-                    },
-                    parlay::make_slice(this->target_dpu, this->target_dpu + total_query_num),
-                    parlay::make_slice(this->op_taskpos, this->op_taskpos + total_query_num)
-                );
-            }
-            io->finish_task_batch();
-        });
-
-        time_nested("exec", [&](){ASSERT(io->exec());});
-        time_nested("get result", [&]() {
-            if(count_or_fetch) {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    this->i64_io[i] = 0;
-                    int end_idx = (i == this->length - 1 ? total_query_num : box_dpu_num[i + 1]);
-                    for(int j = box_dpu_num[i]; j < end_idx; j++) {
-                        this->i64_io[i] += ((Box_count_reply*)box_batch->ith(this->target_dpu[j], this->op_taskpos[j]))->count;
+                else {
+                    for(j = box_idx[i].litmin; j <= box_idx[i].bigmax; j++, start_idx++) {
+                        tdpu[start_idx] = j;
+                        query_seq[start_idx] = i;
                     }
-                });
-            } else {
-                parlay::sequence<int> return_size_seq = parlay::tabulate(total_query_num, [&](size_t i) {
-                    return (int)(((Box_fetch_reply*)box_batch->ith(this->target_dpu[i], this->op_taskpos[i]))->len);
-                });
-                int total_return_num = parlay::scan_inplace(return_size_seq);
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    this->i64_io[i] = return_size_seq[box_dpu_num[i]];
-                });
-                this->i64_io[this->length] = total_return_num;
-                ASSERT(total_return_num <= BATCH_SIZE);
-                if(total_return_num > BATCH_SIZE) return;
-                parfor_wrap(0, total_query_num, [&](size_t i) {
-                    int len = (i == total_query_num - 1 ? total_return_num : return_size_seq[i + 1]) - return_size_seq[i];
-                    Box_fetch_reply *rep = (Box_fetch_reply*)box_batch->ith(this->target_dpu[i], this->op_taskpos[i]);
-                    memcpy(this->vector_output + return_size_seq[i], rep->v, S64(MULTIPLY_NR_DIMENSION(len)));
-                });
+                }
             }
-            io->reset();
+#endif
         });
+        return query_seq;
+    }
 
-        time_end("box");
-        cpu_coverage_timer->end();
-        this->epoch_num++;
-#endif
+    IO_Task_Batch* box_taskgen(IO_Manager *io, bool count_or_fetch, int expected_length, int64_t n, vectorT *vec_input,
+                               int *tdpu, int32_t *tpos, parlay::sequence<int> &box_dpu_num, int &total_query_num) {
+        IO_Task_Batch *batch;
+        auto query_seq = box_route(n, vec_input, tdpu, box_dpu_num, total_query_num);
+
+        if(count_or_fetch) {
+            batch = io->alloc<Box_count_task, Box_count_reply>(direct);
+            batch->push_task_from_array_by_isort<false>(
+                total_query_num,
+                [&](size_t i) {
+                    Box_count_task tsk;
+                    tsk.vec_min = vec_input[query_seq[i] << 1];
+                    tsk.vec_max = vec_input[(query_seq[i] << 1) + 1];
+                    return tsk;
+                },
+                parlay::make_slice(tdpu, tdpu + total_query_num),
+                parlay::make_slice(tpos, tpos + total_query_num)
+            );
+        } else {
+            batch = io->alloc_task_batch(direct, fixed_length, variable_length, BOX_FETCH_TSK, 
+                                         sizeof(Box_fetch_task), BOX_FETCH_REP_SIZE(expected_length));
+            batch->push_task_from_array_by_isort<false>(
+                total_query_num,
+                [&](size_t i) {
+                    Box_fetch_task tsk;
+                    tsk.vec_min = vec_input[query_seq[i] << 1];
+                    tsk.vec_max = vec_input[(query_seq[i] << 1) + 1];
+                    return tsk;
+                },
+                parlay::make_slice(tdpu, tdpu + total_query_num),
+                parlay::make_slice(tpos, tpos + total_query_num)
+            );
+        }
+        io->finish_task_batch();
+        return batch;
     }
 
-    void knn(int knn_k = 10, vectorT *vec_input = nullptr) {
-#ifdef KNN_ON
-        print_current_epoch();
-        cpu_coverage_timer->start();
-        time_start("knn");
+    /*
+        Route each ball (center vec_input[i], radius radius[i] in vector_norm units) to the DPUs covered by its bounding box.
+        The replies are those of box queries, so box_result collects them.
+    */
+    IO_Task_Batch* ball_taskgen(IO_Manager *io, bool count_or_fetch, int expected_length, int64_t n, vectorT *vec_input, int64_t *radius,
+                                int *tdpu, int32_t *tpos, parlay::sequence<int> &box_dpu_num, int &total_query_num) {
+        IO_Task_Batch *batch;
+        auto boxes = parlay::sequence<vectorT>(n << 1);
+        parfor_wrap(0, n, [&](size_t i) {
+            int64_t r = radius[i];
+#if LX_NORM == 2
+            r = (int64_t)sqrt(r);
+#endif
+            vector_ones(&(boxes[i << 1]), r);
+            boxes[i << 1] = vector_sub_zero_bounded(&(vec_input[i]), &(boxes[i << 1]));
+            vector_ones(&(boxes[(i << 1) + 1]), r);
+            boxes[(i << 1) + 1] = vector_add(&(vec_input[i]), &(boxes[(i << 1) + 1]));
+        });
+        auto query_seq = box_route(n, boxes.data(), tdpu, box_dpu_num, total_query_num);
 
-        if(vec_input == nullptr) vec_input = this->vector_input;
-        IO_Manager *io;
-        IO_Task_Batch *knn_batch;
+        if(count_or_fetch) {
+            batch = io->alloc<Ball_count_task, Box_count_reply>(direct);
+            batch->push_task_from_array_by_isort<false>(
+                total_query_num,
+                [&](size_t i) {
+                    Ball_count_task tsk;
+                    tsk.center = vec_input[query_seq[i]];
+                    tsk.radius = radius[query_seq[i]];
+                    return tsk;
+                },
+                parlay::make_slice(tdpu, tdpu + total_query_num),
+                parlay::make_slice(tpos, tpos + total_query_num)
+            );
+        } else {
+            batch = io->alloc_task_batch(direct, fixed_length, variable_length, BALL_FETCH_TSK,
+                                         sizeof(Ball_fetch_task), BOX_FETCH_REP_SIZE(expected_length));
+            batch->push_task_from_array_by_isort<false>(
+                total_query_num,
+                [&](size_t i) {
+                    Ball_fetch_task tsk;
+                    tsk.center = vec_input[query_seq[i]];
+                    tsk.radius = radius[query_seq[i]];
+                    return tsk;
+                },
+                parlay::make_slice(tdpu, tdpu + total_query_num),
+                parlay::make_slice(tpos, tpos + total_query_num)
+            );
+        }
+        io->finish_task_batch();
+        return batch;
+    }
 
-#if (LX_NORM == 2) && !defined(LX_NORM_ON_DPU)
-        parlay::sequence<uint32_t> needs_further_processing_idx;
-        time_nested("first round", [&]() {
-            time_nested("taskgen", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    this->target_dpu[i] = key_to_dpu_id(coord_to_key(&(vec_input[i])));
-                });
-                io = alloc_io_manager();
-                io->init();
-                knn_batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_TSK, sizeof(knn_task), KNN_REP_SIZE(knn_k));
-                knn_batch->push_task_from_array_by_isort<false>(
-                    this->length,
-                    [&](size_t i) {
-                        knn_task tsk;
-                        tsk.k = knn_k;
-                        tsk.center = vec_input[i];
-                        return tsk;
-                    },
-                    parlay::make_slice(this->target_dpu, this->target_dpu + this->length),
-                    parlay::make_slice(this->op_taskpos, this->op_taskpos + this->length)
-                );
-                io->finish_task_batch();
+    /*
+        Counts go to i64_out[0, n). Fetched points are packed into vec_out, with the start of box i
+        in i64_out[i] and the total in i64_out[n]. Their payloads go to the same positions of payload_out.
+    */
+    void box_result(IO_Task_Batch *batch, bool count_or_fetch, int64_t n, parlay::sequence<int> &box_dpu_num, int total_query_num,
+                    int *tdpu, int32_t *tpos, int64_t *i64_out, vectorT *vec_out PAYLOAD_ARG(PAYLOAD_TYPE *payload_out)) {
+        if(count_or_fetch) {
+            parfor_wrap(0, n, [&](size_t i) {
+                i64_out[i] = 0;
+                int end_idx = (i == n - 1 ? total_query_num : box_dpu_num[i + 1]);
+                for(int j = box_dpu_num[i]; j < end_idx; j++) {
+                    i64_out[i] += ((Box_count_reply*)batch->ith(tdpu[j], tpos[j]))->count;
+                }
             });
-            time_nested("exec", [&](){ASSERT(io->exec());});
-            time_nested("get result", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    knn_reply *rep = (knn_reply*)knn_batch->ith(this->target_dpu[i], this->op_taskpos[i]);
-                    heap_host heap(knn_k);
-                    vectorT vec;
-                    int64_t distance;
-                    int j, k;
-                    for(j = 0; j < rep->len; j++) {
-                        vec = vector_sub(vec_input + i, rep->v + j);
-                        distance = vector_norm(&vec);
-                        heap.enqueue(distance, rep->v + j);
-                    }
-                    memcpy(this->vector_output + i * knn_k, heap.vector_storage, S64(MULTIPLY_NR_DIMENSION(knn_k)));
-                });
-                io->reset();
+        } else {
+            parlay::sequence<int> return_size_seq = parlay::tabulate(total_query_num, [&](size_t i) {
+                return (int)(((Box_fetch_reply*)batch->ith(tdpu[i], tpos[i]))->len);
+            });
+            int total_return_num = parlay::scan_inplace(return_size_seq);
+            parfor_wrap(0, n, [&](size_t i) {
+                i64_out[i] = return_size_seq[box_dpu_num[i]];
+            });
+            i64_out[n] = total_return_num;
+            ASSERT(total_return_num <= BATCH_SIZE);
+            if(total_return_num > BATCH_SIZE) return;
+            parfor_wrap(0, total_query_num, [&](size_t i) {
+                int len = (i == total_query_num - 1 ? total_return_num : return_size_seq[i + 1]) - return_size_seq[i];
+                Box_fetch_reply *rep = (Box_fetch_reply*)batch->ith(tdpu[i], tpos[i]);
+                memcpy(vec_out + return_size_seq[i], rep->v, S64(MULTIPLY_NR_DIMENSION(len)));
+#ifdef POINT_PAYLOAD_ON
+                memcpy(payload_out + return_size_seq[i], rep->v + len, S64(PAYLOAD_WORDS * len));
+#endif
             });
+        }
+    }
+#endif
+
+#ifdef BOX_RANGE_COUNT_ON
+    /* Approximate counts, with the node budget and the depth limit applied by each routed task */
+    IO_Task_Batch* box_count_approx_taskgen(IO_Manager *io, int64_t n, vectorT *vec_input, int32_t budget, int32_t max_depth,
+                                            int *tdpu, int32_t *tpos, parlay::sequence<int> &box_dpu_num, int &total_query_num) {
+        auto query_seq = box_route(n, vec_input, tdpu, box_dpu_num, total_query_num);
+        IO_Task_Batch *batch = io->alloc<Box_count_approx_task, Box_count_approx_reply>(direct);
+        batch->push_task_from_array_by_isort<false>(
+            total_query_num,
+            [&](size_t i) {
+                Box_count_approx_task tsk;
+                tsk.vec_min = vec_input[query_seq[i] << 1];
+                tsk.vec_max = vec_input[(query_seq[i] << 1) + 1];
+                tsk.budget = budget;
+                tsk.max_depth = max_depth;
+                return tsk;
+            },
+            parlay::make_slice(tdpu, tdpu + total_query_num),
+            parlay::make_slice(tpos, tpos + total_query_num)
+        );
+        io->finish_task_batch();
+        return batch;
+    }
+
+    /* Estimates go to i64_out[0, n), and the bounds of the exact counts to i64_out[n, 2n) (lower) and i64_out[2n, 3n) (upper) */
+    void box_count_approx_result(IO_Task_Batch *batch, int64_t n, parlay::sequence<int> &box_dpu_num, int total_query_num,
+                                 int *tdpu, int32_t *tpos, int64_t *i64_out) {
+        parfor_wrap(0, n, [&](size_t i) {
+            int64_t count = 0, lower = 0, upper = 0;
+            int end_idx = (i == n - 1 ? total_query_num : box_dpu_num[i + 1]);
+            for(int j = box_dpu_num[i]; j < end_idx; j++) {
+                Box_count_approx_reply *rep = (Box_count_approx_reply*)batch->ith(tdpu[j], tpos[j]);
+                count += rep->count;
+                lower += rep->lower;
+                upper += rep->upper;
+            }
+            i64_out[i] = count;
+            i64_out[n + i] = lower;
+            i64_out[(n << 1) + i] = upper;
         });
+    }
 
-        time_nested("second round", [&]() {
-            parlay::sequence<int> box_dpu_num;
-            int total_return_num;
+    IO_Task_Batch* box_aggregate_taskgen(IO_Manager *io, int64_t n, vectorT *vec_input,
+                                         int *tdpu, int32_t *tpos, parlay::sequence<int> &box_dpu_num, int &total_query_num) {
+        auto query_seq = box_route(n, vec_input, tdpu, box_dpu_num, total_query_num);
+        IO_Task_Batch *batch = io->alloc<Box_aggregate_task, Box_aggregate_reply>(direct);
+        batch->push_task_from_array_by_isort<false>(
+            total_query_num,
+            [&](size_t i) {
+                Box_aggregate_task tsk;
+                tsk.vec_min = vec_input[query_seq[i] << 1];
+                tsk.vec_max = vec_input[(query_seq[i] << 1) + 1];
+                return tsk;
+            },
+            parlay::make_slice(tdpu, tdpu + total_query_num),
+            parlay::make_slice(tpos, tpos + total_query_num)
+        );
+        io->finish_task_batch();
+        return batch;
+    }
 
+    /*
+        Merge the replies of box i into i64_out[i] (count) and vec_out[4 * i, 4 * i + 4): coordinate sums,
+        centroid (sums divided by the count), and the tight bounding box. Empty boxes get a zero centroid.
+    */
+    void box_aggregate_result(IO_Task_Batch *batch, int64_t n, parlay::sequence<int> &box_dpu_num, int total_query_num,
+                              int *tdpu, int32_t *tpos, int64_t *i64_out, vectorT *vec_out) {
+        parfor_wrap(0, n, [&](size_t i) {
+            int64_t count = 0;
+            vectorT sum, box_min, box_max, centroid;
+            vector_ones(&sum, 0);
+            vector_ones(&box_min, INT64_MAX);
+            vector_ones(&box_max, INT64_MIN);
+            int end_idx = (i == n - 1 ? total_query_num : box_dpu_num[i + 1]);
+            for(int j = box_dpu_num[i]; j < end_idx; j++) {
+                Box_aggregate_reply *rep = (Box_aggregate_reply*)batch->ith(tdpu[j], tpos[j]);
+                count += rep->count;
+                for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&sum, d) += VECTOR_COORD(&(rep->sum), d);
+                vector_min(&(rep->box_min), &box_min);
+                vector_max(&(rep->box_max), &box_max);
+            }
+            for(int d = 0; d < NR_DIMENSION; d++) VECTOR_COORD(&centroid, d) = (count > 0 ? VECTOR_COORD(&sum, d) / count : 0);
+            i64_out[i] = count;
+            vec_out[i << 2] = sum;
+            vec_out[(i << 2) + 1] = centroid;
+            vec_out[(i << 2) + 2] = box_min;
+            vec_out[(i << 2) + 3] = box_max;
+        });
+    }
+#endif
+
+#ifdef KNN_ON
+    /*
+        Per-query k: k_offsets[i] is the output position of query i, and k_offsets[i + 1] - k_offsets[i] its k.
+        Without k_offsets, every query has k = knn_k and query i starts at knn_k * i.
+    */
+    inline int knn_query_k(int knn_k, int64_t *k_offsets, size_t i) {
+        return (k_offsets == nullptr ? knn_k : (int)(k_offsets[i + 1] - k_offsets[i]));
+    }
+
+    inline int64_t knn_query_out(int knn_k, int64_t *k_offsets, size_t i) {
+        return (k_offsets == nullptr ? (int64_t)knn_k * i : k_offsets[i]);
+    }
+
+    /* Reply class of k: class c holds k in (2^(c - 1), 2^c] */
+    inline int knn_k_class(int k) {
+        int c = 0;
+        while((1 << c) < k) c++;
+        return c;
+    }
+
+    /*
+        With per-query k, the tasks of each reply class go to their own batch in class_batches (nullptr if the class is empty),
+        whose reply buffers are sized for the largest k of the class instead of the largest k of the queries.
+        push(batch, j) pushes the tasks of item j, and k_of(j) is its k.
+    */
+    template<class K, class F>
+    void knn_push_by_class(IO_Manager *io, int task_type, int task_len, int64_t m, K k_of, F push, IO_Task_Batch **class_batches) {
+        auto classes = parlay::tabulate(m, [&](size_t j) {return (int8_t)knn_k_class(k_of(j));});
+        for(int c = 0; c < KNN_K_CLASS_NUM; c++) {
+            auto members = parlay::pack_index<uint32_t>(parlay::delayed_tabulate(m, [&](size_t j)->bool {return classes[j] == c;}));
+            class_batches[c] = nullptr;
+            if(members.size() == 0) continue;
+            IO_Task_Batch *batch = io->alloc_task_batch(direct, fixed_length, variable_length, task_type, task_len,
+                                                        KNN_REP_SIZE(std::min(1 << c, MAX_KNN_SIZE)));
+            parfor_wrap(0, members.size(), [&](size_t j) {
+                push(batch, members[j]);
+            });
+            io->finish_task_batch();
+            class_batches[c] = batch;
+        }
+    }
+
+    /* First round: each query searches the DPU owning its center. With k_offsets, the batches are returned in class_batches. */
+    IO_Task_Batch* knn_first_round_taskgen(IO_Manager *io, int knn_k, int64_t n, vectorT *vec_input, int *tdpu, int32_t *tpos,
+                                           int64_t *k_offsets = nullptr, IO_Task_Batch **class_batches = nullptr) {
+        parfor_wrap(0, n, [&](size_t i) {
+            tdpu[i] = key_to_dpu_id(key_prefix(coord_to_key(&(vec_input[i]))));
+        });
+        if(k_offsets != nullptr) {
+            knn_push_by_class(io, KNN_TSK, sizeof(knn_task), n,
+                [&](size_t i) {return knn_query_k(knn_k, k_offsets, i);},
+                [&](IO_Task_Batch *batch, size_t i) {
+                    knn_task *tsk = (knn_task*)batch->push_task_zero_copy(tdpu[i], sizeof(knn_task), true, tpos + i);
+                    tsk->k = knn_query_k(knn_k, k_offsets, i);
+                    tsk->center = vec_input[i];
+                },
+                class_batches);
+            return nullptr;
+        }
+        IO_Task_Batch *batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_TSK, sizeof(knn_task), KNN_REP_SIZE(knn_k));
+        batch->push_task_from_array_by_isort<false>(
+            n,
+            [&](size_t i) {
+                knn_task tsk;
+                tsk.k = knn_k;
+                tsk.center = vec_input[i];
+                return tsk;
+            },
+            parlay::make_slice(tdpu, tdpu + n),
+            parlay::make_slice(tpos, tpos + n)
+        );
+        io->finish_task_batch();
+        return batch;
+    }
+
+    /*
+        Copy the first-round candidates of query i to vec_out from its output position (payloads to payload_out)
+        and their bounding radius to radius[i]. Return the queries whose radius may reach other DPUs.
+    */
+    parlay::sequence<uint32_t> knn_first_round_result(IO_Task_Batch *batch, int knn_k, int64_t n, vectorT *vec_input,
+                                                      int *tdpu, int32_t *tpos, vectorT *vec_out PAYLOAD_ARG(PAYLOAD_TYPE *payload_out),
+                                                      int64_t *radius, int64_t *k_offsets = nullptr, IO_Task_Batch **class_batches = nullptr) {
+#if (LX_NORM == 2) && !defined(LX_NORM_ON_DPU)
+        parfor_wrap(0, n, [&](size_t i) {
+            int k = knn_query_k(knn_k, k_offsets, i);
+            int64_t out = knn_query_out(knn_k, k_offsets, i);
+            knn_reply *rep = (knn_reply*)(k_offsets == nullptr ? batch : class_batches[knn_k_class(k)])->ith(tdpu[i], tpos[i]);
+            heap_host heap(k);
+            vectorT vec;
+            int64_t distance;
+            int j;
+            for(j = 0; j < rep->len; j++) {
+                vec = vector_sub(vec_input + i, rep->v + j);
+                distance = vector_norm(&vec);
+                heap.enqueue(distance, rep->v + j PAYLOAD_ARG(((PAYLOAD_TYPE*)(rep->v + rep->len))[j]));
+            }
+            memcpy(vec_out + out, heap.vector_storage, S64(MULTIPLY_NR_DIMENSION(k)));
+#ifdef POINT_PAYLOAD_ON
+            memcpy(payload_out + out, heap.payload_storage, S64(PAYLOAD_WORDS * k));
+#endif
+            vec = vector_sub(vec_out + out, vec_input + i);
+            int64_t r = sqrt(vector_norm(&vec));
+            radius[i] = r * r;
+        });
+        return parlay::tabulate(n, [&](uint32_t i) {return i;});
+#else
+        parfor_wrap(0, n, [&](size_t i) {
+            int k = knn_query_k(knn_k, k_offsets, i);
+            int64_t out = knn_query_out(knn_k, k_offsets, i);
+            knn_reply *rep = (knn_reply*)(k_offsets == nullptr ? batch : class_batches[knn_k_class(k)])->ith(tdpu[i], tpos[i]);
+            radius[i] = rep->len;
+            memcpy(vec_out + out, rep->v, S64(MULTIPLY_NR_DIMENSION(k)));
+#ifdef POINT_PAYLOAD_ON
+            // rep->len holds the radius, so the DPU pads the points to k and the payloads start at rep->v + k
+            memcpy(payload_out + out, rep->v + k, S64(PAYLOAD_WORDS * k));
+#endif
+        });
+        return parlay::pack_index<uint32_t>(
+            parlay::delayed_tabulate(n, [&](size_t i)->bool {
+                return (radius[i] >= 0);
+            })
+        );
+#endif
+    }
+
+    /* Number of DPUs whose key ranges meet the box of half width r around center, the DPU of the center included */
+    int box_dpu_count(vectorT *center, int64_t r) {
+        vectorT vec_min, vec_max;
+        vector_ones(&vec_min, r);
+        vec_min = vector_sub_zero_bounded(center, &vec_min);
+        vector_ones(&vec_max, r);
+        vec_max = vector_add(center, &vec_max);
+#ifdef HILBERT_KEY_ON
+        int num = 0;
+        hilbert_box_dpus(&vec_min, &vec_max, [&](int j) { num++; });
+        return num;
+#else
+        box_dpu_id box_idx;
+        uint64_t key1 = key_prefix(coord_to_key(&vec_min)), key2 = key_prefix(coord_to_key(&vec_max));
+        box_idx.set_litmin_bigmax(key_to_dpu_id(key1), key_to_dpu_id(key2));
+        auto box_split_res = box_split(key1, key2);
+        box_idx.set_litmax_bigmin(key_to_dpu_id(box_split_res.first), key_to_dpu_id(box_split_res.second));
+        return box_idx.size();
+#endif
+    }
+
+    /* Largest half width in [0, r] whose box around center meets at most dpu_num DPUs, found by binary search */
+    int64_t box_dpu_count_max_width(vectorT *center, int64_t r, int dpu_num) {
+        int64_t lo = 0, hi = r, mid;
+        if(box_dpu_count(center, r) <= dpu_num) return r;
+        while(lo < hi) {
+            mid = lo + ((hi - lo + 1) >> 1);
+            if(box_dpu_count(center, mid) <= dpu_num) lo = mid;
+            else hi = mid - 1;
+        }
+        return lo;
+    }
+
+    /*
+        Approximate kNN between the two rounds. Return the queries of idx that still need a second round.
+        With eps > 0, queries whose first-round radius is within (1 + eps) of the distance to the nearest point outside the DPU
+        of their center are dropped: their first-round k-th distance is within (1 + eps) of the exact one.
+        With fanout_budget >= 0, the other queries reach at most fanout_budget other DPUs. Their radius[i] shrinks until
+        its box meets that many, and they only improve on the first round within the shrunk radius.
+    */
+    parlay::sequence<uint32_t> knn_approx_filter(vectorT *vec_input, parlay::sequence<uint32_t> &idx, int64_t *radius,
+                                                 double eps, int fanout_budget) {
+        auto keep = parlay::tabulate(idx.size(), [&](size_t i)->bool {
+            vectorT *center = vec_input + idx[i];
+            int64_t r = radius[idx[i]];
+#if LX_NORM == 2
+            r = (int64_t)sqrt(r);
+#endif
+            if(eps > 0) {
+                // Points of other DPUs are outside the largest box around the center that only meets its own DPU
+                double bound = (1 + eps) * (box_dpu_count_max_width(center, r, 1) + 1);
+#if LX_NORM == 2
+                bound = bound * bound;
+#endif
+                if((double)radius[idx[i]] <= bound) return false;
+            }
+            if(fanout_budget >= 0 && box_dpu_count(center, r) > fanout_budget + 1) {
+                if(fanout_budget == 0) return false;
+                r = box_dpu_count_max_width(center, r, fanout_budget + 1);
+#if LX_NORM == 2
+                radius[idx[i]] = r * r;
+#else
+                radius[idx[i]] = r;
+#endif
+            }
+            return true;
+        });
+        auto kept = parlay::pack_index<uint32_t>(keep);
+        return parlay::tabulate(kept.size(), [&](size_t i) {return idx[kept[i]];});
+    }
+
+    /*
+        Second round: bounded searches on the other DPUs covered by the radius box of each query in idx.
+        With k_offsets, the batches are returned in class_batches as in the first round.
+    */
+    IO_Task_Batch* knn_second_round_taskgen(IO_Manager *io, int knn_k, vectorT *vec_input, parlay::sequence<uint32_t> &idx, int64_t *radius,
+                                            int *tdpu, int32_t *tpos, parlay::sequence<int> &box_dpu_num, int &total_return_num,
+                                            int64_t *k_offsets = nullptr, IO_Task_Batch **class_batches = nullptr) {
+        int64_t m = idx.size();
+        parlay::sequence<box_dpu_id> box_idx(m);
+        box_dpu_num = parlay::tabulate(m, [&](size_t i) {
+            vectorT vec;
+            int64_t r = radius[idx[i]];
+#if LX_NORM == 2
+            r = (int64_t)sqrt(r);
+#endif
+            vector_ones(&vec, r);
+            vec = vector_sub_zero_bounded(&(vec_input[idx[i]]), &vec);
+#ifdef HILBERT_KEY_ON
+            vectorT vec_max;
+            vector_ones(&vec_max, r);
+            vec_max = vector_add(&(vec_input[idx[i]]), &vec_max);
+            int num = 0;
+            hilbert_box_dpus(&vec, &vec_max, [&](int j) { num++; });
+            return num - 1;
+#else
+            uint64_t key1, key2;
+            key1 = key_prefix(coord_to_key(&vec));
+            vector_ones(&vec, r);
+            vec = vector_add(&(vec_input[idx[i]]), &vec);
+            key2 = key_prefix(coord_to_key(&vec));
+            box_idx[i].set_litmin_bigmax(key_to_dpu_id(key1), key_to_dpu_id(key2));
+            auto box_split_res = box_split(key1, key2);
+            box_idx[i].set_litmax_bigmin(
+                key_to_dpu_id(box_split_res.first),
+                key_to_dpu_id(box_split_res.second)
+            );
+            return box_idx[i].size() - 1;
+#endif
+        });
+        total_return_num = parlay::scan_inplace(box_dpu_num);
+
+        auto push_query = [&](IO_Task_Batch *batch, size_t i) {
+            vectorT vec = vec_input[idx[i]];
+            int this_dpu_idx = key_to_dpu_id(key_prefix(coord_to_key(&vec)));
+            int start_idx = box_dpu_num[i];
+            auto push_bounded = [&](int j) {
+                if(j == this_dpu_idx) return;
+                tdpu[start_idx] = j;
+                knn_bounded_task *tsk = (knn_bounded_task*)batch->push_task_zero_copy(
+                    j, sizeof(knn_bounded_task), true, tpos + start_idx
+                );
+                tsk->k = knn_query_k(knn_k, k_offsets, idx[i]);
+                tsk->center = vec;
+                tsk->radius = radius[idx[i]];
+                start_idx++;
+            };
+#ifdef HILBERT_KEY_ON
+            int64_t r = radius[idx[i]];
+#if LX_NORM == 2
+            r = (int64_t)sqrt(r);
+#endif
+            vectorT vec_min, vec_max;
+            vector_ones(&vec_min, r);
+            vec_min = vector_sub_zero_bounded(&vec, &vec_min);
+            vector_ones(&vec_max, r);
+            vec_max = vector_add(&vec, &vec_max);
+            hilbert_box_dpus(&vec_min, &vec_max, push_bounded);
+#else
+            int j;
+            if(box_idx[i].litmax < box_idx[i].bigmin) {
+                for(j = box_idx[i].litmin; j <= box_idx[i].litmax; j++) push_bounded(j);
+                for(j = box_idx[i].bigmin; j <= box_idx[i].bigmax; j++) push_bounded(j);
+            }
+            else {
+                for(j = box_idx[i].litmin; j <= box_idx[i].bigmax; j++) push_bounded(j);
+            }
+#endif
+        };
+        if(k_offsets != nullptr) {
+            knn_push_by_class(io, KNN_BOUNDED_TSK, sizeof(knn_bounded_task), m,
+                              [&](size_t i) {return knn_query_k(knn_k, k_offsets, idx[i]);}, push_query, class_batches);
+            return nullptr;
+        }
+        IO_Task_Batch *batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_BOUNDED_TSK, sizeof(knn_bounded_task), KNN_REP_SIZE(knn_k));
+        parfor_wrap(0, m, [&](size_t i) {
+            push_query(batch, i);
+        });
+        io->finish_task_batch();
+        return batch;
+    }
+
+    /* Merge the first-round candidates in vec_out (and payload_out) with the second-round replies */
+    void knn_second_round_result(IO_Task_Batch *batch, int knn_k, vectorT *vec_input, parlay::sequence<uint32_t> &idx,
+                                 parlay::sequence<int> &box_dpu_num, int total_return_num, int *tdpu, int32_t *tpos, vectorT *vec_out
+                                 PAYLOAD_ARG(PAYLOAD_TYPE *payload_out), int64_t *k_offsets = nullptr, IO_Task_Batch **class_batches = nullptr) {
+        int64_t m = idx.size();
+        parfor_wrap(0, m, [&](size_t i) {
+            int k = knn_query_k(knn_k, k_offsets, idx[i]);
+            int64_t out = knn_query_out(knn_k, k_offsets, idx[i]);
+            IO_Task_Batch *query_batch = (k_offsets == nullptr ? batch : class_batches[knn_k_class(k)]);
+            heap_host heap(k);
+            vectorT *center = vec_input + idx[i];
+            vectorT vec, *vec_pt;
+            int64_t distance;
+            int j;
+            for(vec_pt = vec_out + out, j = 0; j < k; j++, vec_pt++) {
+                vec = vector_sub(center, vec_pt);
+                distance = vector_norm(&vec);
+                heap.enqueue(distance, vec_pt PAYLOAD_ARG(payload_out[out + j]));
+            }
+            int end_idx = (i == m - 1 ? total_return_num : box_dpu_num[i + 1]);
+            knn_reply *rep;
+            for(j = box_dpu_num[i]; j < end_idx; j++) {
+                rep = (knn_reply*)query_batch->ith(tdpu[j], tpos[j]);
+                for(int k = 0; k < rep->len; k++) {
+                    vec_pt = rep->v + k;
+                    vec = vector_sub(center, vec_pt);
+                    distance = vector_norm(&vec);
+                    heap.enqueue(distance, vec_pt PAYLOAD_ARG(((PAYLOAD_TYPE*)(rep->v + rep->len))[k]));
+                }
+            }
+            memcpy(vec_out + out, heap.vector_storage, S64(MULTIPLY_NR_DIMENSION(k)));
+#ifdef POINT_PAYLOAD_ON
+            memcpy(payload_out + out, heap.payload_storage, S64(PAYLOAD_WORDS * k));
+#endif
+        });
+    }
+#endif
+
+#if (defined INSERT_NODE_ON) && (defined BOX_RANGE_COUNT_ON) && (defined KNN_ON)
+    /* Inputs, scratch arrays and results of one mixed batch. Two of them are in flight when pipelined. */
+    struct mixed_batch {
+        int64_t insert_num, box_num, knn_num;
+        int knn_k;
+        vectorT *insert_input, *box_input, *knn_input;
+
+        pptr *op_addrs;
+        int32_t *op_taskpos;
+        int *target_dpu;
+        int64_t *i64_io;  // Box counts, then the sorted insert keys (KEY_WORDS each), then the kNN radii
+        vectorT *vector_output;  // kNN results
+#ifdef POINT_PAYLOAD_ON
+        PAYLOAD_TYPE *insert_payloads, *payload_output;
+#endif
+
+        parlay::sequence<int32_t> key_idx_seq;
+        parlay::sequence<int> box_dpu_num, knn_dpu_num;
+        parlay::sequence<uint32_t> needs_further_processing_idx;
+        int total_query_num, total_return_num;
+        int knn_offset, search_offset;  // Slices of target_dpu and op_taskpos in the first launch
+
+        IO_Manager *io;
+        IO_Task_Batch *box_batch, *knn_batch, *single_search_batch;
+    };
+
+    void mixed_batch_init(mixed_batch &mb, int64_t insert_num, int64_t box_num, int64_t knn_num, int knn_k, vectorT *vec_input
+                          PAYLOAD_ARG(PAYLOAD_TYPE *payload_input)) {
+        ASSERT(insert_num + (box_num << 1) + knn_num <= BATCH_SIZE);
+        ASSERT(box_num + KEY_WORDS * insert_num + knn_num <= (int64_t)BATCH_SIZE * KEY_WORDS);
+        ASSERT(knn_num * knn_k <= BATCH_SIZE);
+        mb.insert_num = insert_num;
+        mb.box_num = box_num;
+        mb.knn_num = knn_num;
+        mb.knn_k = knn_k;
+        mb.insert_input = vec_input;
+#ifdef POINT_PAYLOAD_ON
+        mb.insert_payloads = payload_input;
+#endif
+        mb.box_input = vec_input + insert_num;
+        mb.knn_input = mb.box_input + (box_num << 1);
+        mb.total_query_num = mb.total_return_num = 0;
+        mb.needs_further_processing_idx.clear();
+    }
+
+    /* First launch: box counts, first-round kNN and the insert search */
+    void mixed_first_taskgen(mixed_batch &mb) {
+        KEY_TYPE *key_seq = (KEY_TYPE*)(mb.i64_io + mb.box_num);
+        mb.key_idx_seq = sort_by_key(mb.insert_num, mb.insert_input, key_seq);
+        mb.io = alloc_io_manager();
+        mb.io->init();
+        if(mb.box_num > 0) {
+            mb.box_batch = box_taskgen(mb.io, true, 0, mb.box_num, mb.box_input,
+                                       mb.target_dpu, mb.op_taskpos, mb.box_dpu_num, mb.total_query_num);
+        }
+        mb.knn_offset = mb.total_query_num;
+        mb.search_offset = mb.knn_offset + mb.knn_num;
+        ASSERT(mb.search_offset + mb.insert_num <= BATCH_SIZE);
+        if(mb.knn_num > 0) {
+            mb.knn_batch = knn_first_round_taskgen(mb.io, mb.knn_k, mb.knn_num, mb.knn_input,
+                                                   mb.target_dpu + mb.knn_offset, mb.op_taskpos + mb.knn_offset);
+        }
+        if(mb.insert_num > 0) {
+            mb.single_search_batch = search_taskgen(mb.io, mb.insert_num, key_seq,
+                                                    mb.target_dpu + mb.search_offset, mb.op_taskpos + mb.search_offset);
+        }
+    }
+
+    void mixed_first_result(mixed_batch &mb) {
+        if(mb.box_num > 0) {
+            box_result(mb.box_batch, true, mb.box_num, mb.box_dpu_num, mb.total_query_num,
+                       mb.target_dpu, mb.op_taskpos, mb.i64_io, nullptr PAYLOAD_ARG(nullptr));
+        }
+        if(mb.knn_num > 0) {
+            mb.needs_further_processing_idx = knn_first_round_result(mb.knn_batch, mb.knn_k, mb.knn_num, mb.knn_input,
+                                                                     mb.target_dpu + mb.knn_offset, mb.op_taskpos + mb.knn_offset,
+                                                                     mb.vector_output PAYLOAD_ARG(mb.payload_output), mb.i64_io + mb.box_num + KEY_WORDS * mb.insert_num);
+        }
+        if(mb.insert_num > 0) {
+            search_result(mb.single_search_batch, mb.insert_num, mb.target_dpu + mb.search_offset,
+                          mb.op_taskpos + mb.search_offset, mb.op_addrs);
+        }
+        mb.io->reset();
+    }
+
+    inline bool mixed_needs_second_launch(mixed_batch &mb) {
+        return mb.needs_further_processing_idx.size() > 0 || mb.insert_num > 0;
+    }
+
+    /* Second launch: bounded kNN, then the inserts, so that no query of the batch sees its points */
+    void mixed_second_taskgen(mixed_batch &mb) {
+        mb.io = alloc_io_manager();
+        mb.io->init();
+        if(mb.needs_further_processing_idx.size() > 0) {
+            mb.knn_batch = knn_second_round_taskgen(mb.io, mb.knn_k, mb.knn_input, mb.needs_further_processing_idx,
+                                                    mb.i64_io + mb.box_num + KEY_WORDS * mb.insert_num,
+                                                    mb.target_dpu, mb.op_taskpos, mb.knn_dpu_num, mb.total_return_num);
+        }
+        if(mb.insert_num > 0) {
+            insert_taskgen(mb.io, mb.insert_num, mb.op_addrs, mb.key_idx_seq.data(), mb.insert_input PAYLOAD_ARG(mb.insert_payloads));
+        }
+    }
+
+    void mixed_second_result(mixed_batch &mb) {
+        if(mb.needs_further_processing_idx.size() > 0) {
+            knn_second_round_result(mb.knn_batch, mb.knn_k, mb.knn_input, mb.needs_further_processing_idx, mb.knn_dpu_num,
+                                    mb.total_return_num, mb.target_dpu, mb.op_taskpos, mb.vector_output PAYLOAD_ARG(mb.payload_output));
+        }
+        mb.io->reset();
+    }
+#endif
+
+/* Interfaces for database operations */
+
+public:
+    void init_range() {
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        printf("\n********** INIT RANGES **********\n");
+#ifdef DPU_INIT_ON
+        auto io = alloc_io_manager();
+        ASSERT(io == io_managers[0]);
+        io->init();
+        IO_Task_Batch* batch = io->alloc<dpu_init_range_task, empty_task_reply>(direct);
+        parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+            auto it = (dpu_init_range_task*)batch->push_task_zero_copy(i, -1, false);
+            it->range_start = this->partition_borders[i];
+            it->range_end = this->partition_borders[i + 1];
+        });
+        io->finish_task_batch();
+        ASSERT(io->exec());
+        io->reset();
+#endif
+        printf("\n****** INIT RANGES Finished ******\n");
+        cpu_coverage_timer->end();
+    }
+
+    /* Batched insertion. With POINT_PAYLOAD_ON, the payload of vec_input[i] is pim_zd_tree::payload_input[i]. */
+    void insert(vectorT *vec_input = nullptr, bool debug_print = false) {
+#ifdef INSERT_NODE_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("insert");
+
+        time_start("init");
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        IO_Manager *io;
+        IO_Task_Batch *single_search_batch, *single_insert_batch;
+        KEY_TYPE *key_seq = (KEY_TYPE*)this->i64_io;
+        auto key_idx_seq = sort_by_key(this->length, vec_input, key_seq);
+        time_end("init");
+
+        if(this->use_top_cache) {
+            // A single round: the DPUs search below the deepest replicated node themselves
+            time_nested("insert_from_cache", [&]() {
+                parlay::sequence<int64_t> cache_slot;
+                int task_num;
+                time_nested("taskgen", [&]() {
+                    io = alloc_io_manager();
+                    io->init();
+                    single_insert_batch = insert_from_cache_taskgen(io, this->length, key_seq, key_idx_seq.data(), vec_input
+                                                                    PAYLOAD_ARG(this->payload_input),
+                                                                    this->target_dpu, this->op_taskpos, cache_slot, task_num);
+                });
+                time_nested("exec", [&](){ASSERT(io->exec());});
+                time_nested("get result", [&]() {
+                    insert_from_cache_result(single_insert_batch, task_num, this->target_dpu, this->op_taskpos, cache_slot);
+                    io->reset();
+                });
+            });
+        }
+        else {
+            time_nested("search", [&]() {
+                time_nested("taskgen", [&]() {
+                    io = alloc_io_manager();
+                    io->init();
+                    single_search_batch = search_taskgen(io, this->length, key_seq, this->target_dpu, this->op_taskpos);
+                });
+                time_nested("exec", [&](){ASSERT(io->exec());});
+                time_nested("get result", [&]() {
+                    search_result(single_search_batch, this->length, this->target_dpu, this->op_taskpos, this->op_addrs);
+                    io->reset();
+                });
+            });
+
+            time_nested("insert_vector", [&]() {
+                time_nested("taskgen", [&]() {
+                    io = alloc_io_manager();
+                    io->init();
+                    insert_taskgen(io, this->length, this->op_addrs, key_idx_seq.data(), vec_input PAYLOAD_ARG(this->payload_input));
+                });
+                time_nested("exec", [&](){ASSERT(io->exec());});
+                time_nested("get result", [&]() {io->reset();});
+            });
+        }
+
+        // nr_points += this->length;
+        std::atomic_fetch_add(&(this->nr_points), this->length);
+
+        time_end("insert");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Batched deletion. Set pim_zd_tree::length to be the number of points to be removed.
+        Each input point removes at most one stored copy, and points not in the tree are ignored.
+    */
+    void erase(vectorT *vec_input = nullptr, bool debug_print = false) {
+#ifdef DELETE_NODE_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("erase");
+
+        time_start("init");
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        IO_Manager *io;
+        IO_Task_Batch *single_search_batch, *single_delete_batch;
+        KEY_TYPE *key_seq = (KEY_TYPE*)this->i64_io;
+        auto key_idx_seq = sort_by_key(this->length, vec_input, key_seq);
+        int64_t nr_deleted = 0;
+        time_end("init");
+
+        time_nested("search", [&]() {
             time_nested("taskgen", [&]() {
-                parlay::sequence<box_dpu_id> box_idx(this->length);
-                box_dpu_num = parlay::tabulate(this->length, [&](size_t i) {
-                    vectorT vec;
-                    uint64_t key1, key2;
-                    vec = vector_sub(this->vector_output + i * knn_k, vec_input + i);
-                    int64_t radius = sqrt(vector_norm(&vec));
-                    vector_ones(&vec, radius);
-                    vec = vector_sub_zero_bounded(vec_input + i, &vec);
-                    key1 = coord_to_key(&vec);
-                    vector_ones(&vec, radius);
-                    vec = vector_add(vec_input + i, &vec);
-                    key2 = coord_to_key(&vec);
-                    box_idx[i].set_litmin_bigmax(key_to_dpu_id(key1),  key_to_dpu_id(key2));
-                    auto box_split_res = box_split(key1, key2);
-                    box_idx[i].set_litmax_bigmin(
-                        key_to_dpu_id(box_split_res.first),
-                        key_to_dpu_id(box_split_res.second)
-                    );
-                    int ret = box_idx[i].size() - 1;
-                    this->i64_io[i] = (ret <= 0 ? -1 : radius * radius);
-                    return ret;
+                io = alloc_io_manager();
+                io->init();
+                single_search_batch = search_taskgen(io, this->length, key_seq, this->target_dpu, this->op_taskpos);
+            });
+            time_nested("exec", [&](){ASSERT(io->exec());});
+            time_nested("get result", [&]() {
+                search_result(single_search_batch, this->length, this->target_dpu, this->op_taskpos, this->op_addrs);
+                io->reset();
+            });
+        });
+
+        time_nested("delete_vector", [&]() {
+            int pptr_diff_num;
+            time_nested("taskgen", [&]() {
+                io = alloc_io_manager();
+                io->init();
+                single_delete_batch = io->alloc_task_batch(direct, variable_length, fixed_length, SINGLE_DELETE_TSK, -1, sizeof(Single_delete_reply));
+
+                // Searches ending at a B node prove that the point does not exist
+                auto pptr_diff_idx = parlay::pack_index<uint32_t>(parlay::delayed_tabulate(this->length, [&](size_t i)->bool {
+                    return this->op_addrs[i].data_type == P_NODE_DATA_TYPE && ((i == 0) || !equal_pptr_strong(this->op_addrs[i], this->op_addrs[i - 1]));
+                }));
+                pptr_diff_num = pptr_diff_idx.size();
+                parfor_wrap(0, pptr_diff_num, [&](int i) {
+                    int k = pptr_diff_idx[i], len = 1;
+                    pptr addr = this->op_addrs[k];
+                    while(k + len < this->length && equal_pptr_strong(this->op_addrs[k + len], addr)) len++;
+                    Single_delete_task *tsk = (Single_delete_task*)(single_delete_batch->push_task_zero_copy(
+                        addr.id,
+                        SINGLE_DELETE_TSK_SIZE(len),
+                        true,
+                        this->op_taskpos + i
+                    ));
+                    this->target_dpu[i] = addr.id;
+                    tsk->addr = addr;
+                    tsk->len = len;
+                    for(int j = 0; j < len; j++, k++) {
+                        tsk->v[j] = vec_input[key_idx_seq[k]];
+                    }
                 });
-                total_return_num = parlay::scan_inplace(box_dpu_num);
 
+                io->finish_task_batch();
+            });
+            time_nested("exec", [&](){ASSERT(io->exec());});
+            time_nested("get result", [&]() {
+                nr_deleted = parlay::reduce(parlay::delayed_tabulate(pptr_diff_num, [&](size_t i)->int64_t {
+                    return ((Single_delete_reply*)single_delete_batch->ith(this->target_dpu[i], this->op_taskpos[i]))->count;
+                }));
+                io->reset();
+            });
+        });
+
+        if(debug_print) printf("Deleted %lld of %lld points\n", nr_deleted, this->length);
+        std::atomic_fetch_sub(&(this->nr_points), nr_deleted);
+        // Emptied B nodes may have been freed
+        top_cache.reset();
+
+        time_end("erase");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Offline compaction of the node buffers on all DPUs, reclaiming nodes freed by deletions.
+        Node addresses change, so no pptr obtained before may be reused afterwards.
+    */
+    void compact(bool debug_print = false) {
+#ifdef DELETE_NODE_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("compact");
+        IO_Manager *io = alloc_io_manager();
+        io->init();
+        IO_Task_Batch *batch = io->alloc<dpu_compact_task, dpu_compact_reply>(direct);
+        parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+            auto it = (dpu_compact_task*)batch->push_task_zero_copy(i, -1, false);
+            it->dpu_id = i;
+        });
+        io->finish_task_batch();
+        time_nested("exec", [&](){ASSERT(io->exec());});
+        if(debug_print) {
+            int64_t total_bcnt = 0, total_pcnt = 0;
+            for(int i = 0; i < nr_of_dpus; i++) {
+                dpu_compact_reply *rep = (dpu_compact_reply*)batch->ith(i, 0);
+                total_bcnt += rep->bcnt;
+                total_pcnt += rep->pcnt;
+            }
+            printf("Live B nodes: %lld; Live P nodes: %lld\n", total_bcnt, total_pcnt);
+        }
+        io->reset();
+        top_cache.reset();
+        time_end("compact");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Repartition the key space so that each DPU holds about nr_points / nr_of_dpus points. Needs the insert binary.
+        Every DPU samples keys, and the new partition_borders are the quantiles of the samples weighted by their DPU's size.
+        Points outside their DPU's new range are then exported in rounds of at most BATCH_SIZE points, erased with the
+        old borders and inserted with the new ones. Finally the ranges are re-sent with INIT_RANGE_TSK.
+        With POINT_PAYLOAD_ON, the migrated payloads pass through pim_zd_tree::payload_input.
+        Return the number of migrated points.
+    */
+    int64_t rebalance(int sample_num_per_dpu = 128, bool debug_print = false) {
+#if (defined DELETE_NODE_ON) && (defined INSERT_NODE_ON)
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("rebalance");
+
+        IO_Manager *io;
+        IO_Task_Batch *batch;
+        parlay::sequence<uint64_t> new_borders(nr_of_dpus + 1);
+        int64_t total_count = 0, total_migrated = 0;
+
+        time_nested("sample", [&]() {
+            io = alloc_io_manager();
+            io->init();
+            batch = io->alloc_task_batch(direct, fixed_length, variable_length, DPU_SAMPLE_TSK,
+                                         sizeof(dpu_sample_task), DPU_SAMPLE_REP_SIZE(sample_num_per_dpu));
+            parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+                auto it = (dpu_sample_task*)batch->push_task_zero_copy(i, -1, false);
+                it->sample_num = sample_num_per_dpu;
+            });
+            io->finish_task_batch();
+            ASSERT(io->exec());
+
+            // Each sampled key stands for count / len points of its DPU
+            auto sample_num = parlay::tabulate(nr_of_dpus, [&](size_t i) {
+                return (int)(((dpu_sample_reply*)batch->ith(i, 0))->len);
+            });
+            int total_sample_num = parlay::scan_inplace(sample_num);
+            auto samples = parlay::sequence<std::pair<uint64_t, double>>(total_sample_num);
+            parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+                dpu_sample_reply *rep = (dpu_sample_reply*)batch->ith(i, 0);
+                for(int j = 0; j < rep->len; j++) {
+                    samples[sample_num[i] + j] = std::make_pair(rep->keys[j], (double)rep->count / rep->len);
+                }
+            });
+            total_count = parlay::reduce(parlay::delayed_tabulate(nr_of_dpus, [&](size_t i) {
+                return ((dpu_sample_reply*)batch->ith(i, 0))->count;
+            }));
+            io->reset();
+
+            parlay::integer_sort_inplace(samples, [&](std::pair<uint64_t, double> kw) {return kw.first;});
+            // Exclusive prefix sums: the weight of the samples before each one
+            auto weights = parlay::tabulate(total_sample_num, [&](size_t i) {return samples[i].second;});
+            double total_weight = parlay::scan_inplace(weights);
+            new_borders[0] = 0;
+            new_borders[nr_of_dpus] = UINT64_MAX;
+            parfor_wrap(1, nr_of_dpus, [&](size_t i) {
+                double target = total_weight * i / nr_of_dpus;
+                size_t pos = std::lower_bound(weights.begin(), weights.end(), target) - weights.begin();
+                new_borders[i] = (pos < samples.size() ? samples[pos].first : UINT64_MAX);
+            });
+        });
+        if(total_count == 0) {
+            time_end("rebalance");
+            cpu_coverage_timer->end();
+            return 0;
+        }
+
+        parlay::sequence<uint64_t> old_borders(this->partition_borders, this->partition_borders + nr_of_dpus + 1);
+        int8_t old_mode = this->key_to_dpu_id_mode, new_mode = (old_mode == 0 ? 1 : old_mode);
+        int64_t limit = std::min((int64_t)DPU_EXPORT_MAX_LEN, (int64_t)(BATCH_SIZE / nr_of_dpus));
+        parlay::sequence<vectorT> migrate_seq;
+        while(true) {
+            int64_t migrate_num;
+            time_nested("export", [&]() {
                 io = alloc_io_manager();
                 io->init();
-                knn_batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_BOUNDED_TSK, sizeof(knn_bounded_task), KNN_REP_SIZE(knn_k));
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    if(this->i64_io[i] < 0) return;
-                    vectorT *vec = vec_input + i;
-                    int this_dpu_idx = key_to_dpu_id(coord_to_key(vec));
-                    int start_idx = box_dpu_num[i];
-                    int j;
-                    knn_bounded_task *tsk;
-                    if(box_idx[i].litmax < box_idx[i].bigmin) {
-                        for(j = box_idx[i].litmin; j <= box_idx[i].litmax; j++) {
-                            if(j == this_dpu_idx) {
-                                continue;
-                            }
-                            this->target_dpu[start_idx] = j;
-                            tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                            );
-                            tsk->k = knn_k;
-                            tsk->center = *vec;
-                            tsk->radius = this->i64_io[i];
-                            start_idx++;
-                        }
-                        for(j = box_idx[i].bigmin; j <= box_idx[i].bigmax; j++) {
-                            if(j == this_dpu_idx) {
-                                continue;
-                            }
-                            this->target_dpu[start_idx] = j;
-                            tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                            );
-                            tsk->k = knn_k;
-                            tsk->center = *vec;
-                            tsk->radius = this->i64_io[i];
-                            start_idx++;
-                        }
-                    }
-                    else {
-                        for(j = box_idx[i].litmin; j <= box_idx[i].bigmax; j++) {
-                            if(j == this_dpu_idx) {
-                                continue;
-                            }
-                            this->target_dpu[start_idx] = j;
-                            tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                            );
-                            tsk->k = knn_k;
-                            tsk->center = *vec;
-                            tsk->radius = this->i64_io[i];
-                            start_idx++;
-                        }
-                    }
+                batch = io->alloc_task_batch(direct, fixed_length, variable_length, DPU_EXPORT_TSK,
+                                             sizeof(dpu_export_task), DPU_EXPORT_REP_SIZE(limit));
+                parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+                    auto it = (dpu_export_task*)batch->push_task_zero_copy(i, -1, false);
+                    it->range_start = new_borders[i];
+                    it->range_end = new_borders[i + 1];
+                    it->limit = limit;
                 });
                 io->finish_task_batch();
-            });
-            time_nested("exec", [&](){ASSERT(io->exec());});
-            time_nested("get result", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    if(this->i64_io[i] < 0) return;
-                    heap_host heap(knn_k);
-                    vectorT *center = vec_input + i;
-                    vectorT vec, *vec_pt;
-                    int64_t distance;
-                    int j;
-                    for(vec_pt = this->vector_output + knn_k * i, j = 0; j < knn_k; j++, vec_pt++) {
-                        vec = vector_sub(center, vec_pt);
-                        distance = vector_norm(&vec);
-                        heap.enqueue(distance, vec_pt);
-                    }
-                    int end_idx = (i == this->length - 1 ? total_return_num : box_dpu_num[i + 1]);
-                    knn_reply *rep;
-                    for(j = box_dpu_num[i]; j < end_idx; j++) {
-                        rep = (knn_reply*)knn_batch->ith(this->target_dpu[j], this->op_taskpos[j]);
-                        for(int k = 0; k < rep->len; k++) {
-                            vec_pt = rep->v + k;
-                            vec = vector_sub(center, vec_pt);
-                            distance = vector_norm(&vec);
-                            heap.enqueue(distance, vec_pt);
-                        }
-                    }
-                    memcpy(this->vector_output + i * knn_k, heap.vector_storage, S64(MULTIPLY_NR_DIMENSION(knn_k)));
+                ASSERT(io->exec());
+                auto export_num = parlay::tabulate(nr_of_dpus, [&](size_t i) {
+                    return (int64_t)(((dpu_export_reply*)batch->ith(i, 0))->len);
+                });
+                migrate_num = parlay::scan_inplace(export_num);
+                migrate_seq = parlay::sequence<vectorT>::uninitialized(migrate_num);
+                parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+                    dpu_export_reply *rep = (dpu_export_reply*)batch->ith(i, 0);
+                    memcpy(migrate_seq.data() + export_num[i], rep->v, S64(MULTIPLY_NR_DIMENSION(rep->len)));
+#ifdef POINT_PAYLOAD_ON
+                    memcpy(this->payload_input + export_num[i], rep->v + rep->len, S64(PAYLOAD_WORDS * rep->len));
+#endif
                 });
                 io->reset();
             });
-        });
+            if(migrate_num == 0) break;
+            total_migrated += migrate_num;
+
+            // Erase from the old owners, then insert into the new ones
+            this->length = migrate_num;
+            int64_t nr_points_before = this->nr_points.load();
+            erase(migrate_seq.data());
+            ASSERT(nr_points_before - this->nr_points.load() == migrate_num);
+            set_partition_borders(new_mode, new_borders.data());
+            insert(migrate_seq.data());
+            set_partition_borders(old_mode, old_borders.data());
+        }
+
+        set_partition_borders(new_mode, new_borders.data());
+        init_range();
+        if(debug_print) printf("Rebalanced %lld points, migrated %lld\n", total_count, total_migrated);
+
+        time_end("rebalance");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+        return total_migrated;
 #else
-        parlay::sequence<uint32_t> needs_further_processing_idx;
-        time_nested("first round", [&]() {
-            time_nested("taskgen", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    this->target_dpu[i] = key_to_dpu_id(coord_to_key(&(vec_input[i])));
-                });
+        return 0;
+#endif
+    }
+
+    /*
+        Exact membership queries, in one DPU round and in any DPU binary.
+        Set pim_zd_tree::length to be the number of points, and put them in pim_zd_tree::vector_input.
+        pim_zd_tree::i64_io[i] is 1 if a point equal to vec_input[i] is stored, else 0.
+        With POINT_PAYLOAD_ON, pim_zd_tree::payload_output[i] receives the payload of one stored copy.
+    */
+    void contains(vectorT *vec_input = nullptr) {
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("contains");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        IO_Manager *io;
+        IO_Task_Batch *lookup_batch;
+
+        time_nested("taskgen", [&]() {
+            io = alloc_io_manager();
+            io->init();
+            lookup_batch = point_lookup_taskgen(io, this->length, vec_input, this->target_dpu, this->op_taskpos);
+        });
+        time_nested("exec", [&](){ASSERT(io->exec());});
+        time_nested("get result", [&]() {
+            point_lookup_result(lookup_batch, this->length, this->target_dpu, this->op_taskpos, this->i64_io
+                                PAYLOAD_ARG(this->payload_output));
+            io->reset();
+        });
+
+        time_end("contains");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+    }
+
+    /* 
+        Box range queries. Return the number of existing points in the queried box, or fetch them.
+        count_or_fetch = true, return the counted numbers; false, fetch the points.
+        Set pim_zd_tree::length to be the number of boxes.
+        Put a vector pair in pim_zd_tree::vector_input as box boundaries.
+        Counts are approximate when approx_budget > 0 or approx_depth > 0: every DPU expands at most approx_budget nodes
+        (no limit if <= 0) above depth approx_depth (no limit if <= 0) and estimates the rest by volume, which bounds its work per box.
+        The estimates then go to pim_zd_tree::i64_io as exact counts, followed by the lower and upper bounds as in box_count_approx_result.
+    */
+    void box_range(bool count_or_fetch = true, int expected_length = 100, vectorT *vec_input = nullptr, int approx_budget = 0, int approx_depth = 0) {
+#if (defined BOX_RANGE_FETCH_ON) || (defined BOX_RANGE_COUNT_ON)
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("box");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        parlay::sequence<int> box_dpu_num;
+        int total_query_num;
+        IO_Manager *io;
+        IO_Task_Batch *box_batch;
+#ifdef BOX_RANGE_COUNT_ON
+        bool approx = count_or_fetch && (approx_budget > 0 || approx_depth > 0);
+        if(approx) ASSERT(this->length * 3 <= (int64_t)BATCH_SIZE * KEY_WORDS);
+#endif
+        
+        time_nested("taskgen", [&]() {
+            io = alloc_io_manager();
+            io->init();
+#ifdef BOX_RANGE_COUNT_ON
+            if(approx) {
+                box_batch = box_count_approx_taskgen(io, this->length, vec_input, (approx_budget > 0 ? approx_budget : INT32_MAX), approx_depth,
+                                                     this->target_dpu, this->op_taskpos, box_dpu_num, total_query_num);
+            }
+            else
+#endif
+            {
+                box_batch = box_taskgen(io, count_or_fetch, expected_length, this->length, vec_input,
+                                        this->target_dpu, this->op_taskpos, box_dpu_num, total_query_num);
+            }
+        });
+        box_query_num += this->length;
+        box_dpu_task_num += total_query_num;
+
+        time_nested("exec", [&](){ASSERT(io->exec());});
+        time_nested("get result", [&]() {
+#ifdef BOX_RANGE_COUNT_ON
+            if(approx) {
+                box_count_approx_result(box_batch, this->length, box_dpu_num, total_query_num,
+                                        this->target_dpu, this->op_taskpos, this->i64_io);
+            }
+            else
+#endif
+            {
+                box_result(box_batch, count_or_fetch, this->length, box_dpu_num, total_query_num,
+                           this->target_dpu, this->op_taskpos, this->i64_io, this->vector_output PAYLOAD_ARG(this->payload_output));
+            }
+            io->reset();
+        });
+
+        time_end("box");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Box aggregate queries: count, coordinate sums, centroid and tight bounding box of the points in each box.
+        Set pim_zd_tree::length to be the number of boxes, and put the box boundaries in pim_zd_tree::vector_input as in box_range.
+        Counts go to pim_zd_tree::i64_io, and the other results to pim_zd_tree::vector_output as in box_aggregate_result.
+        Sums (and centroids) are int64_t and may wrap with KEY_128_BIT_ON coordinates, see BNODE_AGGREGATE_ON.
+    */
+    void box_aggregate(vectorT *vec_input = nullptr) {
+#ifdef BOX_RANGE_COUNT_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("box_aggregate");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        ASSERT(this->length * 4 <= BATCH_SIZE);
+        parlay::sequence<int> box_dpu_num;
+        int total_query_num;
+        IO_Manager *io;
+        IO_Task_Batch *batch;
+
+        time_nested("taskgen", [&]() {
+            io = alloc_io_manager();
+            io->init();
+            batch = box_aggregate_taskgen(io, this->length, vec_input, this->target_dpu, this->op_taskpos, box_dpu_num, total_query_num);
+        });
+        box_query_num += this->length;
+        box_dpu_task_num += total_query_num;
+
+        time_nested("exec", [&](){ASSERT(io->exec());});
+        time_nested("get result", [&]() {
+            box_aggregate_result(batch, this->length, box_dpu_num, total_query_num,
+                                 this->target_dpu, this->op_taskpos, this->i64_io, this->vector_output);
+            io->reset();
+        });
+
+        time_end("box_aggregate");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Box range fetch without a bound on the result size.
+        Set pim_zd_tree::length to be the number of boxes, and put the box boundaries in pim_zd_tree::vector_input as in box_range.
+        Each DPU returns at most chunk_length points per box and round (LEAF_SIZE at least), and a cursor to resume from.
+        on_chunk(i, vecs, len) is called sequentially for every non-empty chunk of box i, with the payloads after vecs
+        when POINT_PAYLOAD_ON. The chunks point into the reply buffers, which are only valid during the call.
+        Return the total number of fetched points.
+    */
+    template <class F>
+    int64_t box_fetch_stream(int chunk_length, F on_chunk, vectorT *vec_input = nullptr) {
+#ifdef BOX_RANGE_FETCH_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("box_stream");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        if(chunk_length < LEAF_SIZE) chunk_length = LEAF_SIZE;
+        parlay::sequence<int> box_dpu_num;
+        int total_query_num;
+        parlay::sequence<int64_t> query_seq;
+        IO_Manager *io;
+        IO_Task_Batch *batch;
+        int64_t total_return_num = 0;
+
+        time_nested("taskgen", [&]() {
+            query_seq = box_route(this->length, vec_input, this->target_dpu, box_dpu_num, total_query_num);
+        });
+        box_query_num += this->length;
+        box_dpu_task_num += total_query_num;
+
+        // Routed tasks still to fetch from, with their cursors. A round returns at most BATCH_SIZE points, as box_range.
+        auto active = parlay::tabulate(total_query_num, [&](size_t i) { return (int)i; });
+        auto cursors = parlay::sequence<KEY_TYPE>(total_query_num, INVALID_KEY);
+        auto more = parlay::sequence<bool>(total_query_num);
+        int64_t round_capacity = std::max((int64_t)1, (int64_t)(BATCH_SIZE / chunk_length));
+        while(!active.empty()) {
+            int64_t m = std::min((int64_t)active.size(), round_capacity);
+            auto round_dpu = parlay::tabulate(m, [&](size_t i) { return this->target_dpu[active[i]]; });
+            auto round_pos = parlay::sequence<int32_t>(m);
+            time_nested("round", [&]() {
                 io = alloc_io_manager();
                 io->init();
-                knn_batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_TSK, sizeof(knn_task), KNN_REP_SIZE(knn_k));
-                knn_batch->push_task_from_array_by_isort<false>(
-                    this->length,
+                batch = io->alloc_task_batch(direct, fixed_length, variable_length, BOX_FETCH_STREAM_TSK,
+                                             sizeof(Box_fetch_stream_task), BOX_FETCH_STREAM_REP_SIZE(chunk_length));
+                batch->push_task_from_array_by_isort<false>(
+                    m,
                     [&](size_t i) {
-                        knn_task tsk;
-                        tsk.k = knn_k;
-                        tsk.center = vec_input[i];
+                        Box_fetch_stream_task tsk;
+                        int64_t q = query_seq[active[i]];
+                        tsk.vec_min = vec_input[q << 1];
+                        tsk.vec_max = vec_input[(q << 1) + 1];
+                        tsk.cursor = cursors[active[i]];
+                        tsk.limit = chunk_length;
                         return tsk;
                     },
-                    parlay::make_slice(this->target_dpu, this->target_dpu + this->length),
-                    parlay::make_slice(this->op_taskpos, this->op_taskpos + this->length)
+                    parlay::make_slice(round_dpu.data(), round_dpu.data() + m),
+                    parlay::make_slice(round_pos.data(), round_pos.data() + m)
                 );
                 io->finish_task_batch();
+                ASSERT(io->exec());
+                for(int64_t i = 0; i < m; i++) {
+                    Box_fetch_stream_reply *rep = (Box_fetch_stream_reply*)batch->ith(round_dpu[i], round_pos[i]);
+                    cursors[active[i]] = rep->cursor;
+                    more[active[i]] = (rep->more != 0);
+                    total_return_num += rep->len;
+                    if(rep->len > 0) {
+                        on_chunk(query_seq[active[i]], (const vectorT*)rep->v, rep->len
+                                 PAYLOAD_ARG((const PAYLOAD_TYPE*)(rep->v + rep->len)));
+                    }
+                }
+                io->reset();
+            });
+            // The tasks not sent yet go first, followed by the ones to resume
+            int64_t k = active.size();
+            auto next_idx = parlay::pack_index<int64_t>(
+                parlay::delayed_tabulate(k, [&](size_t i)->bool {
+                    int64_t j = (i + m) % k;
+                    return j >= m || more[active[j]];
+                })
+            );
+            active = parlay::tabulate(next_idx.size(), [&](size_t i) { return active[(next_idx[i] + m) % k]; });
+        }
+
+        time_end("box_stream");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+        return total_return_num;
+#else
+        return 0;
+#endif
+    }
+
+    /* 
+        Ball range queries. Count or fetch the existing points within radius of a center, like box_range.
+        Set pim_zd_tree::length to be the number of balls, and put the centers in pim_zd_tree::vector_input.
+        The radii, in vector_norm units (squared for L2), are read from radius_input, or from pim_zd_tree::i64_io if it is null.
+    */
+    void ball_range(bool count_or_fetch = true, int expected_length = 100, vectorT *vec_input = nullptr, int64_t *radius_input = nullptr) {
+#if (defined BOX_RANGE_FETCH_ON) || (defined BOX_RANGE_COUNT_ON)
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("ball");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        parlay::sequence<int64_t> radius_seq;
+        parlay::sequence<int> box_dpu_num;
+        int total_query_num;
+        IO_Manager *io;
+        IO_Task_Batch *ball_batch;
+
+        time_nested("taskgen", [&]() {
+            // i64_io also receives the results
+            if(radius_input == nullptr) radius_seq = parlay::sequence<int64_t>(this->i64_io, this->i64_io + this->length);
+            else radius_seq = parlay::sequence<int64_t>(radius_input, radius_input + this->length);
+            io = alloc_io_manager();
+            io->init();
+            ball_batch = ball_taskgen(io, count_or_fetch, expected_length, this->length, vec_input, radius_seq.data(),
+                                      this->target_dpu, this->op_taskpos, box_dpu_num, total_query_num);
+        });
+        box_query_num += this->length;
+        box_dpu_task_num += total_query_num;
+
+        time_nested("exec", [&](){ASSERT(io->exec());});
+        time_nested("get result", [&]() {
+            box_result(ball_batch, count_or_fetch, this->length, box_dpu_num, total_query_num,
+                       this->target_dpu, this->op_taskpos, this->i64_io, this->vector_output PAYLOAD_ARG(this->payload_output));
+            io->reset();
+        });
+
+        time_end("ball");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+#ifdef KNN_ON
+    /* Both kNN rounds, with the first-round radii in radius. k_offsets as in knn_first_round_taskgen, and eps and fanout_budget as in knn. */
+    void knn_rounds(int knn_k, vectorT *vec_input, double eps, int fanout_budget, int64_t *k_offsets, int64_t *radius) {
+        IO_Manager *io;
+        IO_Task_Batch *knn_batch;
+        IO_Task_Batch *class_batches[KNN_K_CLASS_NUM];
+
+        parlay::sequence<uint32_t> needs_further_processing_idx;
+        time_nested("first round", [&]() {
+            time_nested("taskgen", [&]() {
+                io = alloc_io_manager();
+                io->init();
+                knn_batch = knn_first_round_taskgen(io, knn_k, this->length, vec_input, this->target_dpu, this->op_taskpos,
+                                                    k_offsets, class_batches);
             });
+            knn_query_num += this->length;
+            knn_dpu_task_num += this->length;
             time_nested("exec", [&](){ASSERT(io->exec());});
             time_nested("get result", [&]() {
-                parfor_wrap(0, this->length, [&](size_t i) {
-                    knn_reply *rep = (knn_reply*)knn_batch->ith(this->target_dpu[i], this->op_taskpos[i]);
-                    this->i64_io[i] = rep->len;
-                    memcpy(this->vector_output + i * knn_k, rep->v, S64(MULTIPLY_NR_DIMENSION(knn_k)));
-                });
+                needs_further_processing_idx = knn_first_round_result(knn_batch, knn_k, this->length, vec_input,
+                                                                      this->target_dpu, this->op_taskpos, this->vector_output
+                                                                      PAYLOAD_ARG(this->payload_output), radius, k_offsets, class_batches);
                 io->reset();
-                needs_further_processing_idx = parlay::pack_index<uint32_t>(
-                    parlay::delayed_tabulate(this->length, [&](size_t i)->bool {
-                        return (this->i64_io[i] >= 0);
-                    })
-                );
             });
+            if(eps > 0 || fanout_budget >= 0) {
+                time_nested("approx filter", [&]() {
+                    needs_further_processing_idx = knn_approx_filter(vec_input, needs_further_processing_idx, radius, eps, fanout_budget);
+                });
+            }
         });
 
-        int needs_further_processing_knn_num = needs_further_processing_idx.size();
-        if(needs_further_processing_knn_num > 0) {
+        if(needs_further_processing_idx.size() > 0) {
             time_nested("second round", [&]() {
                 parlay::sequence<int> box_dpu_num;
                 int total_return_num;
 
                 time_nested("taskgen", [&]() {
-                    parlay::sequence<box_dpu_id> box_idx(needs_further_processing_knn_num);
-                    box_dpu_num = parlay::tabulate(needs_further_processing_knn_num, [&](size_t i) {
-                        vectorT vec;
-                        uint64_t key1, key2;
-                        int64_t radius = this->i64_io[needs_further_processing_idx[i]];
-#if LX_NORM == 2
-                        radius = (int64_t)sqrt(radius);
-#endif
-                        vector_ones(&vec, radius);
-                        vec = vector_sub_zero_bounded(&(vec_input[needs_further_processing_idx[i]]), &vec);
-                        key1 = coord_to_key(&vec);
-                        vector_ones(&vec, radius);
-                        vec = vector_add(&(vec_input[needs_further_processing_idx[i]]), &vec);
-                        key2 = coord_to_key(&vec);
-                        box_idx[i].set_litmin_bigmax(key_to_dpu_id(key1), key_to_dpu_id(key2));
-                        auto box_split_res = box_split(key1, key2);
-                        box_idx[i].set_litmax_bigmin(
-                            key_to_dpu_id(box_split_res.first),
-                            key_to_dpu_id(box_split_res.second)
-                        );
-                        return box_idx[i].size() - 1;
-                    });
-                    total_return_num = parlay::scan_inplace(box_dpu_num);
-
                     io = alloc_io_manager();
                     io->init();
-                    knn_batch = io->alloc_task_batch(direct, fixed_length, variable_length, KNN_BOUNDED_TSK, sizeof(knn_bounded_task), KNN_REP_SIZE(knn_k));
-                    parfor_wrap(0, needs_further_processing_knn_num, [&](size_t i) {
-                        vectorT vec = vec_input[needs_further_processing_idx[i]];
-                        int this_dpu_idx = key_to_dpu_id(coord_to_key(&vec));
-                        int start_idx = box_dpu_num[i];
-                        int j;
-                        knn_bounded_task *tsk;
-                        if(box_idx[i].litmax < box_idx[i].bigmin) {
-                            for(j = box_idx[i].litmin; j <= box_idx[i].litmax; j++) {
-                                if(j == this_dpu_idx) {
-                                    continue;
-                                }
-                                this->target_dpu[start_idx] = j;
-                                tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                    j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                                );
-                                tsk->k = knn_k;
-                                tsk->center = vec;
-                                tsk->radius = this->i64_io[needs_further_processing_idx[i]];
-                                start_idx++;
-                            }
-                            for(j = box_idx[i].bigmin; j <= box_idx[i].bigmax; j++) {
-                                if(j == this_dpu_idx) {
-                                    continue;
-                                }
-                                this->target_dpu[start_idx] = j;
-                                tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                    j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                                );
-                                tsk->k = knn_k;
-                                tsk->center = vec;
-                                tsk->radius = this->i64_io[needs_further_processing_idx[i]];
-                                start_idx++;
-                            }
-                        }
-                        else {
-                            for(j = box_idx[i].litmin; j <= box_idx[i].bigmax; j++) {
-                                if(j == this_dpu_idx) {
-                                    continue;
-                                }
-                                this->target_dpu[start_idx] = j;
-                                tsk = (knn_bounded_task*)knn_batch->push_task_zero_copy(
-                                    j, sizeof(knn_bounded_task), true, this->op_taskpos + start_idx
-                                );
-                                tsk->k = knn_k;
-                                tsk->center = vec;
-                                tsk->radius = this->i64_io[needs_further_processing_idx[i]];
-                                start_idx++;
-                            }
-                        }
-                    });
-                    io->finish_task_batch();
+                    knn_batch = knn_second_round_taskgen(io, knn_k, vec_input, needs_further_processing_idx, radius,
+                                                         this->target_dpu, this->op_taskpos, box_dpu_num, total_return_num,
+                                                         k_offsets, class_batches);
                 });
+                knn_dpu_task_num += total_return_num;
                 time_nested("exec", [&](){ASSERT(io->exec());});
                 time_nested("get result", [&]() {
-                    parfor_wrap(0, needs_further_processing_knn_num, [&](size_t i) {
-                        heap_host heap(knn_k);
-                        vectorT center = vec_input[needs_further_processing_idx[i]];
-                        vectorT vec, *vec_pt;
-                        int64_t distance;
-                        int j;
-                        for(j = 0; j < knn_k; j++) {
-                            vec_pt = &(this->vector_output[j + knn_k * needs_further_processing_idx[i]]);
-                            vec = vector_sub(&center, vec_pt);
-                            distance = vector_norm(&vec);
-                            heap.enqueue(distance, vec_pt);
-                        }
-                        int end_idx = (i == needs_further_processing_knn_num - 1 ? total_return_num : box_dpu_num[i + 1]);
-                        knn_reply *rep;
-                        for(j = box_dpu_num[i]; j < end_idx; j++) {
-                            rep = (knn_reply*)knn_batch->ith(this->target_dpu[j], this->op_taskpos[j]);
-                            for(int k = 0; k < rep->len; k++) {
-                                vec_pt = &(rep->v[k]);
-                                vec = vector_sub(&center, vec_pt);
-                                distance = vector_norm(&vec);
-                                heap.enqueue(distance, vec_pt);
-                            }
-                        }
-                        memcpy(this->vector_output + knn_k * needs_further_processing_idx[i], heap.vector_storage, S64(MULTIPLY_NR_DIMENSION(knn_k)));
-                    });
+                    knn_second_round_result(knn_batch, knn_k, vec_input, needs_further_processing_idx, box_dpu_num, total_return_num,
+                                            this->target_dpu, this->op_taskpos, this->vector_output PAYLOAD_ARG(this->payload_output),
+                                            k_offsets, class_batches);
                     io->reset();
                 });
             });
         }
+    }
+#endif
+
+    /*
+        kNN queries. Set pim_zd_tree::length to be the number of queries, and put the centers in pim_zd_tree::vector_input.
+        The neighbours of query i go to pim_zd_tree::vector_output[knn_k * i, knn_k * (i + 1)).
+        eps > 0 or fanout_budget >= 0 trade exactness for fewer second-round tasks, as in knn_approx_filter:
+        k-th distances within (1 + eps) of the exact ones skip the second round, and at most fanout_budget other DPUs
+        are searched per query. eps = 0 with fanout_budget = -1 is exact.
+    */
+    void knn(int knn_k = 10, vectorT *vec_input = nullptr, double eps = 0, int fanout_budget = -1) {
+#ifdef KNN_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("knn");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        knn_rounds(knn_k, vec_input, eps, fanout_budget, nullptr, this->i64_io);
+
+        time_end("knn");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
 #endif
+    }
+
+    /*
+        kNN queries with a k per query, in [1, MAX_KNN_SIZE], read from k_input or from pim_zd_tree::i64_io if it is null.
+        The results are packed: the neighbours of query i go to pim_zd_tree::vector_output[i64_io[i], i64_io[i + 1])
+        (payloads to the same positions of pim_zd_tree::payload_output), and the total to i64_io[length].
+        Queries are batched by reply class of k, so small k do not reserve the reply buffers of large k.
+        eps and fanout_budget as in knn.
+    */
+    void knn_per_query_k(int64_t *k_input = nullptr, vectorT *vec_input = nullptr, double eps = 0, int fanout_budget = -1) {
+#ifdef KNN_ON
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("knn");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        if(k_input == nullptr) k_input = this->i64_io;
+        parlay::sequence<int64_t> k_offsets = parlay::tabulate(this->length + 1, [&](size_t i) -> int64_t {
+            return (i < (size_t)this->length ? k_input[i] : 0);
+        });
+        parlay::sequence<int64_t> radius(this->length);
+        parfor_wrap(0, this->length, [&](size_t i) {
+            ASSERT(k_offsets[i] >= 1 && k_offsets[i] <= MAX_KNN_SIZE);
+        });
+        int64_t total_k = parlay::scan_inplace(k_offsets);
+        ASSERT(total_k <= BATCH_SIZE && this->length < (int64_t)BATCH_SIZE * KEY_WORDS);
+        knn_rounds(0, vec_input, eps, fanout_budget, k_offsets.data(), radius.data());
+        parfor_wrap(0, this->length + 1, [&](size_t i) {
+            this->i64_io[i] = k_offsets[i];
+        });
+
         time_end("knn");
         cpu_coverage_timer->end();
         this->epoch_num++;
 #endif
     }
 
-    void search_maximum_match(bool print_res = false, bool debug_fetch = false, bool debug_print = false, uint64_t default_key = 0) {
+    /*
+        Mixed batch of inserts, box counts and kNN queries, packed into two DPU launches instead of
+        one or two launches per operation type. Requires the unified DPU binary, since the blocks of
+        one launch are served by the same program.
+        Put insert_num points, then box_num box boundary pairs, then knn_num kNN centers in
+        pim_zd_tree::vector_input.
+        Blocks run in order on each DPU, and the insert block is the last block of the last launch,
+        so every query of the batch observes the tree as it was before the batch.
+        Box counts are returned in pim_zd_tree::i64_io[0, box_num), and the kNN results of query i
+        in pim_zd_tree::vector_output[knn_k * i, knn_k * (i + 1)).
+        With POINT_PAYLOAD_ON, insert point i carries pim_zd_tree::payload_input[i], and the kNN result payloads
+        are returned in pim_zd_tree::payload_output.
+    */
+    void execute_mixed(int64_t insert_num, int64_t box_num, int64_t knn_num, int knn_k = 10, vectorT *vec_input = nullptr) {
+#if (defined INSERT_NODE_ON) && (defined BOX_RANGE_COUNT_ON) && (defined KNN_ON)
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("mixed");
+
+        if(vec_input == nullptr) vec_input = this->vector_input;
+        mixed_batch mb;
+        mb.op_addrs = this->op_addrs;
+        mb.op_taskpos = this->op_taskpos;
+        mb.target_dpu = this->target_dpu;
+        mb.i64_io = this->i64_io;
+        mb.vector_output = this->vector_output;
+#ifdef POINT_PAYLOAD_ON
+        mb.payload_output = this->payload_output;
+#endif
+        mixed_batch_init(mb, insert_num, box_num, knn_num, knn_k, vec_input PAYLOAD_ARG(this->payload_input));
+
+        time_nested("first launch", [&]() {
+            time_nested("taskgen", [&]() {mixed_first_taskgen(mb);});
+            time_nested("exec", [&](){ASSERT(mb.io->exec());});
+            time_nested("get result", [&]() {mixed_first_result(mb);});
+        });
+        if(mixed_needs_second_launch(mb)) {
+            time_nested("second launch", [&]() {
+                time_nested("taskgen", [&]() {mixed_second_taskgen(mb);});
+                time_nested("exec", [&](){ASSERT(mb.io->exec());});
+                time_nested("get result", [&]() {mixed_second_result(mb);});
+            });
+        }
+
+        std::atomic_fetch_add(&(this->nr_points), insert_num);
+
+        time_end("mixed");
+        cpu_coverage_timer->end();
+        this->epoch_num++;
+#endif
+    }
+
+    /*
+        Run batch_num mixed batches (see execute_mixed), with batch j read from vec_input + j * (insert_num + 2 * box_num + knn_num).
+        While the DPUs run one launch, the host generates the next batch's first launch or decodes the previous batch's
+        second launch, alternating between two sets of scratch arrays.
+        Batches are applied in order. on_result(j, box_counts, knn_results) is called once batch j is decoded,
+        and its arrays are reused two batches later.
+        With POINT_PAYLOAD_ON, payload_input is indexed like vec_input, and on_result also receives the kNN result payloads.
+    */
+    template <class F>
+    void execute_mixed_pipelined(int batch_num, int64_t insert_num, int64_t box_num, int64_t knn_num, int knn_k, vectorT *vec_input
+                                 PAYLOAD_ARG(PAYLOAD_TYPE *payload_input), F on_result) {
+#if (defined INSERT_NODE_ON) && (defined BOX_RANGE_COUNT_ON) && (defined KNN_ON)
+        print_current_epoch();
+        cpu_coverage_timer->start();
+        time_start("mixed pipeline");
+
+        int64_t batch_input_size = insert_num + (box_num << 1) + knn_num;
+        mixed_batch mb[2];
+        mb[0].op_addrs = this->op_addrs;
+        mb[0].op_taskpos = this->op_taskpos;
+        mb[0].target_dpu = this->target_dpu;
+        mb[0].i64_io = this->i64_io;
+        mb[0].vector_output = this->vector_output;
+#ifdef POINT_PAYLOAD_ON
+        mb[0].payload_output = this->payload_output;
+        auto payload_output_buf = parlay::sequence<PAYLOAD_TYPE>::uninitialized(BATCH_SIZE);
+        mb[1].payload_output = payload_output_buf.data();
+#endif
+        auto op_addrs_buf = parlay::sequence<pptr>::uninitialized(BATCH_SIZE);
+        auto op_taskpos_buf = parlay::sequence<int32_t>::uninitialized(BATCH_SIZE);
+        auto target_dpu_buf = parlay::sequence<int>::uninitialized(BATCH_SIZE);
+        auto i64_io_buf = parlay::sequence<int64_t>::uninitialized((int64_t)BATCH_SIZE * KEY_WORDS);
+        auto vector_output_buf = parlay::sequence<vectorT>::uninitialized(BATCH_SIZE);
+        mb[1].op_addrs = op_addrs_buf.data();
+        mb[1].op_taskpos = op_taskpos_buf.data();
+        mb[1].target_dpu = target_dpu_buf.data();
+        mb[1].i64_io = i64_io_buf.data();
+        mb[1].vector_output = vector_output_buf.data();
+
+        // The batch whose second launch is still running on the DPUs
+        mixed_batch *in_flight = nullptr;
+        int in_flight_id = -1;
+        auto finish_in_flight = [&]() {
+            time_nested("get result", [&]() {mixed_second_result(*in_flight);});
+            on_result(in_flight_id, (const int64_t*)in_flight->i64_io, (const vectorT*)in_flight->vector_output
+                      PAYLOAD_ARG((const PAYLOAD_TYPE*)in_flight->payload_output));
+            in_flight = nullptr;
+        };
+
+        for(int j = 0; j < batch_num; j++) {
+            mixed_batch &cur = mb[j & 1];
+            mixed_batch_init(cur, insert_num, box_num, knn_num, knn_k, vec_input + j * batch_input_size
+                             PAYLOAD_ARG(payload_input + j * batch_input_size));
+            time_nested("first launch", [&]() {
+                time_nested("taskgen", [&]() {mixed_first_taskgen(cur);});
+                if(in_flight != nullptr) time_nested("wait", [&]() {ASSERT(in_flight->io->wait());});
+                time_nested("launch", [&]() {ASSERT(cur.io->exec_async());});
+                if(in_flight != nullptr) finish_in_flight();
+                time_nested("wait", [&]() {ASSERT(cur.io->wait());});
+                time_nested("get result", [&]() {mixed_first_result(cur);});
+            });
+            std::atomic_fetch_add(&(this->nr_points), insert_num);
+            if(mixed_needs_second_launch(cur)) {
+                time_nested("second launch", [&]() {
+                    time_nested("taskgen", [&]() {mixed_second_taskgen(cur);});
+                    time_nested("launch", [&]() {ASSERT(cur.io->exec_async());});
+                });
+                in_flight = &cur;
+                in_flight_id = j;
+            }
+            else {
+                on_result(j, (const int64_t*)cur.i64_io, (const vectorT*)cur.vector_output PAYLOAD_ARG((const PAYLOAD_TYPE*)cur.payload_output));
+            }
+        }
+        if(in_flight != nullptr) {
+            time_nested("second launch", [&]() {
+                time_nested("wait", [&]() {ASSERT(in_flight->io->wait());});
+                finish_in_flight();
+            });
+        }
+
+        time_end("mixed pipeline");
+        cpu_coverage_timer->end();
+        this->epoch_num += batch_num;
+#endif
+    }
+
+    void search_maximum_match(bool print_res = false, bool debug_fetch = false, bool debug_print = false, KEY_TYPE default_key = KEY_ZERO) {
 #ifdef SEARCH_TEST_ON
         print_current_epoch();
         cpu_coverage_timer->start();
         time_start("search max match");
 
-        parlay::sequence<uint64_t> key_seq, return_seq;
+        parlay::sequence<KEY_TYPE> key_seq, return_seq;
         IO_Manager *io;
         IO_Task_Batch *single_key_search_batch;
 
         time_nested("taskgen", [&]() {
             key_seq = parlay::tabulate(this->length, [&](size_t i){ return coord_to_key(&(this->vector_input[i])); });
-            parfor_wrap(0, this->length, [&](size_t i){ this->target_dpu[i] = key_to_dpu_id(key_seq[i]); });
+            parfor_wrap(0, this->length, [&](size_t i){ this->target_dpu[i] = key_to_dpu_id(key_prefix(key_seq[i])); });
             io = alloc_io_manager();
             io->init();
             single_key_search_batch = io->alloc<Single_key_search_task, Single_key_search_reply>(direct);
@@ -776,7 +2007,7 @@ public:
             cout<<"------------ Search Results --------------"<<endl;
             int match_num = 0;
             for(int i = 0; i < this->length; i++) {
-                if(key_seq[i] == return_seq[i]) match_num++;
+                if(key_equal(key_seq[i], return_seq[i])) match_num++;
                 else cout<<hex<<key_seq[i]<<" "<<return_seq[i]<<endl;
             }
             cout<<"Match Num: "<<dec<<match_num<<"; Unmatch Num: "<<(this->length - match_num)<<endl;
@@ -786,11 +2017,11 @@ public:
         if(debug_fetch) {
             time_start("fetch node");
             auto idx_seq = parlay::pack_index<uint32_t>(parlay::delayed_tabulate(this->length, [&](size_t i) {
-                return key_seq[i] != return_seq[i] && key_seq[i] != default_key;
+                return !key_equal(key_seq[i], return_seq[i]) && !key_equal(key_seq[i], default_key);
             }));
             int tmp_length = idx_seq.size();
             auto target_dpu_seq = parlay::tabulate(tmp_length, [&](size_t i){
-                return (size_t)key_to_dpu_id(key_seq[idx_seq[i]]);
+                return (size_t)key_to_dpu_id(key_prefix(key_seq[idx_seq[i]]));
             });
             if(debug_print) for(int i = 0; i < tmp_length; i++) cout<<key_seq[idx_seq[i]]<<" "<<target_dpu_seq[i]<<endl;
             parlay::integer_sort_inplace(target_dpu_seq);
@@ -828,6 +2059,8 @@ public:
             });
             for(int i = 0; i < tmp_length; i++) {
                 cout<<"DPU: "<<this->target_dpu[i]<<"; Bcnt: "<<dpu_stats_return_seq[i].bcnt<<"; Pcnt: "<<dpu_stats_return_seq[i].pcnt;
+                cout<<"; Bfree: "<<dpu_stats_return_seq[i].bfree<<"; Pfree: "<<dpu_stats_return_seq[i].pfree;
+                cout<<"; Bslab unused: "<<dpu_stats_return_seq[i].bslab_unused<<"; Pslab unused: "<<dpu_stats_return_seq[i].pslab_unused;
                 cout<<endl;
             }
             
@@ -890,6 +2123,7 @@ public:
             if(print_res) {
                 cout<<"------------ Fetch Results --------------"<<endl;
                 for(int i = 0; i < total_node_to_fetch; i++) {
+                    if(!valid_pptr(fetch_return_seq[i].addr)) continue;  // Free or unused slot
                     cout<<"*********************"<<endl;
                     cout<<dec<<"Target Addr: "; cout_pptr(pptr_seq_tmp[i]);
                     cout<<"Node key: "<<hex<<fetch_return_seq[i].key<<"; Height: "<<dec<<fetch_return_seq[i].height<<endl;
@@ -901,7 +2135,8 @@ public:
                     }
                     else if(pptr_seq_tmp[i].data_type == B_NODE_DATA_TYPE) {
                         for(int j = 0; j < DB_SIZE; j++) {
-                            pptr tmp_addr = I64_TO_PPTR(fetch_return_seq[i].keys[j]);
+                            uint64_t child = key_prefix(fetch_return_seq[i].keys[j]);
+                            pptr tmp_addr = I64_TO_PPTR(child);
                             if(valid_pptr(tmp_addr)) {
                                 cout<<dec<<j<<": ";
                                 cout_pptr(tmp_addr);
@@ -935,7 +2170,7 @@ public:
             time_nested("DPU stats", [&]() {
                 time_nested("taskgen", [&]() {
                     parfor_wrap(0, tmp_length, [&](size_t i) {
-                        uint64_t key = coord_to_key(&(this->vector_input[i]));
+                        uint64_t key = key_prefix(coord_to_key(&(this->vector_input[i])));
                         this->target_dpu[i] = key_to_dpu_id(key);
                     });
                     io = alloc_io_manager();
@@ -962,6 +2197,8 @@ public:
             });
             for(int i = 0; i < tmp_length; i++) {
                 cout<<"DPU: "<<this->target_dpu[i]<<"; Bcnt: "<<dpu_stats_return_seq[i].bcnt<<"; Pcnt: "<<dpu_stats_return_seq[i].pcnt;
+                cout<<"; Bfree: "<<dpu_stats_return_seq[i].bfree<<"; Pfree: "<<dpu_stats_return_seq[i].pfree;
+                cout<<"; Bslab unused: "<<dpu_stats_return_seq[i].bslab_unused<<"; Pslab unused: "<<dpu_stats_return_seq[i].pslab_unused;
                 cout<<endl;
             }
             
@@ -1025,6 +2262,7 @@ public:
             if(print_res) {
                 cout<<"------------ Fetch Results --------------"<<endl;
                 for(int i = 0; i < total_node_to_fetch; i++) {
+                    if(!valid_pptr(fetch_return_seq[i].addr)) continue;  // Free or unused slot
                     cout<<"*********************"<<endl;
                     cout<<dec<<"Target Addr: "; cout_pptr(pptr_seq_tmp[i]);
                     cout<<"Node key: "<<hex<<fetch_return_seq[i].key<<"; Height: "<<dec<<fetch_return_seq[i].height<<endl;
@@ -1036,7 +2274,8 @@ public:
                     }
                     else if(pptr_seq_tmp[i].data_type == B_NODE_DATA_TYPE) {
                         for(int j = 0; j < DB_SIZE; j++) {
-                            pptr tmp_addr = I64_TO_PPTR(fetch_return_seq[i].keys[j]);
+                            uint64_t child = key_prefix(fetch_return_seq[i].keys[j]);
+                            pptr tmp_addr = I64_TO_PPTR(child);
                             if(valid_pptr(tmp_addr)) {
                                 cout<<dec<<j<<": ";
                                 cout_pptr(tmp_addr);
@@ -1054,4 +2293,8 @@ public:
 
 };
 
-atomic<int64_t> pim_zd_tree::nr_points = atomic<int64_t>(0);
\ No newline at end of file
+atomic<int64_t> pim_zd_tree::nr_points = atomic<int64_t>(0);
+atomic<int64_t> pim_zd_tree::box_query_num = atomic<int64_t>(0);
+atomic<int64_t> pim_zd_tree::box_dpu_task_num = atomic<int64_t>(0);
+atomic<int64_t> pim_zd_tree::knn_query_num = atomic<int64_t>(0);
+atomic<int64_t> pim_zd_tree::knn_dpu_task_num = atomic<int64_t>(0);
@@ -4,6 +4,7 @@
 /* -------------------------- Switches to enable tasks -------------------------- */
 #define DPU_INIT_ON
 #define INSERT_NODE_ON
+#define DELETE_NODE_ON
 #define BOX_RANGE_COUNT_ON
 #define BOX_RANGE_FETCH_ON
 #define KNN_ON
@@ -0,0 +1,90 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+#include <parlay/primitives.h>
+#include "task_utils.hpp"
+#include "dpu_ctrl.hpp"
+#include "utils.hpp"
+
+/* Levels of B nodes replicated on the host, counting the root of each DPU */
+#define HOST_TOP_CACHE_LEVELS (3)
+/* Replicated nodes per DPU, the root included */
+#define HOST_TOP_CACHE_SIZE_PER_DPU (1 + DB_SIZE + DB_SIZE * DB_SIZE)
+
+/*
+    Host replica of the upper B node levels of every DPU, used to route inserts without a search round.
+    B nodes keep their key and height once created, so a cached node stays on the path of the same keys
+    until nodes are freed or moved. Deletion and compaction therefore reset the replica.
+    Cached child links may skip B nodes created later in between, which only makes routing stop higher.
+*/
+class host_top_cache {
+public:
+    struct cache_node {
+        pptr addr;
+        KEY_TYPE key;
+        int32_t height;
+        int32_t depth;
+        int32_t children[DB_SIZE];  // Index of the cached child, or -1
+    };
+
+    cache_node *nodes;
+    std::atomic<int64_t> node_num;
+    int64_t capacity;
+
+    host_top_cache() {
+        this->capacity = (int64_t)NR_DPUS * HOST_TOP_CACHE_SIZE_PER_DPU;
+        this->nodes = new cache_node[this->capacity];
+        this->node_num = 0;
+    }
+
+    ~host_top_cache() {
+        delete [] this->nodes;
+    }
+
+    /* Keep only the roots, which never move: node i is the root of DPU i */
+    void reset() {
+        parfor_wrap(0, nr_of_dpus, [&](size_t i) {
+            cache_node &node = this->nodes[i];
+            node.addr = (pptr){.data_type = B_NODE_DATA_TYPE, .info = 0, .id = (uint16_t)i, .addr = 0};
+            node.key = KEY_ZERO;
+            node.height = 0;
+            node.depth = 0;
+            for(int j = 0; j < DB_SIZE; j++) node.children[j] = -1;
+        });
+        this->node_num = nr_of_dpus;
+    }
+
+    /* Return the deepest cached node on the path of the key, with the child slot to follow in pptr::info */
+    pptr route(KEY_TYPE key, int dpu_id, int32_t &node_idx) {
+        cache_node *node = this->nodes + dpu_id;
+        node_idx = dpu_id;
+        int idx, child;
+        while(true) {
+            idx = lookup_next_bit_chunk(key, node->height);
+            child = node->children[idx];
+            if(child < 0 || !check_match_height(key, this->nodes[child].key, this->nodes[child].height)) break;
+            node = this->nodes + child;
+            node_idx = child;
+        }
+        pptr addr = node->addr;
+        addr.info = (int8_t)idx;
+        return addr;
+    }
+
+    /* Cache a B node found in the child slot of a cached node. The first report of a slot wins. */
+    void add_child(int32_t parent_idx, int idx, pptr addr, KEY_TYPE key, int32_t height) {
+        cache_node &parent = this->nodes[parent_idx];
+        if(parent.depth + 1 >= HOST_TOP_CACHE_LEVELS || parent.children[idx] >= 0) return;
+        int64_t pos = this->node_num.fetch_add(1);
+        if(pos >= this->capacity) return;
+        cache_node &node = this->nodes[pos];
+        node.addr = addr;
+        node.addr.info = 0;
+        node.key = key;
+        node.height = height;
+        node.depth = parent.depth + 1;
+        for(int j = 0; j < DB_SIZE; j++) node.children[j] = -1;
+        __sync_bool_compare_and_swap(&(parent.children[idx]), (int32_t)-1, (int32_t)pos);
+    }
+};
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <parlay/primitives.h>
 #include <utility>
+#include <iostream>
 
 #include "utils.h"
 #include "pptr.h"
@@ -15,6 +16,15 @@ static inline int hash_to_dpu(uint64_t key, uint64_t height, uint64_t max_dpu) {
     return v % max_dpu;
 }
 
+#ifdef KEY_128_BIT_ON
+/* Print a 128-bit key as 32 hex digits */
+static inline std::ostream& operator<<(std::ostream &os, const key128 &key) {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016lx%016lx", (unsigned long)key.hi, (unsigned long)key.lo);
+    return os << buf;
+}
+#endif
+
 /* Only check address and data_type */
 static inline bool equal_pptr_weak(pptr &a, pptr &b) {
     return a.addr == b.addr && a.id == b.id && a.data_type == b.data_type;
@@ -64,10 +74,13 @@ static inline void box_boundary_swap(vectorT &box_min, vectorT &box_max) {
 #endif
 }
 
-/* Return the LITMAX and BIGMIN of a box split */
+/*
+    Return the LITMAX and BIGMIN of a box split.
+    Works on the key prefixes of the box corners, which is exact for routing since the DPUs own ranges of prefixes.
+*/
 static inline std::pair<uint64_t, uint64_t> box_split(uint64_t key_min, uint64_t key_max) {
     // Tropf, Hermann and H. Herzog. “Multimensional Range Search in Dynamically Balanced Trees.” Angew. Inform. 23 (1981): 71-77.
-    INT_HEIGHT match_height = maximum_match_height_precise(key_min, key_max);
+    INT_HEIGHT match_height = (key_min == key_max ? 64 : __builtin_clzll(key_min ^ key_max));
     uint64_t split_key = key_max & (UINT64_MAX << (63 - match_height));
     uint64_t litmax = split_key, bigmin = split_key;
     int idx_lookup;
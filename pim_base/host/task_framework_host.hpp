@@ -1013,7 +1013,12 @@ class IO_Manager {
 
     bool successful_send;
 
-    bool exec() {
+    /*
+        Send the tasks and launch the DPUs without waiting for them. The DPU set stays locked until
+        wait(), so the caller may generate or decode other managers' batches in between, but must not
+        execute them.
+    */
+    bool exec_async() {
         ASSERT(tid == worker_id());
         cpu_coverage_timer->end();
         time_nested(string("lock"), [&]() {
@@ -1026,38 +1031,55 @@ class IO_Manager {
         ASSERT(working_manager.load() == nullptr);
         working_manager = this;
 
-        bool successful_send = false;
+        successful_send = false;
         time_nested("send", [&]() {
             successful_send = send_task();
         });
 
-        bool ret = false;
         if (successful_send) {
-            cpu_coverage_timer->end();
             pim_coverage_timer->start();
-            time_nested("dpu", [&]() {
-                DPU_ASSERT(dpu_launch(dpu_set, DPU_ASYNCHRONOUS));
-                while (!dpu_control::ready()) {
-                    std::this_thread::sleep_for(std::chrono::microseconds(100));
-                }
-                time_nested("wait", [&]() { DPU_ASSERT(dpu_sync(dpu_set)); });
-            });
-            pim_coverage_timer->end();
-            cpu_coverage_timer->start();
-
-            time_nested("receive", [&]() {
-                receive_task();
-                // always use these two together, sync receive is SYNCHRONOUS
-                ret = sync();
-            });
+            DPU_ASSERT(dpu_launch(dpu_set, DPU_ASYNCHRONOUS));
+        } else {
             working_manager = nullptr;
+            time_nested(string("unlock"), [&]() {
+                dpu_control::dpu_mutex.unlock();
+            });
         }
+        return successful_send;
+    }
+
+    // Finish an exec_async() that returned true: wait for the DPUs, receive the replies and unlock
+    bool wait() {
+        ASSERT(tid == worker_id());
+        ASSERT(successful_send && working_manager.load() == this);
+        bool ret = false;
+        cpu_coverage_timer->end();
+        time_nested("dpu", [&]() {
+            while (!dpu_control::ready()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            time_nested("wait", [&]() { DPU_ASSERT(dpu_sync(dpu_set)); });
+        });
+        pim_coverage_timer->end();
+        cpu_coverage_timer->start();
+
+        time_nested("receive", [&]() {
+            receive_task();
+            // always use these two together, sync receive is SYNCHRONOUS
+            ret = sync();
+        });
+        successful_send = false;
         working_manager = nullptr;
         time_nested(string("unlock"), [&]() {
             dpu_control::dpu_mutex.unlock();
         });
         return ret;
     }
+
+    bool exec() {
+        if (!exec_async()) return false;
+        return wait();
+    }
 };
 
 bool IO_Manager::using_upmem_interface = true;